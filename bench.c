@@ -0,0 +1,387 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <kga/kga.h>
+#include <kga/scope.h>
+#include <kga/string.h>
+#include <kga/array.h>
+#include "config.h"
+#include "pkg.h"
+#include "pkg_internal.h"
+#include "port.h"
+#include "misc.h"
+#include "kga_wrappers.h"
+#include "profile.h"
+
+exception_type_t bench_incorrect_cmd;
+
+struct bench_config {
+	const char *work_path;
+	char *pkg_path;
+	char *root;
+	char *ports_path;
+	char *pkg_db_path;
+	long int files;
+	long int dirs;
+	long int pkgs;
+	long int pkg_files;
+	long int ports;
+	long int fan_in;
+	const char *shape;
+	long int iterations;
+	FILE *null_stream;
+};
+
+struct bench_driver {
+	const char *name;
+	double (*run)(struct bench_config *config, long int *ops);
+};
+
+static void bench_write_file(const char *path, const char *content) {
+	scope {
+		FILE *file = kga_fopen(path, "w");
+		kga_fprintf(file, "%s", content);
+	};
+};
+
+/* Package tree with config->files regular files spread over config->dirs directories. */
+static void bench_generate_package(struct bench_config *config) {
+	scope {
+		char *path = string_new_fmt("%s/.name", config->pkg_path);
+		kga_mkpath(config->pkg_path, 0755);
+		bench_write_file(path, "bench");
+		string_fmt(path, "%s/.version", config->pkg_path);
+		bench_write_file(path, "1.0-1-bench");
+		for (long int i = 0; i < config->dirs; i++) {
+			string_fmt(path, "%s/usr/share/bench/d%05li", config->pkg_path, i);
+			kga_mkpath(path, 0755);
+		};
+		for (long int i = 0; i < config->files; i++) {
+			string_fmt(path, "%s/usr/share/bench/d%05li/f%07li", config->pkg_path, i % config->dirs, i);
+			bench_write_file(path, "bench\n");
+		};
+	};
+};
+
+/* Installed package database of config->pkgs packages, config->pkg_files files each. */
+static void bench_generate_db(struct bench_config *config) {
+	scope {
+		char *path = string_new();
+		char **lines = array_new(char *, 0, 0);
+		for (long int i = 0; i < config->pkgs; i++) {
+			array_resize(lines, 0);
+			array_push(lines, "usr");
+			array_push(lines, "usr/share");
+			array_push(lines, string_new_fmt("usr/share/p%05li", i));
+			for (long int j = 0; j < config->pkg_files; j++) {
+				array_push(lines, string_new_fmt("usr/share/p%05li/f%07li", i, j));
+			};
+			string_fmt(path, "%s/%s/p%05li", config->root, PKG_DB_DEFAULT_PATH, i);
+			kga_mkpath(path, 0755);
+			string_fmt(path, "%s/%s/p%05li/1.0-1-bench", config->root, PKG_DB_DEFAULT_PATH, i);
+			scope {
+				struct pathlist *files = pkg_pathlist_new(lines, array_length(lines));
+				struct bloom *bloom = pkg_bloom_new(files);
+				FILE *file = kga_fopen(path, "w");
+				kga_fwrite(files->buffer, 1, files->size, file);
+				string_fmt(path, "%s/%s/p%05li/" PKG_DB_BLOOM_NAME, config->root, PKG_DB_DEFAULT_PATH, i, "1.0-1-bench");
+				file = kga_fopen(path, "w");
+				kga_fwrite(bloom->buffer, 1, bloom->size, file);
+			};
+		};
+	};
+};
+
+/* Port tree of config->ports ports, each depending on up to config->fan_in earlier ports:
+ * "chain" depends on the previous port, "wide" on the first ones, "random" on random ones. */
+static void bench_generate_ports(struct bench_config *config) {
+	srand(1);
+	scope {
+		char *path = string_new();
+		char *depends = string_new();
+		char **targets = array_new(char *, 0, 0);
+		for (long int i = 0; i < config->ports; i++) {
+			string_set(depends, "");
+			for (long int j = 1; j <= config->fan_in && j <= i; j++) {
+				long int depend;
+				if (!strcmp(config->shape, "chain")) {
+					depend = i - j;
+				} else if (!strcmp(config->shape, "wide")) {
+					depend = j - 1;
+				} else {
+					depend = rand() % i;
+				};
+				string_fmt(depends, "%s bench/port%05li", depends, depend);
+			};
+			string_fmt(path, "/%s/pkgblds/bench/port%05li", config->ports_path, i);
+			kga_mkpath(path, 0755);
+			string_fmt(path, "/%s/pkgblds/bench/port%05li/build.sh", config->ports_path, i);
+			scope {
+				char *script = string_new_fmt("NAME=port%05li\nVERSION=1.0\nBUILD=1\nDEPENDS='%s'\n", i, depends);
+				bench_write_file(path, script);
+			};
+			array_push(targets, string_new_fmt("bench/port%05li", i));
+		};
+		string_fmt(path, "/%s/targets", config->ports_path);
+		lines_to_file(targets, path);
+	};
+};
+
+static double bench_pkg_load(struct bench_config *config, long int *ops) {
+	long long int start = profile_now();
+	for (long int i = 0; i < config->iterations; i++) {
+		scope {
+			pkg_load(config->pkg_path);
+		};
+	};
+	*ops = config->iterations;
+	return (profile_now() - start) / 1e6;
+};
+
+static double bench_db_load(struct bench_config *config, long int *ops) {
+	long long int start = profile_now();
+	for (long int i = 0; i < config->iterations; i++) {
+		scope {
+			struct pkg_db *db = pkg_db_new(config->root, PKG_DB_DEFAULT_PATH);
+			pkg_db_load_pkgs(db, 1);
+		};
+	};
+	*ops = config->iterations;
+	return (profile_now() - start) / 1e6;
+};
+
+static double bench_find_conflicts(struct bench_config *config, long int *ops) {
+	double seconds;
+	scope {
+		struct pkg_db *db = pkg_db_new(config->root, PKG_DB_DEFAULT_PATH);
+		pkg_db_load_pkgs(db, PKG_DB_LOAD_FILES | PKG_DB_LOAD_BLOOMS);
+		struct pkg *pkg = pkg_load(config->pkg_path);
+		long long int start = profile_now();
+		for (long int i = 0; i < config->iterations; i++) {
+			scope {
+				pkg_db_find_conflicts(db, pkg);
+			};
+		};
+		seconds = (profile_now() - start) / 1e6;
+	};
+	*ops = config->iterations;
+	return seconds;
+};
+
+static double bench_drop(struct bench_config *config, long int *ops) {
+	double seconds;
+	scope {
+		struct pkg_db *db = pkg_db_new(config->root, PKG_DB_DEFAULT_PATH);
+		pkg_db_load_pkgs(db, PKG_DB_LOAD_BLOOMS);
+		long long int start = profile_now();
+		array_foreach(db->pkgs, struct pkg_info *, each_pkg_info) {
+			pkg_db_drop(db, each_pkg_info, NULL);
+		};
+		seconds = (profile_now() - start) / 1e6;
+		*ops = array_length(db->pkgs);
+	};
+	// dropping removed the database entries
+	bench_generate_db(config);
+	return seconds;
+};
+
+static double bench_file_lines(struct bench_config *config, long int *ops) {
+	double seconds;
+	scope {
+		char *path = string_new_fmt("%s/%s/p00000/1.0-1-bench", config->root, PKG_DB_DEFAULT_PATH);
+		long long int start = profile_now();
+		for (long int i = 0; i < config->iterations; i++) {
+			scope {
+				file_lines(path);
+			};
+		};
+		seconds = (profile_now() - start) / 1e6;
+	};
+	*ops = config->iterations;
+	return seconds;
+};
+
+static double bench_port_prepare(struct bench_config *config, long int *ops) {
+	long long int start = profile_now();
+	for (long int i = 0; i < config->iterations; i++) {
+		scope {
+			port_db_t *db = port_db_new("", config->ports_path, config->pkg_db_path, config->null_stream);
+			port_db_prepare(db);
+		};
+	};
+	*ops = config->iterations;
+	return (profile_now() - start) / 1e6;
+};
+
+static double bench_upgrade_plan(struct bench_config *config, long int *ops) {
+	long long int total = 0;
+	port_test_mode = 1;
+	for (long int i = 0; i < config->iterations; i++) {
+		scope {
+			port_db_t *db = port_db_new("", config->ports_path, config->pkg_db_path, config->null_stream);
+			port_db_prepare(db);
+			long long int start = profile_now();
+			port_db_upgrade(db, NULL);
+			total += profile_now() - start;
+		};
+	};
+	*ops = config->iterations;
+	return total / 1e6;
+};
+
+static struct bench_driver bench_drivers[] = {
+	{"pkg_load", bench_pkg_load},
+	{"db_load", bench_db_load},
+	{"find_conflicts", bench_find_conflicts},
+	{"drop", bench_drop},
+	{"file_lines", bench_file_lines},
+	{"port_prepare", bench_port_prepare},
+	{"upgrade_plan", bench_upgrade_plan},
+	{NULL, NULL}
+};
+
+/* Every driver runs in its own process, so peak RSS belongs to that driver only. */
+static int bench_run(struct bench_config *config, struct bench_driver *driver) {
+	int status;
+	fflush(NULL);
+	pid_t pid = kga_fork();
+	if (!pid) {
+		int ret = EXIT_SUCCESS;
+		try_scope {
+			long int ops = 0;
+			double seconds = driver->run(config, &ops);
+			struct rusage usage;
+			if (getrusage(RUSAGE_SELF, &usage)) throw_errno();
+			printf("%-16s %12.1f ops/s %10.3f s %10li KiB peak RSS\n", driver->name, seconds > 0 ? ops / seconds : 0.0, seconds, (long int)usage.ru_maxrss);
+		};
+		catch {
+			fprintf(stderr, "%s: ", driver->name);
+			exception_print(stderr);
+			ret = EXIT_FAILURE;
+		};
+		fflush(NULL);
+		exit(ret);
+	};
+	waitpid(pid, &status, 0);
+	return status;
+};
+
+static void usage(FILE *out) {
+	fprintf(out, "Usage: pkgbench [-w workdir] [-n files] [-D dirs] [-p packages] [-f files per package]\n"
+			"                [-P ports] [-k fan-in] [-s chain|wide|random] [-i iterations] [driver ...]\n"
+			"Drivers:");
+	for (struct bench_driver *driver = bench_drivers; driver->name; driver++) {
+		fprintf(out, " %s", driver->name);
+	};
+	fprintf(out, "\n");
+};
+
+int main(int argc, char **argv) {
+	int ret = EXIT_SUCCESS;
+	int opt;
+	struct bench_config config;
+	config.work_path = NULL;
+	config.files = 20000;
+	config.dirs = 200;
+	config.pkgs = 300;
+	config.pkg_files = 200;
+	config.ports = 300;
+	config.fan_in = 3;
+	config.shape = "random";
+	config.iterations = 10;
+	kga_init();
+	try_scope {
+		while ((opt = getopt(argc, argv, "w:n:D:p:f:P:k:s:i:h")) != -1) {
+			switch(opt) {
+			case 'w':
+				config.work_path = optarg;
+				break;
+			case 'n':
+				config.files = strtol(optarg, NULL, 10);
+				break;
+			case 'D':
+				config.dirs = strtol(optarg, NULL, 10);
+				break;
+			case 'p':
+				config.pkgs = strtol(optarg, NULL, 10);
+				break;
+			case 'f':
+				config.pkg_files = strtol(optarg, NULL, 10);
+				break;
+			case 'P':
+				config.ports = strtol(optarg, NULL, 10);
+				break;
+			case 'k':
+				config.fan_in = strtol(optarg, NULL, 10);
+				break;
+			case 's':
+				config.shape = optarg;
+				break;
+			case 'i':
+				config.iterations = strtol(optarg, NULL, 10);
+				break;
+			case 'h':
+				usage(stdout);
+				exit(EXIT_SUCCESS);
+			default:
+				throw(bench_incorrect_cmd, 1, "unknown option", NULL);
+				break;
+			};
+		};
+		if (config.files < 0 || config.dirs < 1 || config.pkgs < 1 || config.pkg_files < 0 || config.ports < 1 || config.fan_in < 0 || config.iterations < 1) {
+			throw(bench_incorrect_cmd, 1, "incorrect generator parameters", NULL);
+		};
+		if (strcmp(config.shape, "chain") && strcmp(config.shape, "wide") && strcmp(config.shape, "random")) {
+			throw(bench_incorrect_cmd, 1, "unknown port tree shape", config.shape);
+		};
+		if (config.work_path && config.work_path[0] != '/') {
+			throw(bench_incorrect_cmd, 1, "work directory must be an absolute path", config.work_path);
+		};
+		char *work_path = NULL;
+		if (!config.work_path) {
+			work_path = string_new_set("/tmp/pkgbench.XXXXXX");
+			kga_mkdtemp(work_path);
+			config.work_path = work_path;
+		};
+		config.pkg_path = string_new_fmt("%s/pkg", config.work_path);
+		config.root = string_new_fmt("%s/root", config.work_path);
+		// port database paths are taken relative to /
+		config.ports_path = string_new_fmt("%s/ports", config.work_path + 1);
+		config.pkg_db_path = string_new_fmt("%s/root/%s", config.work_path + 1, PKG_DB_DEFAULT_PATH);
+		config.null_stream = kga_fopen("/dev/null", "w");
+		try {
+			fprintf(stderr, "Generating: package %li files/%li dirs, db %li packages x %li files, %li ports (%s, fan-in %li)\n",
+					config.files, config.dirs, config.pkgs, config.pkg_files, config.ports, config.shape, config.fan_in);
+			bench_generate_package(&config);
+			bench_generate_db(&config);
+			bench_generate_ports(&config);
+			for (struct bench_driver *driver = bench_drivers; driver->name; driver++) {
+				if (optind < argc) {
+					int i;
+					for (i = optind; i < argc && strcmp(argv[i], driver->name); i++);
+					if (i == argc) continue;
+				};
+				if (bench_run(&config, driver)) ret = EXIT_FAILURE;
+			};
+		};
+		catch {
+			exception_print(stderr);
+			ret = EXIT_FAILURE;
+		};
+		if (work_path) rmrf(work_path);
+	};
+	catch {
+		if (exception()->type == &bench_incorrect_cmd) {
+			fprintf(stderr, "Invalid command, %s.\n", exception()->message);
+			usage(stderr);
+		} else {
+			exception_print(stderr);
+		};
+		ret = EXIT_FAILURE;
+	};
+	return ret;
+};
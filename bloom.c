@@ -0,0 +1,61 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "bloom.h"
+
+static void bloom_put_u32(unsigned char *data, uint32_t value) {
+	for (int i = 0; i < 4; i++) data[i] = value >> (8 * i);
+};
+
+static uint32_t bloom_get_u32(const unsigned char *data) {
+	return (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+};
+
+/* At least BLOOM_BITS_PER_ENTRY bits an entry, about 0.05% false positives. */
+int bloom_init(struct bloom *bloom, size_t count) {
+	uint32_t bits = 64;
+	while (bits < count * BLOOM_BITS_PER_ENTRY && bits < (uint32_t)1 << 31) bits <<= 1;
+	memset(bloom, 0, sizeof(struct bloom));
+	if (!(bloom->buffer = calloc(1, BLOOM_HEADER_SIZE + bits / 8))) return ENOMEM;
+	memcpy(bloom->buffer, BLOOM_MAGIC, BLOOM_MAGIC_SIZE);
+	bloom_put_u32(bloom->buffer + 8, bits);
+	bloom_put_u32(bloom->buffer + 12, BLOOM_HASHES);
+	return bloom_parse(bloom, bloom->buffer, BLOOM_HEADER_SIZE + bits / 8);
+};
+
+/* The filter takes the buffer over when it is valid. */
+int bloom_parse(struct bloom *bloom, unsigned char *buffer, size_t size) {
+	if (size < BLOOM_HEADER_SIZE || memcmp(buffer, BLOOM_MAGIC, BLOOM_MAGIC_SIZE)) return EINVAL;
+	uint32_t bits = bloom_get_u32(buffer + 8), hashes = bloom_get_u32(buffer + 12);
+	if (bits < 8 || (bits & (bits - 1)) || !hashes || hashes > 32) return EINVAL;
+	if (size != BLOOM_HEADER_SIZE + bits / 8) return EINVAL;
+	bloom->buffer = buffer;
+	bloom->size = size;
+	bloom->bits = bits;
+	bloom->hashes = hashes;
+	bloom->set = buffer + BLOOM_HEADER_SIZE;
+	return 0;
+};
+
+void bloom_free(struct bloom *bloom) {
+	free(bloom->buffer);
+	bloom->buffer = NULL;
+	bloom->set = NULL;
+};
+
+void bloom_add(struct bloom *bloom, uint64_t hash) {
+	uint64_t step = (hash >> 32 | hash << 32) | 1;
+	for (uint32_t i = 0; i < bloom->hashes; i++, hash += step) {
+		uint32_t bit = hash & (bloom->bits - 1);
+		bloom->set[bit / 8] |= 1 << (bit % 8);
+	};
+};
+
+int bloom_may_contain(const struct bloom *bloom, uint64_t hash) {
+	uint64_t step = (hash >> 32 | hash << 32) | 1;
+	for (uint32_t i = 0; i < bloom->hashes; i++, hash += step) {
+		uint32_t bit = hash & (bloom->bits - 1);
+		if (!(bloom->set[bit / 8] & 1 << (bit % 8))) return 0;
+	};
+	return 1;
+};
@@ -0,0 +1,31 @@
+#ifndef _BLOOM_H_
+#define _BLOOM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bloom filter over 64 bit hashes, probed with double hashing. The bit count
+ * is a power of two so a probe is a mask. As with pathlist, the same block is
+ * the file on disk and the filter in memory. Plain C, errno values on
+ * failure. */
+
+#define BLOOM_MAGIC "/bloom01"
+#define BLOOM_MAGIC_SIZE 8
+#define BLOOM_HEADER_SIZE 16
+#define BLOOM_BITS_PER_ENTRY 16
+#define BLOOM_HASHES 11
+
+struct bloom {
+	unsigned char *buffer;
+	size_t size;
+	uint32_t bits;
+	uint32_t hashes;
+	unsigned char *set;
+};
+
+int bloom_init(struct bloom *bloom, size_t count);
+int bloom_parse(struct bloom *bloom, unsigned char *buffer, size_t size);
+void bloom_free(struct bloom *bloom);
+void bloom_add(struct bloom *bloom, uint64_t hash);
+int bloom_may_contain(const struct bloom *bloom, uint64_t hash);
+#endif
@@ -41,14 +41,49 @@ SOURCES_BASE_DIR=distfiles/"$SOURCES_PREF"/"$SOURCES_NAME"
 PACKAGE_DIR="$PORTSROOT"/"$PACKAGE_BASE_DIR"
 SOURCES_DIR="$PORTSROOT"/"$SOURCES_BASE_DIR"
 PKGFILENAME="$NAME#$VERSION-$BUILD.pkg"
+# Packages are also kept by the hash of their inputs, portng passes INPUT_HASH
+HASH_BASE_DIR=packages/"$PORTS_ARCH"/by-hash
+HASH_DIR="$PORTSROOT"/"$HASH_BASE_DIR"
+HASHFILENAME="$INPUT_HASH.pkg"
+
+case "$SYNC_TO" in
+file://*)
+	SYNC_DIR="${SYNC_TO#file://}"
+	;;
+*)
+	SYNC_DIR="$SYNC_TO"
+	;;
+esac
 
 ARC_SUFFIXES='.tar.xz .tar.bz2 .tar.gz .tar.lzma .tgz .tbz .txz .tlz .cpio.xz .cpio.gz .cpio.bz2 .cpio.lzma .cgz .cbz .clz .cxz'
 mkdir -p fr || exit 1
 BUILDDIR="`pwd`"
 FAKEROOTDIR="$BUILDDIR/fr"
 
+profile_stage() {
+	test "$PORT_PROFILE" = y || return 0
+	echo "$1 $2 `date +%s%N`" >> "$BUILDDIR/profile.log"
+}
+
+profiled() {
+	PROFILE_STAGE="$1"
+	shift
+	profile_stage begin "$PROFILE_STAGE"
+	"$@"
+	PROFILE_RET=$?
+	profile_stage end "$PROFILE_STAGE"
+	return $PROFILE_RET
+}
+
 get_cache_package() {
 	echo get_cache_package "$@"
+	if test -n "$INPUT_HASH"
+	then
+		unpack_by_name "$HASH_DIR/$HASHFILENAME" "$FAKEROOTDIR" && return 0
+		# by name a stale BUILD gets a package of other inputs, caches from
+		# before the hash are read that way only with CACHE_BY_NAME=y
+		test "$CACHE_BY_NAME" = y || return 1
+	fi
 	unpack_by_name "$PACKAGE_DIR/$PKGFILENAME" "$FAKEROOTDIR"
 	return $?
 }
@@ -59,34 +94,44 @@ get_cache_sources() {
 	return $?
 }
 
-get_sync_package() {
-	echo get_sync_package "$@"
+get_sync_package_file() {
 	case "$SYNC_TO" in
-	http://*|ftp://)
-		PKGFILENAME_URL="`echo "$PKGFILENAME"|sed 's/#/%23/'`"
+	http://*|ftp://*)
+		FILENAME_URL="`echo "$2"|sed 's/#/%23/'`"
 		for SUF in $ARC_SUFFIXES
 		do
-			download "$SYNC_TO/$PACKAGE_BASE_DIR/$PKGFILENAME_URL$SUF" && unpack "`pwd`/$PKGFILENAME$SUF" "$FAKEROOTDIR" && return 0
+			download "$SYNC_TO/$1/$FILENAME_URL$SUF" && unpack "`pwd`/$2$SUF" "$FAKEROOTDIR" && return 0
 		done
 		;;
 	*)
-		unpack_by_name "$SYNC_TO/$PACKAGE_BASE_DIR/$PKGFILENAME" "$FAKEROOTDIR" && return 0
+		unpack_by_name "$SYNC_DIR/$1/$2" "$FAKEROOTDIR" && return 0
 		;;
 	esac
 	return 1
 }
 
+get_sync_package() {
+	echo get_sync_package "$@"
+	if test -n "$INPUT_HASH"
+	then
+		get_sync_package_file "$HASH_BASE_DIR" "$HASHFILENAME" && return 0
+		test "$CACHE_BY_NAME" = y || return 1
+	fi
+	get_sync_package_file "$PACKAGE_BASE_DIR" "$PKGFILENAME"
+	return $?
+}
+
 get_sync_sources() {
 	echo get_sync_sources "$@"
 	case "$SYNC_TO" in
-	http://*|ftp://)
+	http://*|ftp://*)
 		for SUF in $ARC_SUFFIXES
 		do
 			download "$SYNC_TO/$SOURCES_BASE_DIR/$SOURCES_NAME-$SOURCES_VERSION$SUF" && unpack "`pwd`/$SOURCES_NAME-$SOURCES_VERSION$SUF" . && return 0
 		done
 		;;
 	*)
-		unpack_by_name "$SYNC_TO/$SOURCES_BASE_DIR/$SOURCES_NAME-$SOURCES_VERSION" . && return 0
+		unpack_by_name "$SYNC_DIR/$SOURCES_BASE_DIR/$SOURCES_NAME-$SOURCES_VERSION" . && return 0
 		;;
 	esac
 	return 1
@@ -162,7 +207,10 @@ save_package_to_cache() {
 		rm -f "$PACKAGE_DIR"/*
 	fi
 	cd "$FAKEROOTDIR" || return 1
-	find `ls -A`| cpio --owner root.root -o 2> /dev/null| xz > "$PACKAGE_DIR/$PKGFILENAME.cpio.xz"
+	find `ls -A`| cpio --owner root.root -o 2> /dev/null| xz > "$PACKAGE_DIR/$PKGFILENAME.cpio.xz" || return 1
+	test -z "$INPUT_HASH" && return 0
+	mkdir -p "$HASH_DIR" || return 1
+	ln -f "$PACKAGE_DIR/$PKGFILENAME.cpio.xz" "$HASH_DIR/$HASHFILENAME.cpio.xz" 2> /dev/null || cp "$PACKAGE_DIR/$PKGFILENAME.cpio.xz" "$HASH_DIR/$HASHFILENAME.cpio.xz"
 	return $?
 }
 
@@ -181,6 +229,97 @@ save_sources_to_cache() {
 	return $?
 }
 
+cached_by_name() {
+	for SUF in $ARC_SUFFIXES
+	do
+		test -f "$1$SUF" && return 0
+	done
+	return 1
+}
+
+cache_store() {
+	echo cache_store "$@"
+	FILE="$1"
+	CACHE_DIR="$2"
+	CACHE_MODE="$3"
+	mkdir -p "$CACHE_DIR" || return 1
+	cp "$FILE" "$CACHE_DIR/.prefetch.$$" || return 1
+	if test "$CACHE_MODE" != all
+	then
+		rm -f "$CACHE_DIR"/*
+	fi
+	mv "$CACHE_DIR/.prefetch.$$" "$CACHE_DIR/`basename "$FILE"`"
+	return $?
+}
+
+prefetch_package_file() {
+	cached_by_name "$3/$2" && return 0
+	case "$SYNC_TO" in
+	'')
+		;;
+	http://*|ftp://*)
+		FILENAME_URL="`echo "$2"|sed 's/#/%23/'`"
+		for SUF in $ARC_SUFFIXES
+		do
+			download "$SYNC_TO/$1/$FILENAME_URL$SUF" "$BUILDDIR/$2$SUF" && cache_store "$BUILDDIR/$2$SUF" "$3" "$4" && return 0
+		done
+		;;
+	*)
+		for SUF in $ARC_SUFFIXES
+		do
+			test -f "$SYNC_DIR/$1/$2$SUF" || continue
+			cache_store "$SYNC_DIR/$1/$2$SUF" "$3" "$4"
+			return $?
+		done
+		;;
+	esac
+	return 1
+}
+
+prefetch_package() {
+	echo prefetch_package "$@"
+	if test -n "$INPUT_HASH"
+	then
+		# every hash is another package, none replaces the others
+		prefetch_package_file "$HASH_BASE_DIR" "$HASHFILENAME" "$HASH_DIR" all && return 0
+		test "$CACHE_BY_NAME" = y || return 1
+	fi
+	prefetch_package_file "$PACKAGE_BASE_DIR" "$PKGFILENAME" "$PACKAGE_DIR" "$CACHE_PACKAGES"
+	return $?
+}
+
+prefetch_sources() {
+	echo prefetch_sources "$@"
+	cached_by_name "$SOURCES_DIR/$SOURCES_NAME-$SOURCES_VERSION" && return 0
+	case "$SYNC_TO" in
+	'')
+		;;
+	http://*|ftp://*)
+		for SUF in $ARC_SUFFIXES
+		do
+			download "$SYNC_TO/$SOURCES_BASE_DIR/$SOURCES_NAME-$SOURCES_VERSION$SUF" "$BUILDDIR/$SOURCES_NAME-$SOURCES_VERSION$SUF" && cache_store "$BUILDDIR/$SOURCES_NAME-$SOURCES_VERSION$SUF" "$SOURCES_DIR" "$CACHE_SOURCES" && return 0
+		done
+		;;
+	*)
+		for SUF in $ARC_SUFFIXES
+		do
+			test -f "$SYNC_DIR/$SOURCES_BASE_DIR/$SOURCES_NAME-$SOURCES_VERSION$SUF" || continue
+			cache_store "$SYNC_DIR/$SOURCES_BASE_DIR/$SOURCES_NAME-$SOURCES_VERSION$SUF" "$SOURCES_DIR" "$CACHE_SOURCES"
+			return $?
+		done
+		;;
+	esac
+	# Upstream archives can go to the cache as is only when named like the cached ones
+	test -z "$SOURCES_URL" && return 1
+	for SUF in $ARC_SUFFIXES
+	do
+		test "`basename "$SOURCES_URL"`" = "$SOURCES_NAME-$SOURCES_VERSION$SUF" || continue
+		download "$SOURCES_URL" "$BUILDDIR/$SOURCES_NAME-$SOURCES_VERSION$SUF" && cache_store "$BUILDDIR/$SOURCES_NAME-$SOURCES_VERSION$SUF" "$SOURCES_DIR" "$CACHE_SOURCES" && return 0
+		return 1
+	done
+	return 1
+}
+
 download() {
 	if test -x /usr/bin/wget
 	then
@@ -253,6 +392,17 @@ _get_source() {
 	return 0
 }
 
+_prefetch() {
+	if test "$CACHE_PACKAGES" != none
+	then
+		prefetch_package && return 0
+	fi
+	test "$NOSOURCE" = y && return 1
+	test "$CACHE_SOURCES" = none && return 1
+	prefetch_sources
+	return $?
+}
+
 _build() {
 	if test "$NOSOURCE" != y
 	then
@@ -268,7 +418,7 @@ _build() {
 	then
 		cp -dR "$PORTDIR/fr/"* "$FAKEROOTDIR" || return 1
 	fi
-	if port_build
+	if profiled port_build port_build
 	then
 		echo -n "$NAME" > "$FAKEROOTDIR/.name" || return 1
 		echo -n "$VERSION-$BUILD" > "$FAKEROOTDIR/.version" || return 1
@@ -280,7 +430,7 @@ _build() {
 			fi
 		done
 		cd "$BUILDDIR"
-		save_package_to_cache
+		profiled save_package_to_cache save_package_to_cache
 		return 0
 	fi
 	return 1
@@ -290,13 +440,17 @@ echo Script for "$NAME/$VERSION-$BUILD" started.
 case "$1" in
 get_package)
 	echo Try get package...
-	_get_package && exit 0
+	profiled fetch_package _get_package && exit 0
+	;;
+prefetch)
+	echo Try prefetch...
+	_prefetch && exit 0
 	;;
 build_package)
 	if test "$NOSOURCE" != y
 	then
 		echo Try get sources...
-		_get_source || {
+		profiled fetch_sources _get_source || {
 			echo "ERROR: Cannot get sources $SOURCES_NAME-$SOURCES_VERSION for $NAME/$VERSION"
 			exit 1
 		}
@@ -0,0 +1,1129 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <kga/kga.h>
+#include <kga/scope.h>
+#include <kga/string.h>
+#include <kga/array.h>
+#include "config.h"
+#include "pkg.h"
+#include "pkg_internal.h"
+#include "misc.h"
+#include "kga_wrappers.h"
+#include "hash.h"
+#include "pathlist.h"
+#include "bloom.h"
+#include "shell.h"
+#include "port.h"
+#include "pkgd.h"
+#include "pkgdb.h"
+
+#ifndef F_OFD_SETLK
+#define F_OFD_SETLK 37
+#endif
+
+/* Behaviour checks, pkgbench only measures speed. Every check runs in its own
+ * process under a scratch directory, a failed check_true throws and leaves
+ * the rest to the exit. */
+
+exception_type_t check_failed;
+
+struct check {
+	const char *name;
+	void (*run)(const char *work_path);
+};
+
+#define check_true(cond, ...) do { \
+	if (!(cond)) { \
+		char *check_message = string_new_fmt(__VA_ARGS__); \
+		throw(check_failed, 1, #cond, check_message); \
+	}; \
+} while (0)
+
+static void check_write_file(const char *path, const char *content) {
+	scope {
+		FILE *file = kga_fopen(path, "w");
+		kga_fprintf(file, "%s", content);
+	};
+};
+
+static void check_pathlist(const char *work_path) {
+	char *paths[] = {"usr/share/b", "usr", "usr/bin/x", "usr/bin", "usr/share", "usr/share/a", "usr/lib/libz.so.1"};
+	size_t count = sizeof(paths) / sizeof(paths[0]);
+	struct pathlist list, parsed;
+	check_true(!pathlist_build(&list, paths, count), "build");
+	check_true(list.count == count, "%zu paths", list.count);
+	char **sorted = array_new(char *, 0, 0);
+	for (size_t i = 0; i < count; i++) array_push(sorted, paths[i]);
+	strings_sort(sorted);
+	// many entries, so restarts and prefixes past them are covered
+	for (int i = 0; i < 100; i++) array_push(sorted, string_new_fmt("usr/share/many/%03d", i));
+	struct pathlist many;
+	check_true(!pathlist_build(&many, sorted, array_length(sorted)), "build many");
+	unsigned char *buffer = kga_malloc(many.size);
+	memcpy(buffer, many.buffer, many.size);
+	check_true(pathlist_encoded(buffer, many.size), "magic");
+	check_true(!pathlist_parse(&parsed, buffer, many.size), "parse");
+	struct pathlist_iter iter;
+	pathlist_iter_init(&iter, &parsed);
+	size_t i = 0;
+	for (const char *path; (path = pathlist_next(&iter)); i++) {
+		check_true(i < array_length(sorted) && !strcmp(path, sorted[i]), "entry %zu is %s", i, path);
+	};
+	check_true(i == array_length(sorted), "%zu entries decoded", i);
+	for (i = array_length(sorted); i-- > 0; ) {
+		check_true(!strcmp(pathlist_get(&iter, i), sorted[i]), "get %zu", i);
+		check_true(pathlist_contains(&parsed, sorted[i]), "contains %s", sorted[i]);
+	};
+	check_true(!pathlist_contains(&parsed, "usr/bin/y"), "contains missing");
+	check_true(!pathlist_contains(&parsed, "a"), "contains before first");
+	check_true(!pathlist_contains(&parsed, "zzz"), "contains after last");
+	check_true(!strcmp(pathlist_seek(&iter, "usr/c"), "usr/lib/libz.so.1"), "seek between");
+	check_true(!pathlist_seek(&iter, "zzz"), "seek past end");
+	// damaged lists are refused rather than read past their end
+	buffer = kga_malloc(many.size);
+	memcpy(buffer, many.buffer, many.size);
+	check_true(pathlist_parse(&parsed, buffer, many.size - 1) == EINVAL, "short list");
+	buffer[0] = 'x';
+	check_true(pathlist_parse(&parsed, buffer, many.size) == EINVAL, "bad magic");
+	free(buffer);
+	pathlist_free(&list);
+	pathlist_free(&many);
+	pathlist_free(&parsed);
+	(void)work_path;
+};
+
+struct check_merged {
+	char **paths;
+	size_t *lists;
+};
+
+static void check_merge_emit(void *data, size_t list, size_t index, const char *path) {
+	struct check_merged *merged = data;
+	array_push(merged->paths, string_new_set(path));
+	array_push(merged->lists, list);
+	(void)index;
+};
+
+static void check_pathlist_merge(const char *work_path) {
+	char *paths1[] = {"a", "c", "e"};
+	char *paths2[] = {"b", "c", "d"};
+	struct pathlist list1, list2;
+	check_true(!pathlist_build(&list1, paths1, 3) && !pathlist_build(&list2, paths2, 3), "build");
+	const struct pathlist *lists[] = {&list1, &list2};
+	struct check_merged merged = {array_new(char *, 0, 0), array_new(size_t, 0, 0)};
+	check_true(!pathlist_merge(lists, 2, check_merge_emit, &merged), "merge");
+	const char *expected = "a b c c d e";
+	check_true(!strcmp(string_join(merged.paths, " ", 0), expected), "%s", string_join(merged.paths, " ", 0));
+	// equal paths come in the order of the lists
+	check_true(merged.lists[2] == 0 && merged.lists[3] == 1, "tie order");
+	pathlist_free(&list1);
+	pathlist_free(&list2);
+	(void)work_path;
+};
+
+static void check_bloom(const char *work_path) {
+	struct bloom bloom, parsed;
+	check_true(!bloom_init(&bloom, 1000), "init");
+	for (int i = 0; i < 1000; i++) {
+		char key[32];
+		snprintf(key, sizeof(key), "usr/share/%d", i);
+		bloom_add(&bloom, hash_data(key, strlen(key)));
+	};
+	unsigned char *buffer = kga_malloc(bloom.size);
+	memcpy(buffer, bloom.buffer, bloom.size);
+	check_true(!bloom_parse(&parsed, buffer, bloom.size), "parse");
+	int false_positives = 0;
+	for (int i = 0; i < 1000; i++) {
+		char key[32];
+		snprintf(key, sizeof(key), "usr/share/%d", i);
+		check_true(bloom_may_contain(&parsed, hash_data(key, strlen(key))), "added %s missing", key);
+		snprintf(key, sizeof(key), "usr/lib/%d", i);
+		if (bloom_may_contain(&parsed, hash_data(key, strlen(key)))) false_positives++;
+	};
+	check_true(false_positives < 10, "%d false positives in 1000", false_positives);
+	unsigned char damaged[BLOOM_HEADER_SIZE + 8];
+	memcpy(damaged, bloom.buffer, BLOOM_HEADER_SIZE);
+	check_true(bloom_parse(&parsed, damaged, sizeof(damaged)) == EINVAL, "size mismatch");
+	bloom_free(&bloom);
+	bloom_free(&parsed);
+	(void)work_path;
+};
+
+/* Reference XXH64 values, seed 0. */
+static void check_hash(const char *work_path) {
+	struct {
+		const char *data;
+		uint64_t hash;
+	} vectors[] = {
+		{"", 0xEF46DB3751D8E999ULL},
+		{"a", 0xD24EC4F1A98C6E5BULL},
+		{"abc", 0x44BC2CF5AD770999ULL},
+		{"Nobody inspects the spammish repetition", 0xFBCEA83C8A378BF1ULL},
+	};
+	for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+		uint64_t hash = hash_data(vectors[i].data, strlen(vectors[i].data));
+		check_true(hash == vectors[i].hash, "\"%s\" hashed to %016llx", vectors[i].data, (unsigned long long int)hash);
+	};
+	// long input fed in uneven pieces must hash as one block
+	unsigned char data[1027];
+	for (size_t i = 0; i < sizeof(data); i++) data[i] = i < 1024 ? i % 256 : "xyz"[i - 1024];
+	check_true(hash_data(data, sizeof(data)) == 0xE146CB31B65BC21AULL, "long input");
+	struct hash_state state;
+	hash_init(&state);
+	for (size_t offset = 0, step = 1; offset < sizeof(data); offset += step, step = step * 3 % 37 + 1) {
+		hash_update(&state, data + offset, offset + step > sizeof(data) ? sizeof(data) - offset : step);
+	};
+	check_true(hash_final(&state) == 0xE146CB31B65BC21AULL, "piecewise input");
+	char *path = string_new_fmt("%s/data", work_path);
+	scope {
+		FILE *file = kga_fopen(path, "w");
+		kga_fwrite(data, 1, sizeof(data), file);
+	};
+	check_true(hash_file(path) == 0xE146CB31B65BC21AULL, "file");
+};
+
+/* Package tree of files given as "path" or "path/" for directories. */
+static char *check_package(const char *work_path, const char *name, char **files) {
+	char *pkg_path = string_new_fmt("%s/%s.pkg", work_path, name);
+	scope {
+		char *path = string_new_fmt("%s/.name", pkg_path);
+		kga_mkpath(pkg_path, 0755);
+		check_write_file(path, name);
+		string_fmt(path, "%s/.version", pkg_path);
+		check_write_file(path, "1.0");
+		for (; *files; files++) {
+			string_fmt(path, "%s/%s", pkg_path, *files);
+			if (path[string_length(path) - 1] == '/') {
+				kga_mkpath(path, 0755);
+			} else {
+				check_write_file(path, name);
+			};
+		};
+	};
+	return pkg_path;
+};
+
+/* Top level dot files are the package's own and left out, deeper ones are
+ * content. The many long names need several getdents64 reads. */
+static void check_walk(const char *work_path) {
+	char *files[] = {"usr/", "usr/bin/", "usr/bin/x", "usr/lib/", "usr/lib/.keep", "usr/many/", NULL};
+	char *pkg_path = check_package(work_path, "walk", files);
+	char **expected = array_new(char *, 0, 0);
+	for (char **each = files; *each; each++) {
+		array_push(expected, string_new_set(*each));
+		char *path = expected[array_length(expected) - 1];
+		if (path[string_length(path) - 1] == '/') path[string_length(path) - 1] = '\0';
+	};
+	char *path = string_new_fmt("%s/.hidden", pkg_path);
+	check_write_file(path, "");
+	string_fmt(path, "%s/usr/link", pkg_path);
+	kga_symlink("bin", path);
+	array_push(expected, "usr/link");
+	for (int i = 0; i < 3000; i++) {
+		string_fmt(path, "%s/usr/many/%04d-a-name-long-enough-to-fill-the-read-buffer-soon", pkg_path, i);
+		check_write_file(path, "");
+		array_push(expected, string_new_set(path + strlen(pkg_path) + 1));
+	};
+	strings_sort(expected);
+	struct pkg *pkg = pkg_load(pkg_path);
+	check_true(!strcmp(pkg->name, "walk") && !strcmp(pkg->version, "1.0"), "name %s version %s", pkg->name, pkg->version);
+	check_true(array_length(pkg->files) == array_length(expected), "%zu files", array_length(pkg->files));
+	for (size_t i = 0; i < array_length(expected); i++) {
+		struct pkg_file *file = &pkg->files[i];
+		check_true(!strcmp(file->path, expected[i]), "file %zu is %s", i, file->path);
+		int flags = !strcmp(file->path, "usr/link") ? PKG_FILE_LNK : 0;
+		if (!strcmp(file->path, "usr") || !strcmp(file->path, "usr/bin") || !strcmp(file->path, "usr/lib") || !strcmp(file->path, "usr/many")) flags = PKG_FILE_DIR;
+		check_true(file->flags == flags, "%s flags %d", file->path, file->flags);
+	};
+	check_true(!pkg->files[array_length(pkg->files)].path, "not terminated");
+};
+
+static ino_t check_inode(const char *root, const char *path) {
+	struct stat st;
+	char *fs_path = string_new_fmt("%s/%s", root, path);
+	kga_lstat(fs_path, &st);
+	return st.st_ino;
+};
+
+/* An incremental upgrade leaves files the new version has unchanged where they
+ * are, replaces changed ones and ones edited since the install, and removes
+ * what the new version no longer has. */
+static void check_upgrade(const char *work_path) {
+	char *root = string_new_fmt("%s/root", work_path);
+	char *old_files[] = {"usr/", "usr/bin/", "usr/bin/same", "usr/bin/changed", "usr/bin/edited", "usr/bin/gone", NULL};
+	char *new_files[] = {"usr/", "usr/bin/", "usr/bin/same", "usr/bin/changed", "usr/bin/edited", "usr/bin/added", NULL};
+	FILE *null_stream = kga_fopen("/dev/null", "w");
+	char *old_path = check_package(string_new_fmt("%s/old", work_path), "foo", old_files);
+	char *new_path = check_package(string_new_fmt("%s/new", work_path), "foo", new_files);
+	char *path = string_new_fmt("%s/.version", new_path);
+	check_write_file(path, "1.1");
+	string_fmt(path, "%s/usr/bin/changed", new_path);
+	check_write_file(path, "new");
+	kga_mkpath(root, 0755);
+	pkg_install(old_path, root, PKG_DB_DEFAULT_PATH, 0, null_stream);
+	ino_t same = check_inode(root, "usr/bin/same");
+	ino_t changed = check_inode(root, "usr/bin/changed");
+	ino_t edited = check_inode(root, "usr/bin/edited");
+	string_fmt(path, "%s/usr/bin/edited", root);
+	// same size, only the mtime tells
+	check_write_file(path, "bar");
+	struct timespec times[2] = {{0, UTIME_OMIT}, {1, 0}};
+	if (utimensat(AT_FDCWD, path, times, 0)) throw_errno_verbose(path);
+	pkg_install(new_path, root, PKG_DB_DEFAULT_PATH, PKG_UPGRADE | PKG_INCREMENTAL, null_stream);
+	check_true(check_inode(root, "usr/bin/same") == same, "unchanged file replaced");
+	check_true(check_inode(root, "usr/bin/changed") != changed, "changed file kept");
+	check_true(check_inode(root, "usr/bin/edited") != edited, "edited file kept");
+	string_fmt(path, "%s/usr/bin/changed", root);
+	check_true(!strcmp(string_from_file(path), "new"), "changed file has the old content");
+	string_fmt(path, "%s/usr/bin/edited", root);
+	check_true(!strcmp(string_from_file(path), "foo"), "edited file not restored");
+	string_fmt(path, "%s/usr/bin/gone", root);
+	check_true(!kga_file_exists(path), "removed file left");
+	string_fmt(path, "%s/usr/bin/added", root);
+	check_true(kga_file_exists(path), "added file missing");
+	check_true(!pkg_installed(root, PKG_DB_DEFAULT_PATH, "foo", "1.0") && pkg_installed(root, PKG_DB_DEFAULT_PATH, "foo", "1.1"), "installed versions");
+	check_true(!pkg_verify(root, PKG_DB_DEFAULT_PATH, NULL, 1, 0, null_stream, null_stream), "verify failed");
+};
+
+/* Workers report by entry index, so problems with paths longer than a pipe
+ * write come out whole, once each, however the workers interleave. */
+static void check_verify(const char *work_path) {
+	char *root = string_new_fmt("%s/root", work_path);
+	char **files = array_new(char *, 0, ARRAY_NULL_TERMINATED);
+	char **long_files = array_new(char *, 0, 0);
+	char *path = string_new_set("usr");
+	array_push(files, "usr/");
+	for (int i = 0; i < 200; i++) array_push(files, string_new_fmt("usr/f%03d", i));
+	// close to PATH_MAX with the root, a line with the path would not fit in one pipe write
+	for (int i = 0; i < 16; i++) {
+		string_fmt(path, "%s/%0250d", path, i);
+		array_push(files, string_new_fmt("%s/", path));
+	};
+	for (int i = 0; i < 10; i++) {
+		array_push(long_files, string_new_fmt("%s/l%d", path, i));
+		array_push(files, long_files[i]);
+	};
+	FILE *null_stream = kga_fopen("/dev/null", "w");
+	kga_mkpath(root, 0755);
+	pkg_install(check_package(work_path, "foo", files), root, PKG_DB_DEFAULT_PATH, 0, null_stream);
+	check_true(!pkg_verify(root, PKG_DB_DEFAULT_PATH, NULL, 4, 0, null_stream, null_stream), "problems after install");
+	char **expected = array_new(char *, 0, 0);
+	for (int i = 0; i < 200; i += 3) {
+		string_fmt(path, "%s/usr/f%03d", root, i);
+		check_write_file(path, "changed");
+		array_push(expected, string_new_fmt("foo/1.0: usr/f%03d: size changed", i));
+	};
+	string_fmt(path, "%s/usr/f001", root);
+	if (unlink(path)) throw_errno_verbose(path);
+	array_push(expected, "foo/1.0: usr/f001: missing");
+	array_foreach(long_files, char **, each_file) {
+		string_fmt(path, "%s/%s", root, *each_file);
+		check_write_file(path, "bar");
+		array_push(expected, string_new_fmt("foo/1.0: %s: content changed", *each_file));
+	};
+	strings_sort(expected);
+	char *report_path = string_new_fmt("%s/report", work_path);
+	int problems;
+	scope {
+		FILE *report = kga_fopen(report_path, "w");
+		problems = pkg_verify(root, PKG_DB_DEFAULT_PATH, NULL, 4, 0, report, null_stream);
+	};
+	char **lines = file_lines(report_path);
+	strings_sort(lines);
+	check_true(problems == (int)array_length(expected), "%d problems", problems);
+	check_true(array_length(lines) == array_length(expected), "%zu report lines", array_length(lines));
+	for (size_t i = 0; i < array_length(expected); i++) {
+		check_true(!strcmp(lines[i], expected[i]), "line %zu is %.80s", i, lines[i]);
+	};
+};
+
+/* Directories come up from sorted lists going deeper, back up and across,
+ * into a root that already has some of them. */
+static void check_mkdir(const char *work_path) {
+	char *root = string_new_fmt("%s/root", work_path);
+	char *files[] = {"a/", "a/b/", "a/b/c/", "a/b/c/d/", "a/b/c/d/e/", "a/b/c/d/e/f", "a/b/c/g", "a/b/x/", "a/b/x/y/", "a/b/x/y/f",
+			"a/z/", "a/z/f", "b/", "b/c/", "b/c/f", NULL};
+	FILE *null_stream = kga_fopen("/dev/null", "w");
+	char *path = string_new_fmt("%s/a/b", root);
+	kga_mkpath(path, 0755);
+	string_cat(path, "/kept");
+	check_write_file(path, "kept");
+	pkg_install(check_package(work_path, "dirs", files), root, PKG_DB_DEFAULT_PATH, 0, null_stream);
+	for (char **each = files; *each; each++) {
+		struct stat st;
+		int dir = (*each)[strlen(*each) - 1] == '/';
+		string_fmt(path, "%s/%s", root, *each);
+		check_true(!kga_lstat_skip_enoent(path, &st), "%s missing", *each);
+		check_true(!S_ISDIR(st.st_mode) == !dir, "%s has the wrong type", *each);
+	};
+	string_fmt(path, "%s/a/b/kept", root);
+	check_true(!strcmp(string_from_file(path), "kept"), "a/b/kept lost");
+};
+
+static void check_transaction_add(struct pkg_fs_transaction **transactions, const char *dir, const char *name, const char *content) {
+	struct pkg_fs_transaction transaction;
+	transaction.to = string_new_fmt("%s/%s", dir, name);
+	transaction.from = string_new_fmt("%s.new", transaction.to);
+	transaction.backup = string_new_fmt("%s.backup", transaction.to);
+	transaction.exchanged = 0;
+	if (content) check_write_file(transaction.from, content);
+	array_push(*transactions, transaction);
+};
+
+/* A commit replaces and adds files and leaves neither staged nor backup names.
+ * One failing halfway is rolled back to the files from before. */
+static void check_commit(const char *work_path) {
+	char *path = string_new_fmt("%s/replaced", work_path);
+	check_write_file(path, "old");
+	struct pkg_fs_transaction *transactions = array_new(struct pkg_fs_transaction, 0, ARRAY_NULL_TERMINATED);
+	check_transaction_add(&transactions, work_path, "replaced", "new");
+	check_transaction_add(&transactions, work_path, "added", "added");
+	transaction_fs_transactions_commit(transactions, NULL);
+	check_true(!strcmp(string_from_file(transactions[0].to), "new"), "replaced file not replaced");
+	check_true(!strcmp(string_from_file(transactions[1].to), "added"), "added file missing");
+	array_foreach(transactions, struct pkg_fs_transaction *, each_transaction) {
+		check_true(!kga_file_exists(each_transaction->from) && !kga_file_exists(each_transaction->backup), "%s left", each_transaction->to);
+	};
+	transactions = array_new(struct pkg_fs_transaction, 0, ARRAY_NULL_TERMINATED);
+	check_transaction_add(&transactions, work_path, "replaced", "newer");
+	// never staged, so the commit fails after the first file
+	check_transaction_add(&transactions, work_path, "unstaged", NULL);
+	int failed = 0;
+	try {
+		transaction_fs_transactions_commit(transactions, NULL);
+	};
+	catch {
+		failed = 1;
+		transaction_fs_transactions_rollback(transactions, NULL);
+	};
+	check_true(failed, "commit of a file never staged");
+	check_true(!strcmp(string_from_file(transactions[0].to), "new"), "replaced file not rolled back");
+	check_true(!kga_file_exists(transactions[0].from) && !kga_file_exists(transactions[0].backup), "replaced file left staged");
+	check_true(!kga_file_exists(transactions[1].to), "unstaged file made");
+};
+
+static void check_drop_case(const char *work_path, int blooms) {
+	char *root = string_new_fmt("%s/root%d", work_path, blooms);
+	char *a_files[] = {"usr/", "usr/bin/", "usr/bin/a", "usr/share/", "usr/share/common/", "usr/share/common/a", NULL};
+	char *b_files[] = {"usr/", "usr/bin/", "usr/bin/b", "usr/share/", "usr/share/common/", "usr/share/common/b", NULL};
+	FILE *null_stream = kga_fopen("/dev/null", "w");
+	kga_mkpath(root, 0755);
+	pkg_install(check_package(work_path, "a", a_files), root, PKG_DB_DEFAULT_PATH, 0, null_stream);
+	pkg_install(check_package(work_path, "b", b_files), root, PKG_DB_DEFAULT_PATH, 0, null_stream);
+	// b also claims usr/bin/a, as a list of an older database without a filter
+	char **lines = array_new(char *, 0, 0);
+	char *listed[] = {"usr", "usr/bin", "usr/bin/a", "usr/bin/b", "usr/share", "usr/share/common", "usr/share/common/b"};
+	for (size_t i = 0; i < sizeof(listed) / sizeof(listed[0]); i++) array_push(lines, listed[i]);
+	char *path = string_new_fmt("%s/%s/b/1.0", root, PKG_DB_DEFAULT_PATH);
+	lines_to_file(lines, path);
+	string_fmt(path, "%s/%s/b/" PKG_DB_BLOOM_NAME, root, PKG_DB_DEFAULT_PATH, "1.0");
+	if (blooms) {
+		scope {
+			struct bloom *bloom = pkg_bloom_new(pkg_pathlist_new(lines, array_length(lines)));
+			FILE *file = kga_fopen(path, "w");
+			kga_fwrite(bloom->buffer, 1, bloom->size, file);
+		};
+	} else {
+		unlink(path);
+	};
+	pkg_drop(root, PKG_DB_DEFAULT_PATH, "a", NULL, null_stream);
+	char *kept[] = {"usr/bin/a", "usr/bin/b", "usr/share/common", "usr/share/common/b"};
+	for (size_t i = 0; i < sizeof(kept) / sizeof(kept[0]); i++) {
+		string_fmt(path, "%s/%s", root, kept[i]);
+		check_true(kga_file_exists(path), "%s removed", kept[i]);
+	};
+	string_fmt(path, "%s/usr/share/common/a", root);
+	check_true(!kga_file_exists(path), "usr/share/common/a left");
+	string_fmt(path, "%s/%s/a/1.0", root, PKG_DB_DEFAULT_PATH);
+	check_true(!kga_file_exists(path), "a still in the database");
+	check_true(!pkg_installed(root, PKG_DB_DEFAULT_PATH, "a", NULL) && pkg_installed(root, PKG_DB_DEFAULT_PATH, "b", NULL), "installed packages");
+};
+
+/* Files other packages have stay, with filters and without. */
+static void check_drop(const char *work_path) {
+	check_drop_case(work_path, 1);
+	check_drop_case(work_path, 0);
+};
+
+static int check_confirm_no(const char *fmt, ...) {
+	return 0;
+};
+
+/* Packages of one install that conflict with each other stop it before
+ * anything is staged. A batch given up before the commit leaves no trace,
+ * one going through installs every package. */
+static void check_install_many(const char *work_path) {
+	char *root = string_new_fmt("%s/root", work_path);
+	char *o_files[] = {"usr/", "usr/bin/", "usr/bin/o", NULL};
+	char *p_files[] = {"usr/", "usr/bin/", "usr/bin/p", "usr/bin/same", NULL};
+	char *q_files[] = {"usr/", "usr/bin/", "usr/bin/q", "usr/bin/same", NULL};
+	char *r_files[] = {"usr/", "usr/lib/", "usr/lib/r", NULL};
+	FILE *null_stream = kga_fopen("/dev/null", "w");
+	kga_mkpath(root, 0755);
+	pkg_install(check_package(work_path, "o", o_files), root, PKG_DB_DEFAULT_PATH, 0, null_stream);
+	char **paths = array_new(char *, 0, ARRAY_NULL_TERMINATED);
+	array_push(paths, check_package(work_path, "p", p_files));
+	array_push(paths, check_package(work_path, "q", q_files));
+	int conflict = 0;
+	try {
+		pkg_install_many(paths, root, PKG_DB_DEFAULT_PATH, 0, null_stream);
+	};
+	catch {
+		conflict = exception_type_is(exception_type_pkg_files_conflict);
+	};
+	check_true(conflict, "p and q both have usr/bin/same");
+	char *path = string_new_fmt("%s/usr/bin/p", root);
+	check_true(!kga_file_exists(path), "p installed with a conflict");
+	paths[1] = check_package(work_path, "r", r_files);
+	int aborted = 0;
+	pkg_confirm = check_confirm_no;
+	try {
+		pkg_install_many(paths, root, PKG_DB_DEFAULT_PATH, 0, null_stream);
+	};
+	catch {
+		aborted = 1;
+	};
+	pkg_confirm = NULL;
+	check_true(aborted, "install not given up");
+	char *left[] = {"usr/bin/p", "usr/bin/p.pkg.transaction.new", "usr/lib/r", "usr/lib/r.pkg.transaction.new", PKG_DB_DEFAULT_PATH "/p/1.0", PKG_DB_DEFAULT_PATH "/r/1.0"};
+	for (size_t i = 0; i < sizeof(left) / sizeof(left[0]); i++) {
+		string_fmt(path, "%s/%s", root, left[i]);
+		check_true(!kga_file_exists(path), "%s left after the rollback", left[i]);
+	};
+	check_true(!pkg_installed(root, PKG_DB_DEFAULT_PATH, "p", NULL) && !pkg_installed(root, PKG_DB_DEFAULT_PATH, "r", NULL), "installed after the rollback");
+	pkg_install_many(paths, root, PKG_DB_DEFAULT_PATH, 0, null_stream);
+	char *names[] = {"o", "p", "r"};
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		check_true(pkg_installed(root, PKG_DB_DEFAULT_PATH, names[i], "1.0"), "%s not installed", names[i]);
+	};
+	string_fmt(path, "%s/usr/lib/r", root);
+	check_true(kga_file_exists(path), "usr/lib/r missing");
+};
+
+/* Deferred hooks run once for the whole set. a runs alone at first, the
+ * serial c waits for it and b waits for c. */
+static void check_hooks(const char *work_path) {
+	char *root = string_new_fmt("%s/root", work_path);
+	char *log = string_new_fmt("%s/hooks.log", work_path);
+	char *hooks_path = string_new_fmt("%s/usr/lib/pkg-hooks", root);
+	struct {
+		const char *name, *script;
+	} hooks[] = {
+		{"a", "#!/bin/sh\necho a start >> %s\nsleep 0.2\necho a end >> %s\n"},
+		{"b", "#!/bin/sh\n# pkg-hook: after c\necho b >> %s\n"},
+		{"c", "#!/bin/sh\n# pkg-hook: serial\necho c start >> %s\nsleep 0.1\necho c end >> %s\n"},
+	};
+	kga_mkpath(hooks_path, 0755);
+	for (size_t i = 0; i < sizeof(hooks) / sizeof(hooks[0]); i++) {
+		char *path = string_new_fmt("%s/%s", hooks_path, hooks[i].name);
+		check_write_file(path, string_new_fmt(hooks[i].script, log, log));
+		if (chmod(path, 0755)) throw_errno_verbose(path);
+	};
+	char *x_files[] = {"usr/", "usr/bin/", "usr/bin/x", NULL};
+	char *y_files[] = {"usr/", "usr/bin/", "usr/bin/y", NULL};
+	FILE *null_stream = kga_fopen("/dev/null", "w");
+	pkg_install(check_package(work_path, "x", x_files), root, PKG_DB_DEFAULT_PATH, PKG_DEFER_HOOKS, null_stream);
+	pkg_install(check_package(work_path, "y", y_files), root, PKG_DB_DEFAULT_PATH, PKG_DEFER_HOOKS, null_stream);
+	check_true(!kga_file_exists(log), "hooks not deferred");
+	pkg_finish_installs(root, NULL, null_stream);
+	char *order = string_join(file_lines(log), ",", 0);
+	check_true(!strcmp(order, "a start,a end,c start,c end,b"), "hooks ran %s", order);
+};
+
+/* dirs directories of files empty files, each with a directory inside. */
+static void check_tree(const char *path, int dirs, int files) {
+	scope {
+		char *file_path = string_new();
+		for (int i = 0; i < dirs; i++) {
+			string_fmt(file_path, "%s/d%d/sub", path, i);
+			kga_mkpath(file_path, 0755);
+			for (int j = 0; j < files; j++) {
+				string_fmt(file_path, "%s/d%d/f%d", path, i, j);
+				int fd = creat(file_path, 0644);
+				if (fd < 0) throw_errno_verbose(file_path);
+				close(fd);
+			};
+		};
+	};
+};
+
+/* Trees past the serial limit are removed in parallel without following
+ * symlinks. The background remover lets go of the caller's pipe before it
+ * is done. */
+static void check_rmrf(const char *work_path) {
+	char *tree = string_new_fmt("%s/tree", work_path);
+	char *outside = string_new_fmt("%s/outside", work_path);
+	char *path = string_new_fmt("%s/keep", outside);
+	kga_mkpath(outside, 0755);
+	check_write_file(path, "");
+	check_tree(tree, 5, 1000);
+	string_fmt(path, "%s/d0/link", tree);
+	kga_symlink(outside, path);
+	rmrf(tree);
+	check_true(!kga_file_exists(tree), "tree left");
+	string_fmt(path, "%s/keep", outside);
+	check_true(kga_file_exists(path), "symlink followed");
+	check_tree(tree, 1, 3);
+	rmrf(tree);
+	check_true(!kga_file_exists(tree), "small tree left");
+	check_tree(tree, 5, 1000);
+	int *fds = kga_pipe();
+	rmrf_background(tree);
+	close(fds[1]);
+	fds[1] = -1;
+	struct pollfd pollfd = {fds[0], POLLIN, 0};
+	char c;
+	check_true(poll(&pollfd, 1, 10000) == 1 && !read(fds[0], &c, 1), "no EOF on the pipe");
+	check_true(kga_file_exists(tree), "the remover held the pipe until the tree was gone");
+	struct timespec pause = {0, 10000000};
+	for (int i = 0; i < 1000 && kga_file_exists(tree); i++) nanosleep(&pause, NULL);
+	check_true(!kga_file_exists(tree), "tree left by the background remover");
+};
+
+static void check_generation_set(const char *root, const char *generation) {
+	scope {
+		char *path = string_new_fmt("%s/%s/" PKG_DB_GENERATION_NAME, root, PKG_DB_DEFAULT_PATH);
+		check_write_file(path, generation);
+	};
+};
+
+/* Another writer holding the lock keeps installs out, at once without a
+ * timeout and until it lets go with one. Readers wait out an odd generation
+ * only while its writer lives. */
+static void check_lock(const char *work_path) {
+	char *root = string_new_fmt("%s/root", work_path);
+	char *a_files[] = {"usr/", "usr/bin/", "usr/bin/a", NULL};
+	char *b_files[] = {"usr/", "usr/bin/", "usr/bin/b", NULL};
+	FILE *null_stream = kga_fopen("/dev/null", "w");
+	kga_mkpath(root, 0755);
+	pkg_install(check_package(work_path, "a", a_files), root, PKG_DB_DEFAULT_PATH, 0, null_stream);
+	int *ready = kga_pipe();
+	int *release = kga_pipe();
+	char *lock_path = string_new_fmt("%s/%s/" PKG_DB_LOCK_NAME, root, PKG_DB_DEFAULT_PATH);
+	fflush(NULL);
+	pid_t pid = kga_fork();
+	if (!pid) {
+		char c;
+		struct flock lock = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+		int fd = open(lock_path, O_RDWR);
+		if (fd < 0 || fcntl(fd, F_OFD_SETLK, &lock) || write(ready[1], "+", 1) != 1) _exit(EXIT_FAILURE);
+		close(release[1]);
+		while (read(release[0], &c, 1) > 0);
+		struct timespec pause = {0, 300000000};
+		nanosleep(&pause, NULL);
+		_exit(EXIT_SUCCESS);
+	};
+	char c;
+	close(release[0]);
+	release[0] = -1;
+	check_true(read(ready[0], &c, 1) == 1, "no lock taken");
+	check_generation_set(root, "3");
+	char *b_path = check_package(work_path, "b", b_files);
+	int locked = 0;
+	pkg_lock_timeout = 0;
+	try {
+		pkg_install(b_path, root, PKG_DB_DEFAULT_PATH, 0, null_stream);
+	};
+	catch {
+		locked = exception_type_is(exception_type_pkg_db_already_locked);
+	};
+	check_true(locked, "installed under another writer");
+	locked = 0;
+	try {
+		pkg_db_list(root, PKG_DB_DEFAULT_PATH);
+	};
+	catch {
+		locked = exception_type_is(exception_type_pkg_db_already_locked);
+	};
+	check_true(locked, "read during a write");
+	close(release[1]);
+	release[1] = -1;
+	pkg_lock_timeout = 5;
+	pkg_install(b_path, root, PKG_DB_DEFAULT_PATH, 0, null_stream);
+	int status;
+	waitpid(pid, &status, 0);
+	check_true(!status, "lock holder failed");
+	struct pkg_db *db = pkg_db_new(root, PKG_DB_DEFAULT_PATH);
+	check_true(!(pkg_db_generation(db) & 1), "generation %llu after the install", pkg_db_generation(db));
+	// no writer alive, the odd generation is left over
+	check_generation_set(root, "9");
+	pkg_lock_timeout = 0;
+	check_true(array_length(pkg_db_list(root, PKG_DB_DEFAULT_PATH)) == 2, "packages after a dead writer");
+};
+
+/* Output of a request to the daemon, status -1 when none listens. */
+static char *check_pkgd_call(const char *work_path, const char *root, char **args, int *status) {
+	char *out_path = string_new_fmt("%s/pkgd.out", work_path);
+	scope {
+		FILE *out = kga_fopen(out_path, "w");
+		FILE *null_stream = kga_fopen("/dev/null", "w");
+		*status = pkgd_call(root, PKG_DB_DEFAULT_PATH, args, out, null_stream);
+	};
+	return string_from_file(out_path);
+};
+
+/* The daemon picks up packages installed and dropped behind its back, the
+ * merged owners stay sorted by path and then by package. */
+static void check_pkgd(const char *work_path) {
+	char *root = string_new_fmt("%s/root", work_path);
+	char *a_files[] = {"usr/", "usr/bin/", "usr/bin/a", "usr/share/", "usr/share/common/", "usr/share/common/a", NULL};
+	char *c_files[] = {"usr/", "usr/bin/", "usr/bin/c", "usr/share/", "usr/share/common/", "usr/share/common/c", NULL};
+	char *b_files[] = {"usr/", "usr/bin/", "usr/bin/b", "usr/share/", "usr/share/common/", "usr/share/common/b", NULL};
+	FILE *null_stream = kga_fopen("/dev/null", "w");
+	kga_mkpath(root, 0755);
+	pkg_install(check_package(work_path, "a", a_files), root, PKG_DB_DEFAULT_PATH, 0, null_stream);
+	pkg_install(check_package(work_path, "c", c_files), root, PKG_DB_DEFAULT_PATH, 0, null_stream);
+	fflush(NULL);
+	pid_t pid = kga_fork();
+	if (!pid) {
+		int ret = EXIT_SUCCESS;
+		try pkgd_serve(root, PKG_DB_DEFAULT_PATH, NULL);
+		catch ret = EXIT_FAILURE;
+		_exit(ret);
+	};
+	int status = -1;
+	char *list_args[] = {"list", NULL};
+	char *owns_args[] = {"owns", "/usr/share/common", "/usr/bin/a", "/usr/bin/b", NULL};
+	char *stop_args[] = {"stop", NULL};
+	char *out;
+	try {
+		struct timespec pause = {0, 10000000};
+		for (int i = 0; i < 1000 && (out = check_pkgd_call(work_path, root, list_args, &status), status < 0); i++) nanosleep(&pause, NULL);
+		check_true(!status && !strcmp(out, "a/1.0\nc/1.0"), "listed %s", out);
+		out = check_pkgd_call(work_path, root, owns_args, &status);
+		check_true(status == 1 && !strcmp(out, "/usr/share/common a/1.0\n/usr/share/common c/1.0\n/usr/bin/a a/1.0"), "owners %s", out);
+		pkg_install(check_package(work_path, "b", b_files), root, PKG_DB_DEFAULT_PATH, 0, null_stream);
+		out = check_pkgd_call(work_path, root, owns_args, &status);
+		check_true(!status && !strcmp(out, "/usr/share/common a/1.0\n/usr/share/common b/1.0\n/usr/share/common c/1.0\n/usr/bin/a a/1.0\n/usr/bin/b b/1.0"), "owners after an install %s", out);
+		pkg_drop(root, PKG_DB_DEFAULT_PATH, "a", NULL, null_stream);
+		out = check_pkgd_call(work_path, root, list_args, &status);
+		check_true(!status && !strcmp(out, "b/1.0\nc/1.0"), "listed after a drop %s", out);
+		out = check_pkgd_call(work_path, root, owns_args, &status);
+		check_true(status == 1 && !strcmp(out, "/usr/share/common b/1.0\n/usr/share/common c/1.0\n/usr/bin/b b/1.0"), "owners after a drop %s", out);
+	};
+	catch {
+		check_pkgd_call(work_path, root, stop_args, &status);
+		waitpid(pid, NULL, 0);
+		throw_proxy();
+	};
+	check_pkgd_call(work_path, root, stop_args, &status);
+	waitpid(pid, &status, 0);
+	check_true(!status, "daemon failed");
+};
+
+static char *check_pkgdb_pkgs(pkgdb_iter_t *iter) {
+	char *pkgs = string_new();
+	for (const pkgdb_pkg_t *pkg; (pkg = pkgdb_next(iter)); ) {
+		string_cat(pkgs, string_new_fmt("%s%s/%s", *pkgs ? "," : "", pkgdb_pkg_name(pkg), pkgdb_pkg_version(pkg)));
+	};
+	return pkgs;
+};
+
+/* The library answers from one snapshot, which goes stale with the next
+ * install and is not taken while a live writer holds an odd generation. */
+static void check_pkgdb(const char *work_path) {
+	char *root = string_new_fmt("%s/root", work_path);
+	char *a_files[] = {"usr/", "usr/bin/", "usr/bin/a", "usr/share/", "usr/share/common/", "usr/share/common/a", NULL};
+	char *b_files[] = {"usr/", "usr/bin/", "usr/bin/b", "usr/share/", "usr/share/common/", "usr/share/common/b", NULL};
+	char *c_files[] = {"usr/", "usr/bin/", "usr/bin/c", NULL};
+	FILE *null_stream = kga_fopen("/dev/null", "w");
+	kga_mkpath(root, 0755);
+	pkg_install(check_package(work_path, "b", b_files), root, PKG_DB_DEFAULT_PATH, 0, null_stream);
+	pkg_install(check_package(work_path, "a", a_files), root, PKG_DB_DEFAULT_PATH, 0, null_stream);
+	pkgdb_t *db;
+	pkgdb_iter_t iter;
+	int ret = pkgdb_open(root, PKG_DB_DEFAULT_PATH, 0, &db);
+	check_true(!ret, "open: %s", strerror(ret));
+	check_true(pkgdb_count(db) == 2 && !pkgdb_stale(db), "%zu packages", pkgdb_count(db));
+	pkgdb_list(db, &iter);
+	char *pkgs = check_pkgdb_pkgs(&iter);
+	check_true(!strcmp(pkgs, "a/1.0,b/1.0"), "listed %s", pkgs);
+	check_true(pkgdb_lookup(db, "b", NULL, &iter) == 1 && !strcmp(pkgs = check_pkgdb_pkgs(&iter), "b/1.0"), "looked up %s", pkgs);
+	check_true(pkgdb_lookup(db, "b", "2.0", &iter) == 0 && !pkgdb_next(&iter), "looked up another version");
+	check_true(pkgdb_lookup(db, "ab", NULL, &iter) == 0 && !pkgdb_next(&iter), "looked up a missing name");
+	check_true(pkgdb_owners(db, "/usr/share/common", &iter) == 2 && !strcmp(pkgs = check_pkgdb_pkgs(&iter), "a/1.0,b/1.0"), "shared owners %s", pkgs);
+	check_true(pkgdb_owners(db, "usr/bin/b", &iter) == 1 && !strcmp(pkgs = check_pkgdb_pkgs(&iter), "b/1.0"), "owners %s", pkgs);
+	check_true(pkgdb_owners(db, "/usr/bin/c", &iter) == 0 && !pkgdb_next(&iter), "owners of an unlisted path");
+	pkgdb_lookup(db, "a", "1.0", &iter);
+	const pkgdb_pkg_t *pkg = pkgdb_next(&iter);
+	pkgdb_files(db, pkg, &iter);
+	char *files = string_new();
+	for (const char *path; (path = pkgdb_next_file(&iter)); ) {
+		string_cat(files, string_new_fmt("%s%s", *files ? "," : "", path));
+	};
+	check_true(pkgdb_pkg_files_count(pkg) == 6 && !strcmp(files, "usr,usr/bin,usr/bin/a,usr/share,usr/share/common,usr/share/common/a"), "files %s", files);
+	pkg_install(check_package(work_path, "c", c_files), root, PKG_DB_DEFAULT_PATH, 0, null_stream);
+	check_true(pkgdb_stale(db) && pkgdb_count(db) == 2, "snapshot after an install");
+	pkgdb_close(db);
+	char *lock_path = string_new_fmt("%s/%s/" PKG_DB_LOCK_NAME, root, PKG_DB_DEFAULT_PATH);
+	struct flock lock = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+	int fd = open(lock_path, O_RDWR);
+	if (fd < 0) throw_errno_verbose(lock_path);
+	if (fcntl(fd, F_OFD_SETLK, &lock)) throw_errno_verbose(lock_path);
+	check_generation_set(root, "11");
+	check_true((ret = pkgdb_open(root, PKG_DB_DEFAULT_PATH, 50, &db)) == EAGAIN, "opened under a live writer: %s", strerror(ret));
+	close(fd);
+	ret = pkgdb_open(root, PKG_DB_DEFAULT_PATH, 0, &db);
+	check_true(!ret && pkgdb_count(db) == 3, "open after a dead writer: %s", strerror(ret));
+	pkgdb_close(db);
+};
+
+static char *check_pkgdb_index_owners(const char *root, const char *path) {
+	pkgdb_index_t *index;
+	pkgdb_iter_t iter;
+	int ret = pkgdb_index_open(root, PKG_DB_DEFAULT_PATH, 0, &index);
+	check_true(!ret, "index open: %s", strerror(ret));
+	char *owners = string_new();
+	pkgdb_index_owners(index, path, &iter);
+	for (const char *owner; (owner = pkgdb_next_owner(&iter)); ) {
+		string_cat(owners, string_new_fmt("%s%s", *owners ? "," : "", owner));
+	};
+	pkgdb_index_close(index);
+	return owners;
+};
+
+/* The index is written on first use and mapped as it is afterwards, one
+ * behind the database or broken is built again and replaced. */
+static void check_pkgdb_index(const char *work_path) {
+	char *root = string_new_fmt("%s/root", work_path);
+	char *a_files[] = {"usr/", "usr/bin/", "usr/bin/a", "usr/share/", "usr/share/common/", "usr/share/common/a", NULL};
+	char *b_files[] = {"usr/", "usr/bin/", "usr/bin/b", "usr/share/", "usr/share/common/", "usr/share/common/b", NULL};
+	char *c_files[] = {"usr/", "usr/bin/", "usr/bin/c", NULL};
+	char *index_path = string_new_fmt("%s/" PKG_DB_INDEX_NAME, PKG_DB_DEFAULT_PATH);
+	FILE *null_stream = kga_fopen("/dev/null", "w");
+	kga_mkpath(root, 0755);
+	pkg_install(check_package(work_path, "a", a_files), root, PKG_DB_DEFAULT_PATH, 0, null_stream);
+	pkg_install(check_package(work_path, "b", b_files), root, PKG_DB_DEFAULT_PATH, 0, null_stream);
+	char *owners = check_pkgdb_index_owners(root, "/usr/share/common");
+	check_true(!strcmp(owners, "a/1.0,b/1.0"), "shared owners %s", owners);
+	ino_t built = check_inode(root, index_path);
+	owners = check_pkgdb_index_owners(root, "usr/bin/b");
+	check_true(!strcmp(owners, "b/1.0"), "owners %s", owners);
+	check_true(!*(owners = check_pkgdb_index_owners(root, "usr/bin/c")), "owners of an unlisted path %s", owners);
+	check_true(check_inode(root, index_path) == built, "current index written again");
+	pkg_install(check_package(work_path, "c", c_files), root, PKG_DB_DEFAULT_PATH, 0, null_stream);
+	owners = check_pkgdb_index_owners(root, "/usr/bin");
+	check_true(!strcmp(owners, "a/1.0,b/1.0,c/1.0"), "owners after an install %s", owners);
+	check_true(check_inode(root, index_path) != built, "stale index kept");
+	char *path = string_new_fmt("%s/%s", root, index_path);
+	check_write_file(path, "PKGIDX0 not an index of this database");
+	owners = check_pkgdb_index_owners(root, "/usr/bin/c");
+	check_true(!strcmp(owners, "c/1.0"), "owners from a broken index %s", owners);
+	check_true(!memcmp(string_from_file(path), PKG_DB_INDEX_MAGIC, 8), "broken index kept");
+};
+
+struct check_script {
+	const char *script;
+	int declarative;
+};
+
+static struct check_script check_scripts[] = {
+	{"NAME=foo\nVERSION=1.2\nDEPENDS=\"bar  baz\"\nBUILD=1 # first\n", 1},
+	{"NAME=foo\nbuild() {\n\tmake\n\t}\nDEPENDS='bar'\ninstall() {\n\tx\n}\n", 1},
+	{"f() { :; }; DEPENDS=baz\nNAME=f\n", 1},
+	{"NAME=foo\nVERSION=2\nDEPENDS=\"$NAME-${VERSION}\"' '$ARCH\nBUILD=$UNSET\n", 1},
+	{"NAME=foo\nbuild()\n{\n\tif true; then { echo '}'; }; fi\n\techo \"${NAME}}\" ${#NAME} # }\n}\nDEPENDS=bar\n", 1},
+	{"NAME=foo\nbuild() {\n\techo }\n}\nDEPENDS=bar\n", 0},
+	{"NAME=foo\nbuild() {\n\tcat <<EOF\n}\nEOF\n}\nDEPENDS=bar\n", 0},
+	{"NAME=foo\nbuild() {\n\tmake\nDEPENDS=bar\n", 0},
+	{"NAME=foo\nVERSION=$(date)\n", 0},
+	{NULL, 0}
+};
+
+static char *check_script_lookup(void *data, const char *name) {
+	return strcmp(name, "ARCH") ? "" : "x86_64";
+};
+
+/* Declarative build.sh files read without the shell give what sh gives, the
+ * rest are left to the shell. */
+static void check_shell(const char *work_path) {
+	const char *names[] = {"NAME", "VERSION", "DEPENDS", "BUILD", NULL};
+	char *path = string_new_fmt("%s/build.sh", work_path);
+	for (struct check_script *each = check_scripts; each->script; each++) {
+		check_write_file(path, each->script);
+		struct shell_var *vars = array_new(struct shell_var, 0, 0);
+		for (const char **name = names; *name; name++) {
+			struct shell_var var = {string_new_set(*name), string_new()};
+			array_push(vars, var);
+		};
+		int declarative = shell_parse_declarative(path, &vars, check_script_lookup, NULL);
+		check_true(declarative == each->declarative, "script %d declarative %d", (int)(each - check_scripts), declarative);
+		if (!declarative) continue;
+		scope {
+			shell_t *shell = shell_new();
+			shell_process(shell, "NAME=''\nVERSION=''\nDEPENDS=''\nBUILD=''\nARCH=x86_64\n");
+			shell_process_file(shell, path);
+			array_foreach(vars, struct shell_var *, each_var) {
+				// as echo prints it, the way shell_get_var reads it
+				for (char *c = each_var->value; *c; c++) {
+					if (*c == '\t' || *c == '\n') *c = ' ';
+				};
+				char *value = string_join(string_split(each_var->value, " ", STRING_SPLIT_WITHOUT_EMPTY), " ", 0);
+				char *expected = shell_get_var(shell, each_var->name);
+				check_true(!strcmp(value, expected), "script %d %s is '%s', sh says '%s'", (int)(each - check_scripts), each_var->name, value, expected);
+			};
+		};
+	};
+};
+
+/* Ports tree of a check: build_template.sh of the current directory, an empty
+ * mirror and a root with an empty package database. Scripts run as PORT_UID, so the tree is
+ * writable by all. */
+struct check_ports {
+	char *path;
+	char *root;
+	char *mirror;
+	char *log;
+};
+
+static struct check_ports *check_ports_new(const char *work_path, const char *conf, const char *targets) {
+	struct check_ports *ports = kga_malloc(sizeof(struct check_ports));
+	ports->path = string_new_fmt("%s/ports", work_path);
+	ports->root = string_new_fmt("%s/root", work_path);
+	ports->mirror = string_new_fmt("%s/mirror", work_path);
+	ports->log = string_new_fmt("%s/log", work_path);
+	scope {
+		char *path = string_new_fmt("%s/tmp", ports->path);
+		kga_mkpath(path, 0755);
+		kga_mkpath(ports->mirror, 0755);
+		if (chmod(ports->path, 0777)) throw_errno_verbose(ports->path);
+		string_fmt(path, "%s/build_template.sh", ports->path);
+		check_write_file(path, string_from_file("build_template.sh"));
+		string_fmt(path, "%s/ports.conf", ports->path);
+		check_write_file(path, string_new_fmt("SYNC_TO=file://%s\n%s", ports->mirror, conf));
+		string_fmt(path, "%s%s", ports->root, ports->path);
+		kga_mkpath(path, 0755);
+		string_fmt(path, "%s/%s", ports->root, PKG_DB_DEFAULT_PATH);
+		kga_mkpath(path, 0755);
+		string_fmt(path, "%s%s/targets", ports->root, ports->path);
+		check_write_file(path, targets);
+	};
+	return ports;
+};
+
+static void check_port(struct check_ports *ports, const char *port_path, const char *script) {
+	scope {
+		char *path = string_new_fmt("%s/pkgblds/%s", ports->path, port_path);
+		kga_mkpath(path, 0755);
+		string_cat(path, "/build.sh");
+		check_write_file(path, script);
+	};
+};
+
+/* Runs portng upgrade, --resume if asked, and returns what it and the
+ * scripts said. */
+static char *check_ports_upgrade(struct check_ports *ports, int resume) {
+	fflush(stdout);
+	int out = kga_dup(STDOUT_FILENO);
+	try_scope {
+		FILE *log = kga_fopen(ports->log, "w");
+		setvbuf(log, NULL, _IONBF, 0);
+		kga_dup2(fileno(log), STDOUT_FILENO);
+		port_db_t *db = port_db_new(ports->root, ports->path + 1, PKG_DB_DEFAULT_PATH, log);
+		port_db_prepare(db);
+		if (resume) port_db_resume(db);
+		port_db_upgrade(db, NULL);
+	};
+	catch {
+		fflush(stdout);
+		kga_dup2(out, STDOUT_FILENO);
+		close(out);
+		throw_proxy();
+	};
+	fflush(stdout);
+	kga_dup2(out, STDOUT_FILENO);
+	close(out);
+	return string_from_file(ports->log);
+};
+
+/* The distfile of b comes into the cache as the mirror has it, the build
+ * would have stored it as .tar.xz. Installed ports are not fetched again. */
+static void check_prefetch(const char *work_path) {
+	struct check_ports *ports = check_ports_new(work_path, "PREFETCH_JOBS=2\n", "a\n");
+	check_port(ports, "a", "NAME=a\nVERSION=1.0\nBUILD=1\nDEPENDS=b\nNOSOURCE=y\n"
+			"port_build() {\n\tmkdir -p \"$FAKEROOTDIR/usr/bin\" && echo a > \"$FAKEROOTDIR/usr/bin/a\"\n}\n");
+	check_port(ports, "b", "NAME=b\nVERSION=1.0\nBUILD=1\n"
+			"port_build() {\n\tmkdir -p \"$FAKEROOTDIR/usr/lib\" && cp hello \"$FAKEROOTDIR/usr/lib/b\"\n}\n");
+	char *path = string_new_fmt("%s/b-1.0", work_path);
+	kga_mkpath(path, 0755);
+	string_cat(path, "/hello");
+	check_write_file(path, "hello\n");
+	string_fmt(path, "%s/distfiles/b/b", ports->mirror);
+	kga_mkpath(path, 0755);
+	char *command = string_new_fmt("tar czf %s/b-1.0.tar.gz -C %s b-1.0", path, work_path);
+	check_true(!system(command), "%s", command);
+	char *log = check_ports_upgrade(ports, 0);
+	check_true(strstr(log, "Prefetch [2/2]"), "no prefetch in:\n%s", log);
+	string_fmt(path, "%s/distfiles/b/b/b-1.0.tar.gz", ports->path);
+	check_true(kga_file_exists(path), "b-1.0.tar.gz not in the cache");
+	string_fmt(path, "%s/usr/lib/b", ports->root);
+	check_true(kga_file_exists(path), "b not installed");
+	string_fmt(path, "%s/usr/bin/a", ports->root);
+	check_true(kga_file_exists(path), "a not installed");
+	log = check_ports_upgrade(ports, 0);
+	check_true(!strstr(log, "Prefetch ["), "installed ports prefetched:\n%s", log);
+};
+
+static const char *check_tmpfs_ports[] = {
+	"NAME=small\nVERSION=%s\nBUILD=1\nNOSOURCE=y\n"
+		"port_build() {\n\tmkdir -p \"$FAKEROOTDIR/usr/bin\" && echo small > \"$FAKEROOTDIR/usr/bin/small\"\n}\n",
+	"NAME=large\nVERSION=%s\nBUILD=1\nNOSOURCE=y\n"
+		"port_build() {\n\tmkdir -p \"$FAKEROOTDIR/usr/bin\" && head -c 2097152 /dev/zero > \"$FAKEROOTDIR/usr/bin/large\"\n}\n",
+};
+
+/* Ports never built go to disk. Built again, the one whose last tree fits the
+ * budget goes to the tmpfs directory and the other stays on disk. */
+static void check_tmpfs(const char *work_path) {
+	char *tmpfs_dir = string_new_fmt("%s/tmpfs", work_path);
+	struct check_ports *ports = check_ports_new(work_path, string_new_fmt("PREFETCH_JOBS=0\nBUILD_TMPFS_DIR=%s\nBUILD_TMPFS_BUDGET=1M\n", tmpfs_dir), "small\nlarge\n");
+	check_port(ports, "small", string_new_fmt(check_tmpfs_ports[0], "1.0"));
+	check_port(ports, "large", string_new_fmt(check_tmpfs_ports[1], "1.0"));
+	char *log = check_ports_upgrade(ports, 0);
+	check_true(!strstr(log, "Building small in") && !strstr(log, "Building large in"), "placed without a recorded tree:\n%s", log);
+	char *stats_path = string_new_fmt("%s/stats", ports->path);
+	char *stats = string_from_file(stats_path);
+	check_true(strstr(stats, "small tree ") && strstr(stats, "large tree "), "trees not recorded:\n%s", stats);
+	check_port(ports, "small", string_new_fmt(check_tmpfs_ports[0], "1.1"));
+	check_port(ports, "large", string_new_fmt(check_tmpfs_ports[1], "1.1"));
+	log = check_ports_upgrade(ports, 0);
+	char *placed = string_new_fmt("Building small in %s.", tmpfs_dir);
+	check_true(strstr(log, placed), "small not on the tmpfs:\n%s", log);
+	check_true(!strstr(log, "Building large in"), "large on the tmpfs:\n%s", log);
+	char *path = string_new_fmt("%s/usr/bin/small", ports->root);
+	check_true(!strcmp(string_from_file(path), "small"), "small not installed");
+};
+
+/* Without hints a build gets every slot, BUILD_JOBS and BUILD_MEM cut it
+ * down. The jobs reach make through MAKEFLAGS with a jobserver. */
+static void check_slots(const char *work_path) {
+	struct {
+		const char *name, *hints, *expected;
+	} builds[] = {
+		{"all", "", "4 -j4 --jobserver-auth="},
+		{"hinted", "BUILD_JOBS=2\n", "2 -j2 --jobserver-auth="},
+		{"memory", "BUILD_MEM=400M\n", "2 -j2 --jobserver-auth="},
+	};
+	size_t count = sizeof(builds) / sizeof(builds[0]);
+	struct check_ports *ports = check_ports_new(work_path, "PREFETCH_JOBS=0\nBUILD_SLOTS=4\nBUILD_MEM_BUDGET=1G\n", "all\nhinted\nmemory\n");
+	for (size_t i = 0; i < count; i++) {
+		check_port(ports, builds[i].name, string_new_fmt("NAME=%s\nVERSION=1.0\nBUILD=1\nNOSOURCE=y\n%s"
+				"port_build() {\n\tmkdir -p \"$FAKEROOTDIR/usr/share\" && echo \"$PORT_JOBS $MAKEFLAGS\" > \"$FAKEROOTDIR/usr/share/%s\"\n}\n",
+				builds[i].name, builds[i].hints, builds[i].name));
+	};
+	check_ports_upgrade(ports, 0);
+	for (size_t i = 0; i < count; i++) {
+		char *path = string_new_fmt("%s/usr/share/%s", ports->root, builds[i].name);
+		char *jobs = string_from_file(path);
+		check_true(!strncmp(jobs, builds[i].expected, strlen(builds[i].expected)), "%s built with %s", builds[i].name, jobs);
+	};
+};
+
+/* A failed run leaves a journal, the run resumed from it builds the failed
+ * port without fetching it again and removes the journal when all is done. */
+static void check_resume(const char *work_path) {
+	struct check_ports *ports = check_ports_new(work_path, "PREFETCH_JOBS=0\n", "a\n");
+	char *fixed = string_new_fmt("%s/fixed", work_path);
+	check_port(ports, "a", "NAME=a\nVERSION=1.0\nBUILD=1\nDEPENDS=b\nNOSOURCE=y\n"
+			"port_build() {\n\tmkdir -p \"$FAKEROOTDIR/usr/bin\" && echo a > \"$FAKEROOTDIR/usr/bin/a\"\n}\n");
+	check_port(ports, "b", string_new_fmt("NAME=b\nVERSION=1.0\nBUILD=1\nNOSOURCE=y\n"
+			"port_build() {\n\ttest -f %s || return 1\n\tmkdir -p \"$FAKEROOTDIR/usr/lib\" && echo b > \"$FAKEROOTDIR/usr/lib/b\"\n}\n", fixed));
+	char *log = check_ports_upgrade(ports, 0);
+	check_true(strstr(log, "Trying get package for b."), "b not fetched:\n%s", log);
+	char *journal_path = string_new_fmt("%s/journal", ports->path);
+	check_true(kga_file_exists(journal_path), "no journal after a failed run");
+	char *journal = string_from_file(journal_path);
+	check_true(strstr(journal, "b error ") && strstr(journal, "b build "), "journal:\n%s", journal);
+	char *path = string_new_fmt("%s/usr/bin/a", ports->root);
+	check_true(!kga_file_exists(path), "a installed without b");
+	check_write_file(fixed, "");
+	log = check_ports_upgrade(ports, 1);
+	check_true(!strstr(log, "Trying get package for b."), "b fetched again on resume:\n%s", log);
+	check_true(kga_file_exists(path), "a not installed on resume:\n%s", log);
+	string_fmt(path, "%s/usr/lib/b", ports->root);
+	check_true(kga_file_exists(path), "b not installed on resume");
+	check_true(!kga_file_exists(journal_path), "journal left after a clean run");
+};
+
+static struct check checks[] = {
+	{"pathlist", check_pathlist},
+	{"pathlist_merge", check_pathlist_merge},
+	{"bloom", check_bloom},
+	{"hash", check_hash},
+	{"drop", check_drop},
+	{"shell", check_shell},
+	{"prefetch", check_prefetch},
+	{"tmpfs", check_tmpfs},
+	{"slots", check_slots},
+	{"resume", check_resume},
+	{"walk", check_walk},
+	{"hooks", check_hooks},
+	{"install_many", check_install_many},
+	{"upgrade", check_upgrade},
+	{"verify", check_verify},
+	{"mkdir", check_mkdir},
+	{"commit", check_commit},
+	{"rmrf", check_rmrf},
+	{"lock", check_lock},
+	{"pkgd", check_pkgd},
+	{"pkgdb", check_pkgdb},
+	{"pkgdb_index", check_pkgdb_index},
+	{NULL, NULL}
+};
+
+static int check_run(const char *work_path, struct check *check) {
+	int status;
+	fflush(NULL);
+	pid_t pid = kga_fork();
+	if (!pid) {
+		int ret = EXIT_SUCCESS;
+		try_scope {
+			char *path = string_new_fmt("%s/%s", work_path, check->name);
+			kga_mkpath(path, 0755);
+			check->run(path);
+			printf("ok   %s\n", check->name);
+		};
+		catch {
+			printf("FAIL %s: ", check->name);
+			fflush(stdout);
+			exception_print(stdout);
+			ret = EXIT_FAILURE;
+		};
+		fflush(NULL);
+		exit(ret);
+	};
+	waitpid(pid, &status, 0);
+	return status;
+};
+
+int main(int argc, char **argv) {
+	int ret = EXIT_SUCCESS;
+	kga_init();
+	try_scope {
+		char *work_path = string_new_set("/tmp/pkgcheck.XXXXXX");
+		kga_mkdtemp(work_path);
+		// port scripts run as PORT_UID and go through it
+		if (chmod(work_path, 0755)) throw_errno_verbose(work_path);
+		for (struct check *check = checks; check->name; check++) {
+			if (argc > 1) {
+				int i;
+				for (i = 1; i < argc && strcmp(argv[i], check->name); i++);
+				if (i == argc) continue;
+			};
+			if (check_run(work_path, check)) ret = EXIT_FAILURE;
+		};
+		rmrf(work_path);
+	};
+	catch {
+		exception_print(stderr);
+		ret = EXIT_FAILURE;
+	};
+	return ret;
+};
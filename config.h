@@ -3,3 +3,4 @@
 #define PKG_DB_DEFAULT_PATH "var/pkgs"
 #define PORT_UID 53421
 #define PORT_GID 53421
+#define PORT_PREFETCH_DEFAULT_JOBS 4
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <kga/kga.h>
+#include <kga/scope.h>
+#include "hash.h"
+#include "kga_wrappers.h"
+
+/* XXH64, so hashes match the reference xxhsum -H64 output. */
+
+#define HASH_PRIME1 11400714785074694791ULL
+#define HASH_PRIME2 14029467366897019727ULL
+#define HASH_PRIME3 1609587929392839161ULL
+#define HASH_PRIME4 9650029242287828579ULL
+#define HASH_PRIME5 2870177450012600261ULL
+#define HASH_FILE_BUFFER_SIZE 65536
+
+static uint64_t hash_rotl(uint64_t value, int bits) {
+	return (value << bits) | (value >> (64 - bits));
+};
+
+static uint64_t hash_read64(const unsigned char *p) {
+	uint64_t value = 0;
+	for (int i = 7; i >= 0; i--) value = (value << 8) | p[i];
+	return value;
+};
+
+static uint64_t hash_read32(const unsigned char *p) {
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24;
+};
+
+static uint64_t hash_round(uint64_t acc, uint64_t input) {
+	acc += input * HASH_PRIME2;
+	acc = hash_rotl(acc, 31);
+	return acc * HASH_PRIME1;
+};
+
+static uint64_t hash_merge(uint64_t acc, uint64_t value) {
+	acc ^= hash_round(0, value);
+	return acc * HASH_PRIME1 + HASH_PRIME4;
+};
+
+static void hash_stripe(struct hash_state *state, const unsigned char *p) {
+	for (int i = 0; i < 4; i++) state->v[i] = hash_round(state->v[i], hash_read64(p + i * 8));
+};
+
+void hash_init(struct hash_state *state) {
+	state->v[0] = HASH_PRIME1 + HASH_PRIME2;
+	state->v[1] = HASH_PRIME2;
+	state->v[2] = 0;
+	state->v[3] = -HASH_PRIME1;
+	state->total = 0;
+	state->buffered = 0;
+};
+
+void hash_update(struct hash_state *state, const void *data, size_t size) {
+	const unsigned char *p = data;
+	state->total += size;
+	if (state->buffered) {
+		size_t fill = 32 - state->buffered;
+		if (fill > size) fill = size;
+		memcpy(state->buffer + state->buffered, p, fill);
+		state->buffered += fill;
+		p += fill;
+		size -= fill;
+		if (state->buffered < 32) return;
+		hash_stripe(state, state->buffer);
+		state->buffered = 0;
+	};
+	for (; size >= 32; p += 32, size -= 32) {
+		hash_stripe(state, p);
+	};
+	memcpy(state->buffer, p, size);
+	state->buffered = size;
+};
+
+uint64_t hash_final(struct hash_state *state) {
+	uint64_t hash;
+	const unsigned char *p = state->buffer;
+	size_t size = state->buffered;
+	if (state->total >= 32) {
+		hash = hash_rotl(state->v[0], 1) + hash_rotl(state->v[1], 7) + hash_rotl(state->v[2], 12) + hash_rotl(state->v[3], 18);
+		for (int i = 0; i < 4; i++) hash = hash_merge(hash, state->v[i]);
+	} else {
+		hash = HASH_PRIME5;
+	};
+	hash += state->total;
+	for (; size >= 8; p += 8, size -= 8) {
+		hash ^= hash_round(0, hash_read64(p));
+		hash = hash_rotl(hash, 27) * HASH_PRIME1 + HASH_PRIME4;
+	};
+	if (size >= 4) {
+		hash ^= hash_read32(p) * HASH_PRIME1;
+		hash = hash_rotl(hash, 23) * HASH_PRIME2 + HASH_PRIME3;
+		p += 4;
+		size -= 4;
+	};
+	for (; size; p++, size--) {
+		hash ^= *p * HASH_PRIME5;
+		hash = hash_rotl(hash, 11) * HASH_PRIME1;
+	};
+	hash ^= hash >> 33;
+	hash *= HASH_PRIME2;
+	hash ^= hash >> 29;
+	hash *= HASH_PRIME3;
+	hash ^= hash >> 32;
+	return hash;
+};
+
+uint64_t hash_data(const void *data, size_t size) {
+	struct hash_state state;
+	hash_init(&state);
+	hash_update(&state, data, size);
+	return hash_final(&state);
+};
+
+uint64_t hash_file(const char *path) {
+	struct hash_state state;
+	hash_init(&state);
+	scope {
+		FILE *file = kga_fopen(path, "r");
+		char *buffer = kga_malloc(HASH_FILE_BUFFER_SIZE);
+		scope_add(buffer, free);
+		for (size_t readed; (readed = kga_fread(buffer, 1, HASH_FILE_BUFFER_SIZE, file)) > 0; ) {
+			hash_update(&state, buffer, readed);
+		};
+	};
+	return hash_final(&state);
+};
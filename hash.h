@@ -0,0 +1,19 @@
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct hash_state {
+	uint64_t v[4];
+	uint64_t total;
+	unsigned char buffer[32];
+	size_t buffered;
+};
+
+void hash_init(struct hash_state *state);
+void hash_update(struct hash_state *state, const void *data, size_t size);
+uint64_t hash_final(struct hash_state *state);
+uint64_t hash_data(const void *data, size_t size);
+uint64_t hash_file(const char *path);
+#endif
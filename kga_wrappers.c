@@ -1,7 +1,10 @@
 #define _POSIX_SOURCE
 #define _XOPEN_SOURCE 500
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
 #include <libgen.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
 #include <glob.h>
 #include <kga/kga.h>
 #include <kga/string.h>
@@ -23,6 +26,12 @@ void kga_free_pipe(void *ptr) {
 	free(ptr);
 };
 
+void kga_free_fd(void *ptr) {
+	int *fd = ptr;
+	if (*fd >= 0) close(*fd);
+	free(ptr);
+};
+
 void kga_free_file(void *ptr) {
 	fclose((FILE *)ptr);
 };
@@ -60,6 +69,12 @@ void kga_dup2(int oldfd, int newfd) {
 	if (dup2(oldfd, newfd) < 0) throw_errno();
 };
 
+int kga_dup(int fd) {
+	int ret;
+	if ((ret = dup(fd)) < 0) throw_errno();
+	return ret;
+};
+
 FILE *kga_fdopen(int fd, const char *opt) {
 	FILE *file = fdopen(fd, opt);
 	if (!file) throw_errno();
@@ -106,18 +121,20 @@ void kga_mkdir(const char *path, mode_t mode) {
 	};
 };
 
+/* Goes up only as far as directories are missing, so an existing path costs one mkdir. */
 void kga_mkpath(const char *path, mode_t mode) {
 	if (!strcmp(path, ".") || !strcmp(path, "/")) return;
+	if (!mkdir(path, mode) || errno == EEXIST) return;
+	if (errno != ENOENT) {
+		struct stat st;
+		if (!stat(path, &st) && S_ISDIR(st.st_mode)) return;
+		throw_errno_verbose(path);
+	};
 	scope {
 		char *path_copy = string_new_set(path);
 		path_copy = dirname(path_copy);
 		kga_mkpath(path_copy, mode);
-		try {
-			mkdir(path, mode);
-		};
-		catch {
-			if (!exception_type_is(exception_type_mkdir_already_exists)) throw_proxy();
-		};
+		if (mkdir(path, mode) && errno != EEXIST) throw_errno_verbose(path);
 	};
 };
 
@@ -132,6 +149,27 @@ DIR *kga_opendir(const char *path) {
 	return dir;
 };
 
+int kga_openat(int dir_fd, const char *path, int flags) {
+	int *fd = kga_malloc(sizeof(int));
+	*fd = -1;
+	scope_add(fd, kga_free_fd);
+	if ((*fd = openat(dir_fd, path, flags | O_CLOEXEC)) < 0) throw_errno_verbose(path);
+	return *fd;
+};
+
+void kga_fstatat(int dir_fd, const char *path, struct stat *stat) {
+	if (fstatat(dir_fd, path, stat, AT_SYMLINK_NOFOLLOW)) {
+		throw_errno_verbose(path);
+	};
+};
+
+/* Reads as many directory entries as fit into the buffer, 0 at the end of directory. */
+size_t kga_getdents64(int fd, void *buffer, size_t size) {
+	long int readed = syscall(SYS_getdents64, fd, buffer, size);
+	if (readed < 0) throw_errno();
+	return readed;
+};
+
 void kga_lstat(const char *path, struct stat *stat) {
 	if (lstat(path, stat)) {
 		throw_errno_verbose(path);
@@ -169,6 +207,20 @@ void kga_rename(const char *old_path, const char *new_path) {
 	if (rename(old_path, new_path)) throw_errno_verbose(new_path);
 };
 
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+/* Swaps two existing paths atomically. 0 when one of them is missing or the
+ * kernel or filesystem can not exchange, so the caller can do it the old way. */
+int kga_rename_exchange(const char *path1, const char *path2) {
+#ifdef SYS_renameat2
+	if (!syscall(SYS_renameat2, AT_FDCWD, path1, AT_FDCWD, path2, RENAME_EXCHANGE)) return 1;
+	if (errno != ENOENT && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) throw_errno_verbose(path2);
+#endif
+	return 0;
+};
+
 void kga_fflush_and_fsync(FILE *file) {
 	if (fflush(file)) throw_errno();
 	if (fsync(fileno(file))) throw_errno();
@@ -4,6 +4,14 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+struct kga_dirent64 {
+	unsigned long long int d_ino;
+	long long int d_off;
+	unsigned short int d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
 exception_type_t exception_type_fopen_no_such_file;
 exception_type_t exception_type_mkdir_already_exists;
 exception_type_t exception_type_glob_nospace;
@@ -13,6 +21,7 @@ exception_type_t exception_type_glob_nomatch;
 int kga_fork();
 int *kga_pipe();
 void kga_dup2(int oldfd, int newfd);
+int kga_dup(int fd);
 void kga_mkdir(const char *path, mode_t mode);
 void kga_rmdir(const char *path);
 void *kga_malloc(size_t size);
@@ -21,11 +30,15 @@ FILE *kga_fopen(const char *path, const char *opt);
 size_t kga_fread(void *ptr, size_t size, size_t nmemb, FILE *stream);
 size_t kga_fwrite(void *ptr, size_t size, size_t nmemb, FILE *stream);
 DIR *kga_opendir(const char *path);
+int kga_openat(int dir_fd, const char *path, int flags);
+void kga_fstatat(int dir_fd, const char *path, struct stat *stat);
+size_t kga_getdents64(int fd, void *buffer, size_t size);
 void kga_mkpath(const char *path, mode_t mode);
 void kga_chdir(const char *path);
 void kga_mkdtemp(char *template);
 void kga_chown(const char *path, uid_t uid, gid_t gid);
 void kga_rename(const char *old_path, const char *new_path);
+int kga_rename_exchange(const char *path1, const char *path2);
 char **kga_glob(const char *pattern);
 void kga_lstat(const char *path, struct stat *stat);
 int kga_lstat_skip_enoent(const char *path, struct stat *stat);
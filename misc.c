@@ -1,11 +1,18 @@
-#define  _XOPEN_SOURCE 600
+#define  _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
 #include <kga/kga.h>
 #include <kga/exception.h>
 #include <kga/array.h>
 #include <kga/string.h>
 #include "kga_wrappers.h"
+#include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
 
 char **file_lines(const char *path) {
 	important_check(path);
@@ -69,23 +76,260 @@ char *string_from_file(const char *path) {
 	return out;
 };
 
-void rmrf(const char *path) {
+#define RMRF_BUFFER_SIZE 65536
+// entries removed before the rest of the tree is split between processes
+#define RMRF_SERIAL_ENTRIES 4096
+
+static void rmrf_dir(int dir_fd, char *buffer);
+static size_t rmrf_removed;
+
+static unsigned char rmrf_type(int dir_fd, const char *name, unsigned char type) {
+	if (type == DT_UNKNOWN) {
+		struct stat st;
+		if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+			if (errno != ENOENT) throw_errno_verbose(name);
+		} else {
+			type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+		};
+	};
+	return type;
+};
+
+static void rmrf_entry(int dir_fd, const char *name, unsigned char type, char *buffer) {
+	if (type == DT_DIR) {
+		scope {
+			int fd = kga_openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			rmrf_dir(fd, buffer);
+		};
+		unlinkat(dir_fd, name, AT_REMOVEDIR);
+	} else {
+		unlinkat(dir_fd, name, 0);
+	};
+	rmrf_removed++;
+};
+
+/* Removes files while reading the directory, subdirectories once it is read, so
+ * one buffer is enough for the whole tree. Returns subdirectories instead of
+ * descending when sub_dirs is given. */
+static void rmrf_dir_entries(int dir_fd, char *buffer, char ***sub_dirs) {
+	scope {
+		char **dirs = array_new(char *, 0, 0);
+		size_t readed;
+		while ((readed = kga_getdents64(dir_fd, buffer, RMRF_BUFFER_SIZE))) {
+			for (size_t position = 0; position < readed; ) {
+				struct kga_dirent64 *dirent = (struct kga_dirent64 *)(buffer + position);
+				position += dirent->d_reclen;
+				if (dirent->d_name[0] == '.' && (dirent->d_name[1] == '\0' || (dirent->d_name[1] == '.' && dirent->d_name[2] == '\0'))) continue;
+				unsigned char type = rmrf_type(dir_fd, dirent->d_name, dirent->d_type);
+				if (type == DT_UNKNOWN) continue;
+				if (type == DT_DIR) {
+					if (sub_dirs) {
+						scope_use_previous {
+							array_push(*sub_dirs, string_new_set(dirent->d_name));
+						};
+					} else {
+						array_push(dirs, string_new_set(dirent->d_name));
+					};
+				} else {
+					rmrf_entry(dir_fd, dirent->d_name, type, buffer);
+				};
+			};
+		};
+		array_foreach(dirs, char **, each_dir) {
+			rmrf_entry(dir_fd, *each_dir, DT_DIR, buffer);
+		};
+	};
+};
+
+static void rmrf_dir(int dir_fd, char *buffer) {
+	rmrf_dir_entries(dir_fd, buffer, NULL);
+};
+
+/* Sibling subtrees of path are split between up to jobs processes, once the
+ * first RMRF_SERIAL_ENTRIES entries show the tree is worth it. Small trees go
+ * without a fork. */
+static void rmrf_jobs(const char *path, long int jobs) {
 	struct stat st;
 	if (kga_lstat_skip_enoent(path, &st)) return;
-	if (S_ISDIR(st.st_mode)) {
-		scope {
-			char *sub_path = string_new();
-			DIR *dir = kga_opendir(path);
-			for (struct dirent *dirent; (dirent = readdir(dir)); ) {
-				if (dirent->d_name[0] == '.' && (dirent->d_name[1] == '\0' || (dirent->d_name[1] == '.' && dirent->d_name[2] == '\0'))) {
-					continue;
+	if (!S_ISDIR(st.st_mode)) {
+		remove(path);
+		return;
+	};
+	scope {
+		char *buffer = kga_malloc(RMRF_BUFFER_SIZE);
+		scope_add(buffer, free);
+		int dir_fd = kga_openat(AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		char **sub_dirs = array_new(char *, 0, 0);
+		rmrf_removed = 0;
+		rmrf_dir_entries(dir_fd, buffer, &sub_dirs);
+		long int sub_dirs_count = array_length(sub_dirs), first = 0;
+		while (first < sub_dirs_count && rmrf_removed < RMRF_SERIAL_ENTRIES) {
+			rmrf_entry(dir_fd, sub_dirs[first++], DT_DIR, buffer);
+		};
+		if (jobs > sub_dirs_count - first) jobs = sub_dirs_count - first;
+		if (jobs < 2) {
+			for (long int i = first; i < sub_dirs_count; i++) {
+				rmrf_entry(dir_fd, sub_dirs[i], DT_DIR, buffer);
+			};
+		} else {
+			pid_t *workers = array_new(pid_t, 0, 0);
+			fflush(NULL);
+			for (long int worker = 0; worker < jobs; worker++) {
+				pid_t pid = kga_fork();
+				if (!pid) {
+					int ret = EXIT_SUCCESS;
+					try {
+						for (long int i = first + worker; i < sub_dirs_count; i += jobs) {
+							rmrf_entry(dir_fd, sub_dirs[i], DT_DIR, buffer);
+						};
+					};
+					catch {
+						ret = EXIT_FAILURE;
+					};
+					_exit(ret);
 				};
-				string_fmt(sub_path, "%s/%s", path, dirent->d_name);
-				rmrf(sub_path);
+				array_push(workers, pid);
+			};
+			array_foreach(workers, pid_t *, each_worker) {
+				waitpid(*each_worker, NULL, 0);
+			};
+		};
+	};
+	rmdir(path);
+};
+
+void rmrf(const char *path) {
+	long int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	rmrf_jobs(path, jobs > 1 ? jobs : 1);
+};
+
+static void close_fds_from(int first) {
+#ifdef SYS_close_range
+	if (!syscall(SYS_close_range, first, ~0U, 0)) return;
+#endif
+	for (long int fd = first, max = sysconf(_SC_OPEN_MAX); fd < max; fd++) close(fd);
+};
+
+/* The intermediate child is reaped right away, so the remover never shows up in
+ * waitpid() of the caller. It keeps none of the caller's files open past the
+ * standard ones, pipes of the caller see their EOF without waiting for it. */
+void rmrf_background(const char *path) {
+	fflush(NULL);
+	pid_t pid = kga_fork();
+	if (!pid) {
+		if (!fork()) {
+			int ret = EXIT_SUCCESS;
+			close_fds_from(3);
+			try rmrf(path);
+			catch ret = EXIT_FAILURE;
+			_exit(ret);
+		};
+		_exit(EXIT_SUCCESS);
+	};
+	waitpid(pid, NULL, 0);
+};
+
+static long long int disk_usage_dir(int dir_fd, char *buffer) {
+	long long int usage = 0;
+	scope {
+		char **dirs = array_new(char *, 0, 0);
+		size_t readed;
+		while ((readed = kga_getdents64(dir_fd, buffer, RMRF_BUFFER_SIZE))) {
+			for (size_t position = 0; position < readed; ) {
+				struct kga_dirent64 *dirent = (struct kga_dirent64 *)(buffer + position);
+				position += dirent->d_reclen;
+				if (dirent->d_name[0] == '.' && (dirent->d_name[1] == '\0' || (dirent->d_name[1] == '.' && dirent->d_name[2] == '\0'))) continue;
+				struct stat st;
+				if (fstatat(dir_fd, dirent->d_name, &st, AT_SYMLINK_NOFOLLOW)) continue;
+				usage += (long long int)st.st_blocks * 512;
+				if (S_ISDIR(st.st_mode)) array_push(dirs, string_new_set(dirent->d_name));
+			};
+		};
+		array_foreach(dirs, char **, each_dir) {
+			scope {
+				int fd = kga_openat(dir_fd, *each_dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+				usage += disk_usage_dir(fd, buffer);
+			};
+		};
+	};
+	return usage;
+};
+
+/* Allocated size of a tree in bytes, like du -s. */
+long long int disk_usage(const char *path) {
+	long long int usage = 0;
+	struct stat st;
+	if (kga_lstat_skip_enoent(path, &st)) return 0;
+	usage = (long long int)st.st_blocks * 512;
+	if (!S_ISDIR(st.st_mode)) return usage;
+	scope {
+		char *buffer = kga_malloc(RMRF_BUFFER_SIZE);
+		scope_add(buffer, free);
+		int dir_fd = kga_openat(AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		usage += disk_usage_dir(dir_fd, buffer);
+	};
+	return usage;
+};
+
+/* Byte count with an optional K, M, G or T suffix, -1 when malformed. */
+long long int parse_size(const char *string) {
+	char *end;
+	long long int size = strtoll(string, &end, 10);
+	if (end == string || size < 0) return -1;
+	switch (*end) {
+	case 'T': case 't': size *= 1024;
+	/* fall through */
+	case 'G': case 'g': size *= 1024;
+	/* fall through */
+	case 'M': case 'm': size *= 1024;
+	/* fall through */
+	case 'K': case 'k': size *= 1024;
+		end++;
+		break;
+	};
+	return *end ? -1 : size;
+};
+
+#define STRINGS_SORT_SMALL 16
+#define STRINGS_SORT_CHAR(strings, i, depth) ((unsigned char)(strings)[i][depth])
+
+static void strings_swap(char **strings, size_t i, size_t j) {
+	char *tmp = strings[i];
+	strings[i] = strings[j];
+	strings[j] = tmp;
+};
+
+/* Multikey quicksort, every string in strings[0..n) shares its first depth bytes. */
+static void strings_sort_depth(char **strings, size_t n, size_t depth) {
+	while (n > STRINGS_SORT_SMALL) {
+		strings_swap(strings, 0, n / 2);
+		int pivot = STRINGS_SORT_CHAR(strings, 0, depth);
+		size_t lt = 0, gt = n;
+		for (size_t i = 0; i < gt; ) {
+			int c = STRINGS_SORT_CHAR(strings, i, depth);
+			if (c < pivot) {
+				strings_swap(strings, lt++, i++);
+			} else if (c > pivot) {
+				strings_swap(strings, i, --gt);
+			} else {
+				i++;
 			};
 		};
+		strings_sort_depth(strings, lt, depth);
+		if (pivot) strings_sort_depth(strings + lt, gt - lt, depth + 1);
+		strings += gt;
+		n -= gt;
 	};
-	remove(path);
+	for (size_t i = 1; i < n; i++) {
+		for (size_t j = i; j > 0 && strcmp(strings[j - 1] + depth, strings[j] + depth) > 0; j--) {
+			strings_swap(strings, j - 1, j);
+		};
+	};
+};
+
+/* Sorts in strcmp order, without comparing long common prefixes again and again. */
+void strings_sort(char **strings) {
+	strings_sort_depth(strings, array_length(strings), 0);
 };
 
 struct restore_sigaction {
@@ -2,6 +2,10 @@
 char **file_lines(const char *path);
 char *string_from_file(const char *path);
 void lines_to_file(char **lines, const char *path);
-void *rmrf(const char *path);
+void strings_sort(char **strings);
+void rmrf(const char *path);
+void rmrf_background(const char *path);
+long long int disk_usage(const char *path);
+long long int parse_size(const char *string);
 void set_signal_handler(int num, void (*handler)(int));
 char *shell_escape(const char *string);
@@ -0,0 +1,261 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include "pathlist.h"
+
+static void pathlist_put_u32(unsigned char *data, uint32_t value) {
+	for (int i = 0; i < 4; i++) data[i] = value >> (8 * i);
+};
+
+static uint32_t pathlist_get_u32(const unsigned char *data) {
+	return (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+};
+
+static size_t pathlist_put_varint(unsigned char *data, size_t value) {
+	size_t size = 0;
+	do {
+		data[size++] = (value & 0x7f) | (value > 0x7f ? 0x80 : 0);
+		value >>= 7;
+	} while (value);
+	return size;
+};
+
+/* 0 when the varint runs past end. */
+static size_t pathlist_get_varint(const unsigned char *data, const unsigned char *end, size_t *value) {
+	size_t size = 0;
+	*value = 0;
+	while (data + size < end && size < 5) {
+		*value |= (size_t)(data[size] & 0x7f) << (7 * size);
+		if (!(data[size++] & 0x80)) return size;
+	};
+	return 0;
+};
+
+static int pathlist_string_compare(const void *ptr1, const void *ptr2) {
+	return strcmp(*(char * const *)ptr1, *(char * const *)ptr2);
+};
+
+int pathlist_encoded(const void *data, size_t size) {
+	return size >= PATHLIST_HEADER_SIZE && !memcmp(data, PATHLIST_MAGIC, PATHLIST_MAGIC_SIZE);
+};
+
+/* Paths are sorted first when they are not already. */
+int pathlist_build(struct pathlist *list, char **paths, size_t count) {
+	char **sorted = paths;
+	for (size_t i = 1; i < count; i++) {
+		if (strcmp(paths[i - 1], paths[i]) > 0) {
+			if (!(sorted = malloc(count * sizeof(char *)))) return ENOMEM;
+			memcpy(sorted, paths, count * sizeof(char *));
+			qsort(sorted, count, sizeof(char *), pathlist_string_compare);
+			break;
+		};
+	};
+	size_t restarts_count = (count + PATHLIST_RESTART_INTERVAL - 1) / PATHLIST_RESTART_INTERVAL;
+	size_t size = PATHLIST_HEADER_SIZE + restarts_count * 4;
+	for (size_t i = 0; i < count; i++) size += strlen(sorted[i]) + 10;
+	int ret = 0;
+	memset(list, 0, sizeof(struct pathlist));
+	if (!(list->buffer = malloc(size))) {
+		if (sorted != paths) free(sorted);
+		return ENOMEM;
+	};
+	unsigned char *restarts = list->buffer + PATHLIST_HEADER_SIZE;
+	unsigned char *entries = restarts + restarts_count * 4;
+	size_t offset = 0, previous_length = 0;
+	for (size_t i = 0; !ret && i < count; i++) {
+		size_t length = strlen(sorted[i]), shared = 0;
+		if (length >= PATHLIST_PATH_MAX) {
+			ret = ENAMETOOLONG;
+			break;
+		};
+		if (i % PATHLIST_RESTART_INTERVAL) {
+			while (shared < length && shared < previous_length && sorted[i][shared] == sorted[i - 1][shared]) shared++;
+		} else {
+			pathlist_put_u32(restarts + i / PATHLIST_RESTART_INTERVAL * 4, offset);
+		};
+		offset += pathlist_put_varint(entries + offset, shared);
+		offset += pathlist_put_varint(entries + offset, length - shared);
+		memcpy(entries + offset, sorted[i] + shared, length - shared);
+		offset += length - shared;
+		previous_length = length;
+	};
+	if (sorted != paths) free(sorted);
+	if (ret) {
+		pathlist_free(list);
+		return ret;
+	};
+	memcpy(list->buffer, PATHLIST_MAGIC, PATHLIST_MAGIC_SIZE);
+	pathlist_put_u32(list->buffer + 8, count);
+	pathlist_put_u32(list->buffer + 12, restarts_count);
+	pathlist_put_u32(list->buffer + 16, offset);
+	return pathlist_parse(list, list->buffer, PATHLIST_HEADER_SIZE + restarts_count * 4 + offset);
+};
+
+/* The list takes the buffer over when it is valid. */
+int pathlist_parse(struct pathlist *list, unsigned char *buffer, size_t size) {
+	if (!pathlist_encoded(buffer, size)) return EINVAL;
+	size_t count = pathlist_get_u32(buffer + 8);
+	size_t restarts_count = pathlist_get_u32(buffer + 12);
+	size_t entries_size = pathlist_get_u32(buffer + 16);
+	if (restarts_count != (count + PATHLIST_RESTART_INTERVAL - 1) / PATHLIST_RESTART_INTERVAL) return EINVAL;
+	if (size != PATHLIST_HEADER_SIZE + restarts_count * 4 + entries_size) return EINVAL;
+	for (size_t i = 0; i < restarts_count; i++) {
+		if (pathlist_get_u32(buffer + PATHLIST_HEADER_SIZE + i * 4) >= entries_size) return EINVAL;
+	};
+	list->buffer = buffer;
+	list->size = size;
+	list->count = count;
+	list->restarts_count = restarts_count;
+	list->restarts = buffer + PATHLIST_HEADER_SIZE;
+	list->entries = list->restarts + restarts_count * 4;
+	list->entries_size = entries_size;
+	return 0;
+};
+
+void pathlist_free(struct pathlist *list) {
+	free(list->buffer);
+	list->buffer = NULL;
+	list->count = 0;
+};
+
+void pathlist_iter_init(struct pathlist_iter *iter, const struct pathlist *list) {
+	iter->list = list;
+	iter->index = 0;
+	iter->offset = 0;
+	iter->length = 0;
+	iter->path[0] = '\0';
+};
+
+/* NULL at the end and for a damaged list. The path lives in the iterator
+ * until the next call. */
+const char *pathlist_next(struct pathlist_iter *iter) {
+	const struct pathlist *list = iter->list;
+	if (iter->index >= list->count) return NULL;
+	const unsigned char *data = list->entries + iter->offset, *end = list->entries + list->entries_size;
+	size_t shared, suffix, size;
+	if (!(size = pathlist_get_varint(data, end, &shared))) return NULL;
+	data += size;
+	if (!(size = pathlist_get_varint(data, end, &suffix))) return NULL;
+	data += size;
+	if (shared > iter->length || shared + suffix >= PATHLIST_PATH_MAX || suffix > (size_t)(end - data)) return NULL;
+	memcpy(iter->path + shared, data, suffix);
+	iter->length = shared + suffix;
+	iter->path[iter->length] = '\0';
+	iter->offset = data + suffix - list->entries;
+	iter->index++;
+	return iter->path;
+};
+
+static void pathlist_restart(struct pathlist_iter *iter, size_t restart) {
+	iter->index = restart * PATHLIST_RESTART_INTERVAL;
+	iter->offset = pathlist_get_u32(iter->list->restarts + restart * 4);
+	iter->length = 0;
+};
+
+/* Compares a whole stored entry of the restart table with path. */
+static int pathlist_restart_compare(const struct pathlist *list, size_t restart, const char *path) {
+	const unsigned char *data = list->entries + pathlist_get_u32(list->restarts + restart * 4), *end = list->entries + list->entries_size;
+	size_t shared, suffix, size;
+	if (!(size = pathlist_get_varint(data, end, &shared))) return -1;
+	data += size;
+	if (!(size = pathlist_get_varint(data, end, &suffix)) || suffix > (size_t)(end - data - size)) return -1;
+	data += size;
+	size_t length = strlen(path);
+	int ret = memcmp(data, path, suffix < length ? suffix : length);
+	if (ret) return ret;
+	return suffix < length ? -1 : suffix > length;
+};
+
+/* Moves to the first path not less than path and returns it. */
+const char *pathlist_seek(struct pathlist_iter *iter, const char *path) {
+	const struct pathlist *list = iter->list;
+	size_t low = 0, high = list->restarts_count;
+	while (low < high) {
+		size_t middle = (low + high) / 2;
+		if (pathlist_restart_compare(list, middle, path) <= 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		};
+	};
+	if (low) {
+		pathlist_restart(iter, low - 1);
+	} else {
+		pathlist_iter_init(iter, list);
+	};
+	const char *each_path;
+	while ((each_path = pathlist_next(iter))) {
+		if (strcmp(each_path, path) >= 0) return each_path;
+	};
+	return NULL;
+};
+
+const char *pathlist_get(struct pathlist_iter *iter, size_t index) {
+	if (index >= iter->list->count) return NULL;
+	if (iter->index > index || iter->index / PATHLIST_RESTART_INTERVAL != index / PATHLIST_RESTART_INTERVAL) {
+		pathlist_restart(iter, index / PATHLIST_RESTART_INTERVAL);
+	};
+	const char *path = NULL;
+	while (iter->index <= index && (path = pathlist_next(iter)));
+	return path;
+};
+
+int pathlist_contains(const struct pathlist *list, const char *path) {
+	struct pathlist_iter iter;
+	pathlist_iter_init(&iter, list);
+	const char *found = pathlist_seek(&iter, path);
+	return found && !strcmp(found, path);
+};
+
+struct pathlist_merge_head {
+	size_t list;
+	struct pathlist_iter iter;
+	const char *path;
+};
+
+static int pathlist_merge_less(struct pathlist_merge_head *heads, size_t *heap, size_t i, size_t j) {
+	int ret = strcmp(heads[heap[i]].path, heads[heap[j]].path);
+	return ret < 0 || (!ret && heads[heap[i]].list < heads[heap[j]].list);
+};
+
+static void pathlist_merge_down(struct pathlist_merge_head *heads, size_t *heap, size_t size, size_t i) {
+	while (1) {
+		size_t smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+		if (left < size && pathlist_merge_less(heads, heap, left, smallest)) smallest = left;
+		if (right < size && pathlist_merge_less(heads, heap, right, smallest)) smallest = right;
+		if (smallest == i) return;
+		size_t swap = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = swap;
+		i = smallest;
+	};
+};
+
+/* Calls emit for every path of the lists in sorted order, decoding each list
+ * once from start to end. Equal paths come in the order of the lists. */
+int pathlist_merge(const struct pathlist **lists, size_t count, void (*emit)(void *data, size_t list, size_t index, const char *path), void *data) {
+	struct pathlist_merge_head *heads = malloc((count ? count : 1) * sizeof(struct pathlist_merge_head));
+	size_t *heap = malloc((count ? count : 1) * sizeof(size_t));
+	if (!heads || !heap) {
+		free(heads);
+		free(heap);
+		return ENOMEM;
+	};
+	size_t size = 0;
+	for (size_t i = 0; i < count; i++) {
+		heads[i].list = i;
+		pathlist_iter_init(&heads[i].iter, lists[i]);
+		if ((heads[i].path = pathlist_next(&heads[i].iter))) heap[size++] = i;
+	};
+	for (size_t i = size; i-- > 0; ) pathlist_merge_down(heads, heap, size, i);
+	while (size) {
+		struct pathlist_merge_head *head = &heads[heap[0]];
+		emit(data, head->list, head->iter.index - 1, head->path);
+		if (!(head->path = pathlist_next(&head->iter))) heap[0] = heap[--size];
+		pathlist_merge_down(heads, heap, size, 0);
+	};
+	free(heads);
+	free(heap);
+	return 0;
+};
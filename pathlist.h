@@ -0,0 +1,47 @@
+#ifndef _PATHLIST_H_
+#define _PATHLIST_H_
+
+#include <stddef.h>
+
+/* Sorted paths, front coded: each entry keeps the length of the prefix it
+ * shares with the one before and the rest of the path. Every
+ * PATHLIST_RESTART_INTERVAL entries one is stored whole, with its offset in
+ * the restart table, so a path is found by a binary search over the restarts
+ * and a short scan. The same block is the file on disk and the list in
+ * memory. Plain C, errno values on failure. */
+
+#define PATHLIST_MAGIC "/fcoded1"
+#define PATHLIST_MAGIC_SIZE 8
+#define PATHLIST_HEADER_SIZE 20
+#define PATHLIST_RESTART_INTERVAL 16
+#define PATHLIST_PATH_MAX 4096
+
+struct pathlist {
+	unsigned char *buffer;
+	size_t size;
+	size_t count;
+	size_t restarts_count;
+	const unsigned char *restarts;
+	const unsigned char *entries;
+	size_t entries_size;
+};
+
+struct pathlist_iter {
+	const struct pathlist *list;
+	size_t index;
+	size_t offset;
+	size_t length;
+	char path[PATHLIST_PATH_MAX];
+};
+
+int pathlist_encoded(const void *data, size_t size);
+int pathlist_build(struct pathlist *list, char **paths, size_t count);
+int pathlist_parse(struct pathlist *list, unsigned char *buffer, size_t size);
+void pathlist_free(struct pathlist *list);
+void pathlist_iter_init(struct pathlist_iter *iter, const struct pathlist *list);
+const char *pathlist_next(struct pathlist_iter *iter);
+const char *pathlist_seek(struct pathlist_iter *iter, const char *path);
+const char *pathlist_get(struct pathlist_iter *iter, size_t index);
+int pathlist_contains(const struct pathlist *list, const char *path);
+int pathlist_merge(const struct pathlist **lists, size_t count, void (*emit)(void *data, size_t list, size_t index, const char *path), void *data);
+#endif
@@ -1,81 +1,73 @@
 #define _XOPEN_SOURCE 600
 #define _POSIX_SOURCE
+#define _DEFAULT_SOURCE
 #include <kga/kga.h>
 #include <kga/string.h>
 #include <kga/exception.h>
 
 #include "misc.h"
 #include "pkg.h"
+#include "pkg_internal.h"
 #include "kga_wrappers.h"
+#include "profile.h"
+#include "hash.h"
 
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <limits.h>
+#include <string.h>
 #include <stdlib.h>
-#define PKG_FILE_DIR 1
-#define PKG_FILE_LNK 2
+#include <time.h>
+
+#ifndef F_OFD_GETLK
+#define F_OFD_GETLK 36
+#define F_OFD_SETLK 37
+#define F_OFD_SETLKW 38
+#endif
 
 int (*pkg_confirm)(const char *fmt, ...) = NULL;
-int string_compare(const void *, const void *);
+long int pkg_lock_timeout = -1;
 
 exception_type_t exception_type_pkg_files_conflict = {};
 exception_type_t exception_type_pkg_db_already_locked = {};
 exception_type_t exception_type_pkg_already_installed = {};
 exception_type_t pkg_aborted_by_user = {};
-
-struct pkg_file {
-	int flags;
-	char *path;
-};
-
-struct pkg_fs_transaction {
-	const char *from, *to, *backup;
-};
-
-struct pkg {
-	const char *path;
-	const char *name;
-	const char *version;
-	struct pkg_file *files;
-};
-
-struct pkg_info {
-	const char *name;
-	const char *version;
-	char **files;
-};
-
-struct pkg_db {
-	const char *lock_path;
-	const char *path;
-	const char *root;
-	int lock_counter;
-	pid_t lock_pid;
-	struct pkg_info *pkgs;
-};
-
-struct pkg_db_conflict {
-	struct pkg_info *info;
-	char **files;
-};
+exception_type_t exception_type_pkg_verify_failed = {};
+exception_type_t exception_type_pkg_finish_failed = {};
 
 struct pkg_db *pkg_db_new(const char *root, const char *db_path) {
 	struct pkg_db *db = new(struct pkg_db);
 	db->path = string_new_fmt("%s/%s", root, db_path);
 	db->root = root;
-	db->lock_path = string_new_fmt("%s/.LOCK", db->path);
+	db->lock_path = string_new_fmt("%s/" PKG_DB_LOCK_NAME, db->path);
+	db->legacy_lock_path = string_new_fmt("%s/" PKG_DB_LEGACY_LOCK_NAME, db->path);
+	db->legacy_lock_mark_path = string_new_fmt("%s/" PKG_DB_LEGACY_LOCK_MARK_NAME, db->path);
 	db->lock_counter = 0;
+	db->lock_fd = -1;
 	db->lock_pid = 0;
+	db->generation = 0;
+	db->pool = scope_current();
 	db->pkgs = array_new(struct pkg_info, 0, ARRAY_NULL_TERMINATED);
 	return db;
 };
 
 void pkg_db_drop(struct pkg_db *db, struct pkg_info *info, FILE *warning_stream);
+static void pkg_db_drop_many(struct pkg_db *db, struct pkg_info **drop, FILE *warning_stream);
 
+/* Files being replaced are swapped with the staged ones in one step where the
+ * filesystem can, the old file is left at the staged name until the cleanup
+ * pass. Elsewhere the old file goes to the backup name first. */
 void transaction_fs_transactions_commit(struct pkg_fs_transaction *transactions, FILE *warning_stream) {
 	array_foreach(transactions, struct pkg_fs_transaction *, each_transaction) {
+		if (each_transaction->backup && kga_rename_exchange(each_transaction->from, each_transaction->to)) {
+			each_transaction->exchanged = 1;
+			if (warning_stream) fprintf(warning_stream, "Exchanging %s <-> %s\n", each_transaction->from, each_transaction->to);
+			continue;
+		};
 		if (each_transaction->backup && kga_file_exists(each_transaction->to)) {
 			if (warning_stream) fprintf(warning_stream, "Renaming %s -> %s\n", each_transaction->to, each_transaction->backup);
 			kga_rename(each_transaction->to, each_transaction->backup);
@@ -84,7 +76,10 @@ void transaction_fs_transactions_commit(struct pkg_fs_transaction *transactions,
 		if (warning_stream) fprintf(warning_stream, "Renaming %s -> %s\n", each_transaction->from, each_transaction->to);
 	};
 	array_foreach(transactions, struct pkg_fs_transaction *, each_transaction) {
-		if (each_transaction->backup) {
+		if (each_transaction->exchanged) {
+			if (warning_stream) fprintf(warning_stream, "Removing %s\n", each_transaction->from);
+			remove(each_transaction->from);
+		} else if (each_transaction->backup) {
 			if (warning_stream) fprintf(warning_stream, "Removing %s\n", each_transaction->backup);
 			remove(each_transaction->backup);
 		};
@@ -93,7 +88,12 @@ void transaction_fs_transactions_commit(struct pkg_fs_transaction *transactions,
 
 void transaction_fs_transactions_rollback(struct pkg_fs_transaction *transactions, FILE *warning_stream) {
 	array_foreach(transactions, struct pkg_fs_transaction *, each_transaction) {
-		if (each_transaction->backup) {
+		if (each_transaction->exchanged) {
+			// swapping again puts the old file back and the new one at the staged name
+			if (warning_stream) fprintf(warning_stream, "Exchanging %s <-> %s\n", each_transaction->to, each_transaction->from);
+			if (!kga_rename_exchange(each_transaction->to, each_transaction->from)) rename(each_transaction->from, each_transaction->to);
+			each_transaction->exchanged = 0;
+		} else if (each_transaction->backup) {
 			if (warning_stream) fprintf(warning_stream, "Renaming %s -> %s\n", each_transaction->backup, each_transaction->to);
 			rename(each_transaction->backup, each_transaction->to);
 		};
@@ -102,11 +102,23 @@ void transaction_fs_transactions_rollback(struct pkg_fs_transaction *transaction
 	};
 };
 
+/* Any version of name when version is NULL. */
 int pkg_db_installed(struct pkg_db *db, const char *name, const char *version) {
 	int installed = 0;
 	scope {
-		char *pkg_info_path = string_new_fmt("%s/%s/%s", db->path, name, version);
-		if (access(pkg_info_path, F_OK)) {
+		char *pkg_info_path = string_new_fmt("%s/%s/%s", db->path, name, version ? version : "");
+		DIR *versions_dir;
+		if (!version) {
+			if ((versions_dir = opendir(pkg_info_path))) {
+				struct dirent *dirent;
+				while ((dirent = readdir(versions_dir))) {
+					if (dirent->d_name[0] != '.') installed = 1;
+				};
+				closedir(versions_dir);
+			} else if (errno != ENOENT) {
+				throw_errno_verbose(pkg_info_path);
+			};
+		} else if (access(pkg_info_path, F_OK)) {
 			if (errno != ENOENT) {
 				throw_errno_verbose(pkg_info_path);
 			};
@@ -126,6 +138,66 @@ int pkg_installed(const char *pkg_root, const char *db_path, const char *name, c
 	return installed;
 };
 
+/* Writers hold an exclusive OFD lock on the lock file for the whole
+ * transaction, readers take no lock. The generation is odd only while a writer
+ * changes database files, around commits and drops; staging and hooks leave it
+ * even. Readers load again until they see the same even generation before and
+ * after, so they get a consistent snapshot and never hold a writer up. Older
+ * binaries know neither, their writers are kept out by the .LOCK directory
+ * (pkg_db_legacy_lock) but readers see their commits half way. */
+unsigned long long int pkg_db_generation(struct pkg_db *db) {
+	unsigned long long int generation;
+	int ret = pkgdb_read_generation(db->path, &generation);
+	if (ret) {
+		errno = ret;
+		throw_errno_verbose(db->path);
+	};
+	return generation;
+};
+
+/* Does not throw, the last unlock runs while scopes unwind. */
+static int pkg_db_generation_set(struct pkg_db *db, unsigned long long int generation) {
+	int ret = -1;
+	scope {
+		char *path = string_new_fmt("%s/" PKG_DB_GENERATION_NAME, db->path);
+		char *tmp_path = string_new_fmt("%s.tmp", path);
+		char *string = string_new_fmt("%llu\n", generation);
+		int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd >= 0) {
+			ret = write(fd, string, string_length(string)) == (ssize_t)string_length(string) ? 0 : -1;
+			if (close(fd)) ret = -1;
+			if (!ret) ret = rename(tmp_path, path);
+		};
+	};
+	if (!ret) db->generation = generation;
+	return ret;
+};
+
+static void pkg_db_sleep() {
+	struct timespec ts = {0, PKG_DB_POLL_INTERVAL * 1000};
+	nanosleep(&ts, NULL);
+};
+
+static int pkg_db_timed_out(long long int start) {
+	return pkg_lock_timeout >= 0 && profile_now() - start >= (long long int)pkg_lock_timeout * 1000000;
+};
+
+static int pkg_db_read_timed_out(long long int start) {
+	long int timeout = pkg_lock_timeout < 0 ? PKG_READ_TIMEOUT : pkg_lock_timeout;
+	return profile_now() - start >= (long long int)timeout * 1000000;
+};
+
+/* Database files change between begin and end only. */
+static void pkg_db_write_begin(struct pkg_db *db) {
+	if (db->generation & 1) return;
+	if (pkg_db_generation_set(db, db->generation + 1)) throw_errno_verbose(db->path);
+};
+
+static void pkg_db_write_end(struct pkg_db *db) {
+	if (!(db->generation & 1)) return;
+	if (pkg_db_generation_set(db, db->generation + 1)) throw_errno_verbose(db->path);
+};
+
 void pkg_db_unlock(void *db_ptr) {
 	if (!db_ptr) return;
 	struct pkg_db *db = db_ptr;
@@ -135,36 +207,216 @@ void pkg_db_unlock(void *db_ptr) {
 	};
 	db->lock_counter--;
 	if (!db->lock_counter) {
-		rmdir(db->lock_path);
+		if (db->generation & 1) pkg_db_generation_set(db, db->generation + 1);
+		unlink(db->legacy_lock_mark_path);
+		rmdir(db->legacy_lock_path);
+		close(db->lock_fd);
+		db->lock_fd = -1;
 	};
 };
 
+/* Binaries from before the lock file lock with the directory only, writers take
+ * it too while those may still run. The mark in it tells a directory left by a
+ * writer holding the lock file, stale once we hold that, from an older one. */
+static void pkg_db_legacy_lock(struct pkg_db *db, int fd) {
+	int error = 0;
+	if (mkdir(db->legacy_lock_path, 0700)) {
+		if ((error = errno) == EEXIST) error = access(db->legacy_lock_mark_path, F_OK) ? EEXIST : 0;
+	};
+	if (!error) {
+		int mark_fd = open(db->legacy_lock_mark_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+		if (mark_fd < 0) {
+			error = errno;
+		} else {
+			close(mark_fd);
+		};
+	};
+	if (!error) return;
+	close(fd);
+	if (error == EEXIST) throw(exception_type_pkg_db_already_locked, 1, "Package database locked by an older pkgng.", db->legacy_lock_path);
+	errno = error;
+	throw_errno_verbose(db->legacy_lock_path);
+};
+
 static void pkg_db_lock(struct pkg_db *db) {
 	kga_mkpath(db->path, 0755);
 	if (!db->lock_pid) {
 		db->lock_pid = getpid();
 	};
 	if (!db->lock_counter) {
-		try {
-			kga_mkdir(db->lock_path, 0700);
-		};
-		catch {
-			if (exception_type_is(exception_type_mkdir_already_exists)) {
+		int fd = open(db->lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		if (fd < 0) throw_errno_verbose(db->lock_path);
+		struct flock lock = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+		long long int start = profile_now();
+		while (fcntl(fd, pkg_lock_timeout < 0 ? F_OFD_SETLKW : F_OFD_SETLK, &lock)) {
+			int error = errno;
+			if (error == EAGAIN || error == EACCES || error == EINTR) {
+				if (!pkg_db_timed_out(start)) {
+					if (pkg_lock_timeout >= 0) pkg_db_sleep();
+					continue;
+				};
+				close(fd);
 				throw(exception_type_pkg_db_already_locked, 1, "Package database already locked.", db->lock_path);
-			} else {
-				throw_proxy();
 			};
+			close(fd);
+			errno = error;
+			throw_errno_verbose(db->lock_path);
 		};
+		pkg_db_legacy_lock(db, fd);
+		db->lock_fd = fd;
+		db->lock_counter++;
+		scope_add(db, pkg_db_unlock);
+		// odd if the previous writer died half way, what it left is what there is
+		db->generation = pkg_db_generation(db);
+		pkg_db_write_end(db);
+		return;
 	};
 	db->lock_counter++;
 	scope_add(db, pkg_db_unlock);
 };
 
-void pkg_db_load_pkgs(struct pkg_db *db, int load_files) {
+static void pkg_pathlist_free(void *ptr) {
+	pathlist_free(ptr);
+	free(ptr);
+};
+
+static struct pathlist *pkg_pathlist_alloc() {
+	struct pathlist *list = kga_malloc(sizeof(struct pathlist));
+	memset(list, 0, sizeof(struct pathlist));
+	scope_add(list, pkg_pathlist_free);
+	return list;
+};
+
+/* Front coded list of paths, freed with the scope. */
+struct pathlist *pkg_pathlist_new(char **paths, size_t count) {
+	struct pathlist *list = pkg_pathlist_alloc();
+	if ((errno = pathlist_build(list, paths, count))) throw_errno();
+	return list;
+};
+
+/* Whole file into a malloc()ed buffer with room for a terminating byte. */
+static unsigned char *pkg_file_read(const char *path, size_t *size) {
+	unsigned char *buffer = NULL;
+	scope {
+		FILE *file = kga_fopen(path, "r");
+		struct stat st;
+		if (fstat(fileno(file), &st)) throw_errno_verbose(path);
+		*size = st.st_size;
+		buffer = kga_malloc(*size + 1);
+		if (fread(buffer, 1, *size, file) != *size) {
+			free(buffer);
+			errno = EIO;
+			throw_errno_verbose(path);
+		};
+	};
+	return buffer;
+};
+
+/* Front coded lists are taken as they are, text ones of older databases are
+ * coded on load. */
+struct pathlist *pkg_db_info_files(const char *path) {
+	struct pathlist *list = pkg_pathlist_alloc();
+	scope {
+		size_t size;
+		list->buffer = pkg_file_read(path, &size);
+		if (pathlist_encoded(list->buffer, size)) {
+			if ((errno = pathlist_parse(list, list->buffer, size))) throw_errno_verbose(path);
+		} else {
+			char **lines = array_new(char *, 0, 0);
+			char *text = (char *)list->buffer;
+			text[size] = '\0';
+			for (char *line = text, *end; *line; line = end + 1) {
+				if ((end = strchr(line, '\n'))) *end = '\0';
+				if (*line) array_push(lines, line);
+				if (!end) break;
+			};
+			if (array_length(lines) && !strcmp(lines[0], PKG_DB_SORTED_HEADER)) array_delete_interval(lines, 0, 1);
+			struct pathlist coded;
+			if ((errno = pathlist_build(&coded, lines, array_length(lines)))) throw_errno_verbose(path);
+			pathlist_free(list);
+			*list = coded;
+		};
+	};
+	return list;
+};
+
+/* File list of an installed package, read on first use. Without the lock it
+ * is read within pkg_db_read, a list of another generation is refused. */
+struct pathlist *pkg_db_files(struct pkg_db *db, struct pkg_info *pkg_info) {
+	if (!pkg_info->files) {
+		scope {
+			char *path = string_new_fmt("%s/%s/%s", db->path, pkg_info->name, pkg_info->version);
+			scope_use((scope_pool_t *)db->pool) pkg_info->files = pkg_db_info_files(path);
+		};
+		if (!db->lock_counter && pkg_db_generation(db) != db->generation) {
+			pkg_info->files = NULL;
+			throw(exception_type_pkg_db_already_locked, 1, "Package database changed while reading.", db->path);
+		};
+	};
+	return pkg_info->files;
+};
+
+static uint64_t pkg_path_hash(const char *path) {
+	return hash_data(path, strlen(path));
+};
+
+static void pkg_bloom_free(void *ptr) {
+	bloom_free(ptr);
+	free(ptr);
+};
+
+static struct bloom *pkg_bloom_alloc() {
+	struct bloom *bloom = kga_malloc(sizeof(struct bloom));
+	memset(bloom, 0, sizeof(struct bloom));
+	scope_add(bloom, pkg_bloom_free);
+	return bloom;
+};
+
+/* Filter of every path of files, freed with the scope. */
+struct bloom *pkg_bloom_new(const struct pathlist *files) {
+	struct bloom *bloom = pkg_bloom_alloc();
+	if ((errno = bloom_init(bloom, files->count))) throw_errno();
+	struct pathlist_iter iter;
+	pathlist_iter_init(&iter, files);
+	for (const char *path; (path = pathlist_next(&iter)); ) {
+		bloom_add(bloom, pkg_path_hash(path));
+	};
+	return bloom;
+};
+
+/* NULL when the package has no filter or a damaged one, it is checked against
+ * the file list then. */
+static struct bloom *pkg_db_info_bloom(const char *path) {
+	unsigned char *buffer = NULL;
+	size_t size = 0;
+	try buffer = pkg_file_read(path, &size);
+	catch if (!exception_type_is(exception_type_fopen_no_such_file)) throw_proxy();
+	if (!buffer) return NULL;
+	struct bloom *bloom = pkg_bloom_alloc();
+	if (bloom_parse(bloom, buffer, size)) {
+		free(buffer);
+		return NULL;
+	};
+	return bloom;
+};
+
+/* Zero only when the package surely has none of the paths hashed. */
+static int pkg_info_may_have(struct pkg_info *pkg_info, uint64_t *hashes) {
+	if (!pkg_info->bloom) return 1;
+	array_foreach(hashes, uint64_t *, each_hash) {
+		if (bloom_may_contain(pkg_info->bloom, *each_hash)) return 1;
+	};
+	return 0;
+};
+
+/* load is PKG_DB_LOAD_FILES to read every file list up front, with
+ * PKG_DB_LOAD_BLOOMS lists that filters rule out need never be read. */
+static void pkg_db_load_pkgs_once(struct pkg_db *db, int load) {
 	scope_pool_t *start_scope = scope_current();
 	scope {
 		char *pkg_path = string_new();
 		char *version_path = string_new();
+		char *bloom_path = string_new();
 		DIR *pkgs_dir = kga_opendir(db->path);
 		DIR *versions_dir;
 		struct dirent *dirent;
@@ -178,15 +430,12 @@ void pkg_db_load_pkgs(struct pkg_db *db, int load_files) {
 				while ((version_dirent = readdir(versions_dir))) {
 					if (version_dirent->d_name[0] == '.') continue;
 					string_fmt(version_path, "%s/%s", pkg_path, version_dirent->d_name);
+					string_fmt(bloom_path, "%s/" PKG_DB_BLOOM_NAME, pkg_path, version_dirent->d_name);
 					scope_use(start_scope) {
 						pkg_info.name = string_new_set(dirent->d_name);
 						pkg_info.version = string_new_set(version_dirent->d_name);
-						if (load_files) {
-							pkg_info.files = file_lines(version_path);
-							array_sort(pkg_info.files, string_compare);
-						} else {
-							pkg_info.files = NULL;
-						};
+						pkg_info.files = load & PKG_DB_LOAD_FILES ? pkg_db_info_files(version_path) : NULL;
+						pkg_info.bloom = load & PKG_DB_LOAD_BLOOMS ? pkg_db_info_bloom(bloom_path) : NULL;
 						array_push(db->pkgs, pkg_info);
 					};
 				};
@@ -195,6 +444,58 @@ void pkg_db_load_pkgs(struct pkg_db *db, int load_files) {
 	};
 };
 
+void pkg_db_load_pkgs(struct pkg_db *db, int load) {
+	if (db->lock_counter) {
+		pkg_db_load_pkgs_once(db, load);
+		return;
+	};
+	long long int start = profile_now();
+	while (1) {
+		unsigned long long int generation = pkg_db_generation(db);
+		if (!(generation & 1) || !pkgdb_writer_alive(db->path)) {
+			int loaded = 0;
+			try {
+				pkg_db_load_pkgs_once(db, load);
+				loaded = 1;
+			};
+			// files may go away under a writer, that shows in the generation
+			catch if (pkg_db_generation(db) == generation) throw_proxy();
+			if (loaded && pkg_db_generation(db) == generation) {
+				db->generation = generation;
+				return;
+			};
+		};
+		if (pkg_db_read_timed_out(start)) {
+			throw(exception_type_pkg_db_already_locked, 1, "Package database is being written.", db->path);
+		};
+		array_resize(db->pkgs, 0);
+		pkg_db_sleep();
+	};
+};
+
+/* Loads the packages and runs read over them, again until the generation is
+ * the same after it, so lists and sums read there are of the same snapshot.
+ * read starts over on its data every run. */
+static void pkg_db_read(struct pkg_db *db, int load, void (*read)(struct pkg_db *db, void *data), void *data) {
+	long long int start = profile_now();
+	while (1) {
+		pkg_db_load_pkgs(db, load);
+		unsigned long long int generation = db->generation;
+		int done = 0;
+		try {
+			read(db, data);
+			done = 1;
+		};
+		catch if (db->lock_counter || pkg_db_generation(db) == generation) throw_proxy();
+		if (done && (db->lock_counter || pkg_db_generation(db) == generation)) return;
+		if (pkg_db_read_timed_out(start)) {
+			throw(exception_type_pkg_db_already_locked, 1, "Package database is being written.", db->path);
+		};
+		array_resize(db->pkgs, 0);
+		pkg_db_sleep();
+	};
+};
+
 void pkg_db_remove_pkg(struct pkg_db *db, const char *name, const char *version) {
 	important_check(db && name && version);
 	scope {
@@ -211,9 +512,89 @@ struct pkg_fs_transaction *pkg_db_write_pkg_info(struct pkg_db *db, struct pkg_i
 			transaction.from = string_new_fmt("%s/.%s.tmp", pkg_info_dir_path, pkg_info->version);
 			transaction.to = string_new_fmt("%s/%s", pkg_info_dir_path, pkg_info->version);
 			transaction.backup = NULL;
+			transaction.exchanged = 0;
 		};
 		kga_mkpath(pkg_info_dir_path, 0755);
-		lines_to_file(pkg_info->files, transaction.from);
+		FILE *file = kga_fopen(transaction.from, "w");
+		kga_fwrite(pkg_info->files->buffer, 1, pkg_info->files->size, file);
+		array_push(transactions, transaction);
+	};
+	return transactions;
+};
+
+/* Sidecar of the file list: "<xxh64> <size> <mode> <mtime> <path>" per non directory entry. */
+static struct pkg_fs_transaction *pkg_db_write_pkg_sums(struct pkg_db *db, struct pkg *pkg, struct pkg_fs_transaction *transactions) {
+	scope {
+		struct pkg_fs_transaction transaction;
+		scope_use_previous {
+			transaction.from = string_new_fmt("%s/%s/.%s.sums.tmp", db->path, pkg->name, pkg->version);
+			transaction.to = string_new_fmt("%s/%s/" PKG_DB_SUMS_NAME, db->path, pkg->name, pkg->version);
+			transaction.backup = NULL;
+			transaction.exchanged = 0;
+		};
+		FILE *file = kga_fopen(transaction.from, "w");
+		array_foreach(pkg->files, struct pkg_file *, each_file) {
+			if (each_file->flags & PKG_FILE_DIR) continue;
+			kga_fprintf(file, "%016llx %lld %o %lld %s\n", (unsigned long long int)each_file->sum.hash,
+					each_file->sum.size, each_file->sum.mode, each_file->sum.mtime, each_file->path);
+		};
+		array_push(transactions, transaction);
+	};
+	return transactions;
+};
+
+/* Entries of the sums sidecar, in the sorted order of the file list they were
+ * written from. NULL for packages installed before sums were kept. */
+static struct pkg_file *pkg_db_info_sums(struct pkg_db *db, struct pkg_info *pkg_info) {
+	struct pkg_file *files = NULL;
+	scope {
+		char *sums_path = string_new_fmt("%s/%s/" PKG_DB_SUMS_NAME, db->path, pkg_info->name, pkg_info->version);
+		char **lines = NULL;
+		try lines = file_lines(sums_path);
+		catch if (!exception_type_is(exception_type_fopen_no_such_file)) throw_proxy();
+		if (lines) scope_use_previous {
+			files = array_new(struct pkg_file, 0, 0);
+			array_foreach(lines, char **, each_line) {
+				struct pkg_file file = {0};
+				unsigned long long int hash;
+				int offset = -1;
+				sscanf(*each_line, "%llx %lld %o %lld %n", &hash, &file.sum.size, &file.sum.mode, &file.sum.mtime, &offset);
+				if (offset < 0) continue;
+				file.sum.hash = hash;
+				file.path = string_new_set(*each_line + offset);
+				array_push(files, file);
+			};
+		};
+	};
+	return files;
+};
+
+static struct pkg_sum *pkg_sums_find(struct pkg_file *files, const char *path) {
+	size_t low = 0, high = array_length(files);
+	while (low < high) {
+		size_t middle = (low + high) / 2;
+		int ret = strcmp(files[middle].path, path);
+		if (!ret) return &files[middle].sum;
+		if (ret < 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		};
+	};
+	return NULL;
+};
+
+static struct pkg_fs_transaction *pkg_db_write_pkg_bloom(struct pkg_db *db, struct pkg_info *pkg_info, struct pkg_fs_transaction *transactions) {
+	scope {
+		struct pkg_fs_transaction transaction;
+		scope_use_previous {
+			transaction.from = string_new_fmt("%s/%s/.%s.bloom.tmp", db->path, pkg_info->name, pkg_info->version);
+			transaction.to = string_new_fmt("%s/%s/" PKG_DB_BLOOM_NAME, db->path, pkg_info->name, pkg_info->version);
+			transaction.backup = NULL;
+			transaction.exchanged = 0;
+		};
+		FILE *file = kga_fopen(transaction.from, "w");
+		kga_fwrite(pkg_info->bloom->buffer, 1, pkg_info->bloom->size, file);
 		array_push(transactions, transaction);
 	};
 	return transactions;
@@ -222,14 +603,20 @@ struct pkg_fs_transaction *pkg_db_write_pkg_info(struct pkg_db *db, struct pkg_i
 struct pkg_fs_transaction *pkg_db_write_pkg(struct pkg_db *db, struct pkg *pkg, struct pkg_fs_transaction *transactions) {
 	important_check(pkg->files);
 	struct pkg_info pkg_info;
-	pkg_info.files = array_new(char *, 0, 0);
 	pkg_info.name = pkg->name;
 	pkg_info.version = pkg->version;
-	for (size_t i = 0, n = array_length(pkg->files); i < n; i++) {
-		array_push(pkg_info.files, pkg->files[i].path);
+	scope {
+		char **paths = array_new(char *, 0, 0);
+		for (size_t i = 0, n = array_length(pkg->files); i < n; i++) {
+			array_push(paths, (char *)pkg->files[i].path);
+		};
+		scope_use_previous pkg_info.files = pkg_pathlist_new(paths, array_length(paths));
 	};
+	pkg_info.bloom = pkg_bloom_new(pkg_info.files);
 	array_push(db->pkgs, pkg_info);
-	return pkg_db_write_pkg_info(db, &pkg_info, transactions);
+	transactions = pkg_db_write_pkg_info(db, &pkg_info, transactions);
+	transactions = pkg_db_write_pkg_bloom(db, &pkg_info, transactions);
+	return pkg_db_write_pkg_sums(db, pkg, transactions);
 };
 
 struct pkg_db_conflict *pkg_db_find_conflicts(struct pkg_db *db, struct pkg *pkg) {
@@ -237,15 +624,23 @@ struct pkg_db_conflict *pkg_db_find_conflicts(struct pkg_db *db, struct pkg *pkg
 	struct pkg_db_conflict conflict;
 	important_check(db->pkgs);
 	int cmp;
+	struct pathlist_iter iter;
+	important_check(pkg->files);
+	uint64_t *hashes = array_new(uint64_t, 0, 0);
+	array_foreach(pkg->files, struct pkg_file *, each_file) {
+		if (!(each_file->flags & PKG_FILE_DIR)) array_push(hashes, pkg_path_hash(each_file->path));
+	};
 	for (size_t i = 0, n = array_length(db->pkgs); i < n; i++) {
 		conflict.files = NULL;
-		important_check(pkg->files);
-		important_check(db->pkgs[i].files);
-		for (size_t j = 0, k = 0, m = array_length(pkg->files), l = array_length(db->pkgs[i].files); j < m && k < l; j++) {
+		// most packages share no file, their lists are not even read
+		if (!pkg_info_may_have(&db->pkgs[i], hashes)) continue;
+		pathlist_iter_init(&iter, pkg_db_files(db, &db->pkgs[i]));
+		const char *path = pathlist_next(&iter);
+		for (size_t j = 0, m = array_length(pkg->files); j < m && path; j++) {
 			if (pkg->files[j].flags & PKG_FILE_DIR) continue;
-			cmp = strcmp(pkg->files[j].path, db->pkgs[i].files[k]);
+			cmp = strcmp(pkg->files[j].path, path);
 			if (cmp > 0) {
-				k++;
+				path = pathlist_next(&iter);
 				j--;
 				continue;
 			} else if (cmp < 0) {
@@ -254,8 +649,8 @@ struct pkg_db_conflict *pkg_db_find_conflicts(struct pkg_db *db, struct pkg *pkg
 				if (!conflict.files) {
 					conflict.files = array_new(char *, 0, ARRAY_NULL_TERMINATED);
 				};
-				array_push(conflict.files, db->pkgs[i].files[k]);
-				k++;
+				array_push(conflict.files, string_new_set(path));
+				path = pathlist_next(&iter);
 			}
 		};
 		if (conflict.files) {
@@ -268,15 +663,20 @@ struct pkg_db_conflict *pkg_db_find_conflicts(struct pkg_db *db, struct pkg *pkg
 
 struct pkg_fs_transaction *pkg_db_remove_conflicts(struct pkg_db *db, struct pkg_db_conflict *conflicts, struct pkg_fs_transaction *transactions) {
 	important_check(conflicts);
+	struct pathlist_iter iter;
 	for (size_t i = 0, n = array_length(conflicts); i < n; i++) {
 		important_check(conflicts[i].files);
-		for (size_t j = 0, m = array_length(conflicts[i].files); j < m; j++) {
-			//FIXME: Optimization needed
-			for (size_t k = 0; k < array_length(conflicts[i].info->files); k++) {
-				if (!strcmp(conflicts[i].info->files[k], conflicts[i].files[j])) {
-					array_delete_interval(conflicts[i].info->files, k, 1);
-				};
+		// conflicts come sorted from the merge in pkg_db_find_conflicts
+		scope {
+			char **paths = array_new(char *, 0, 0);
+			size_t j = 0, m = array_length(conflicts[i].files);
+			pathlist_iter_init(&iter, conflicts[i].info->files);
+			for (const char *path; (path = pathlist_next(&iter)); ) {
+				while (j < m && strcmp(conflicts[i].files[j], path) < 0) j++;
+				if (j < m && !strcmp(conflicts[i].files[j], path)) continue;
+				array_push(paths, string_new_set(path));
 			};
+			scope_use_previous conflicts[i].info->files = pkg_pathlist_new(paths, array_length(paths));
 		};
 #if 0
 		if (pkg_confirm) {
@@ -284,7 +684,7 @@ struct pkg_fs_transaction *pkg_db_remove_conflicts(struct pkg_db *db, struct pkg
 				if (!pkg_confirm("Package info will be updated %s/%s:\n%s\nContinue?\n",
 							conflicts[i].info->name,
 							conflicts[i].info->version,
-							string_join(conflicts[i].info->files, "\n", 0))) {
+							string_join(conflicts[i].files, "\n", 0))) {
 					throw(pkg_aborted_by_user, 1, "Aborted by user", NULL);
 				};
 			};
@@ -295,25 +695,173 @@ struct pkg_fs_transaction *pkg_db_remove_conflicts(struct pkg_db *db, struct pkg
 	return transactions;
 };
 
-void pkg_regular_file_install(const char *from, const char *to, mode_t mode) {
+uint64_t pkg_regular_file_install(const char *from, const char *to, mode_t mode) {
+	struct hash_state hash;
+	hash_init(&hash);
 	scope {
 		FILE *from_file = kga_fopen(from, "r");
 		FILE *to_file = kga_fopen(to, "w");
 		char buffer[1024];
 		size_t readed;
 		while ((readed = kga_fread(buffer, 1, 1024, from_file))) {
+			hash_update(&hash, buffer, readed);
 			kga_fwrite(buffer, 1, readed, to_file);
 		};
 		//kga_fflush_and_fsync(to_file);
 	};
 	if (chmod(to, mode)) throw_errno_verbose(to);
+	return hash_final(&hash);
 };
 
-void pkg_symlink_install(const char *from, const char *to) {
+uint64_t pkg_symlink_install(const char *from, const char *to) {
+	uint64_t hash;
 	scope {
 		char *from_target = kga_readlink(from);
 		remove(to);
 		kga_symlink(from_target, to);
+		hash = hash_data(from_target, strlen(from_target));
+	};
+	return hash;
+};
+
+static void pkg_sum_set(struct pkg_sum *sum, struct stat *st, uint64_t hash) {
+	sum->hash = hash;
+	sum->size = st->st_size;
+	sum->mode = st->st_mode;
+	sum->mtime = st->st_mtime;
+};
+
+static int pkg_info_has_file(struct pkg_info *pkg_info, const char *path) {
+	if (!pkg_info->files) return 0;
+	return pathlist_contains(pkg_info->files, path);
+};
+
+/* An installed file of the package being upgraded can stay in place when the new
+ * version has it with the same type, mode and content. A regular file counts
+ * only while it still has the size, mode and mtime its sums recorded, then the
+ * recorded hash stands for it and only the new file is read. */
+static int pkg_file_unchanged(struct pkg_info **installed, struct pkg_file **sums, struct pkg_file *pkg_file, const char *from, const char *to) {
+	struct pkg_sum *sum = NULL;
+	int owned = 0;
+	for (size_t i = 0, n = array_length(installed); i < n && !owned; i++) {
+		if ((owned = pkg_info_has_file(installed[i], pkg_file->path)) && sums[i]) sum = pkg_sums_find(sums[i], pkg_file->path);
+	};
+	if (!owned) return 0;
+	struct stat from_st, to_st;
+	if (kga_lstat_skip_enoent(to, &to_st)) return 0;
+	kga_lstat(from, &from_st);
+	if ((from_st.st_mode & S_IFMT) != (to_st.st_mode & S_IFMT)) return 0;
+	int unchanged = 0;
+	uint64_t hash = 0;
+	if (S_ISLNK(from_st.st_mode)) {
+		scope {
+			char *target = kga_readlink(from);
+			unchanged = !strcmp(target, kga_readlink(to));
+			hash = hash_data(target, strlen(target));
+		};
+	} else if (S_ISREG(from_st.st_mode) && sum) {
+		if (to_st.st_mode == sum->mode && to_st.st_size == sum->size && to_st.st_mtime == sum->mtime &&
+				(from_st.st_mode & 07777) == (sum->mode & 07777) && from_st.st_size == sum->size) {
+			hash = hash_file(from);
+			unchanged = hash == sum->hash;
+		};
+	};
+	if (unchanged) pkg_sum_set(&pkg_file->sum, &to_st, hash);
+	return unchanged;
+};
+
+/* Has to run before conflicts with the installed versions are cleaned from their file lists. */
+static void pkg_mark_unchanged(struct pkg_db *db, struct pkg *pkg) {
+	scope {
+		char *file_path = string_new();
+		char *fs_path = string_new();
+		struct pkg_info **installed = array_new(struct pkg_info *, 0, 0);
+		struct pkg_file **sums = array_new(struct pkg_file *, 0, 0);
+		array_foreach(db->pkgs, struct pkg_info *, each_pkg_info) {
+			if (strcmp(each_pkg_info->name, pkg->name)) continue;
+			pkg_db_files(db, each_pkg_info);
+			array_push(installed, each_pkg_info);
+			array_push(sums, pkg_db_info_sums(db, each_pkg_info));
+		};
+		if (array_length(installed)) {
+			array_foreach(pkg->files, struct pkg_file *, each_file) {
+				if (each_file->flags & PKG_FILE_DIR) continue;
+				string_fmt(file_path, "%s/%s", pkg->path, each_file->path);
+				string_fmt(fs_path, "%s/%s", db->root, each_file->path);
+				if (pkg_file_unchanged(installed, sums, each_file, file_path, fs_path)) each_file->flags |= PKG_FILE_UNCHANGED;
+			};
+		};
+	};
+};
+
+/* Directories on the way from the root to the last one made. Fds are opened
+ * only when a directory turns out to be a parent, -1 until then. */
+struct pkg_mkdir_stack {
+	const char **paths;
+	int *fds;
+};
+
+static void pkg_mkdir_stack_free(void *ptr) {
+	struct pkg_mkdir_stack *stack = ptr;
+	array_foreach(stack->fds, int *, each_fd) {
+		if (*each_fd >= 0) close(*each_fd);
+	};
+	free(ptr);
+};
+
+static struct pkg_mkdir_stack *pkg_mkdir_stack_new(const char *root) {
+	struct pkg_mkdir_stack *stack = kga_malloc(sizeof(struct pkg_mkdir_stack));
+	stack->paths = array_new(const char *, 0, 0);
+	stack->fds = array_new(int, 0, 0);
+	scope_add(stack, pkg_mkdir_stack_free);
+	int root_fd = open(*root ? root : "/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (root_fd < 0) throw_errno_verbose(root);
+	array_push(stack->fds, root_fd);
+	array_push(stack->paths, "");
+	return stack;
+};
+
+static int pkg_mkdir_stack_fd(struct pkg_mkdir_stack *stack, size_t level) {
+	if (stack->fds[level] < 0) {
+		const char *name = strrchr(stack->paths[level], '/');
+		name = name ? name + 1 : stack->paths[level];
+		stack->fds[level] = openat(pkg_mkdir_stack_fd(stack, level - 1), name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (stack->fds[level] < 0) throw_errno_verbose(stack->paths[level]);
+	};
+	return stack->fds[level];
+};
+
+/* Makes the directory with one mkdirat in its parent. Sorted file lists give
+ * parents first, so the parent is usually on the stack already; missing
+ * levels are made on the way. */
+static void pkg_mkdir(struct pkg_mkdir_stack *stack, const char *path) {
+	size_t length = strlen(path);
+	for (size_t n; (n = array_length(stack->fds)) > 1; ) {
+		size_t top_length = strlen(stack->paths[n - 1]);
+		if (top_length < length && path[top_length] == '/' && !strncmp(stack->paths[n - 1], path, top_length)) break;
+		if (stack->fds[n - 1] >= 0) close(stack->fds[n - 1]);
+		array_resize(stack->fds, n - 1);
+		array_resize(stack->paths, n - 1);
+	};
+	for (;;) {
+		size_t level = array_length(stack->fds) - 1;
+		size_t top_length = strlen(stack->paths[level]);
+		size_t start = top_length ? top_length + 1 : 0;
+		const char *end = strchr(path + start, '/');
+		size_t end_length = end ? (size_t)(end - path) : length;
+		char name[end_length - start + 1];
+		memcpy(name, path + start, end_length - start);
+		name[end_length - start] = '\0';
+		if (mkdirat(pkg_mkdir_stack_fd(stack, level), name, 0755) && errno != EEXIST) throw_errno_verbose(path);
+		const char *prefix = path;
+		if (end) {
+			char *prefix_copy = string_new_set(path);
+			prefix_copy[end_length] = '\0';
+			prefix = prefix_copy;
+		};
+		array_push(stack->fds, -1);
+		array_push(stack->paths, prefix);
+		if (!end) return;
 	};
 };
 
@@ -321,25 +869,30 @@ struct pkg_fs_transaction *pkg_install_files(struct pkg_db *db, struct pkg *pkg,
 	struct pkg_fs_transaction transaction;
 	scope {
 		char *file_path = string_new();
-		char *mkpath_path = string_new();
+		struct pkg_mkdir_stack *mkdir_stack = pkg_mkdir_stack_new(db->root);
 		for (size_t i = 0, files_count = array_length(pkg->files); i < files_count; i++) {
+			if (pkg->files[i].flags & PKG_FILE_UNCHANGED) continue;
 			string_fmt(file_path, "%s/%s", pkg->path, pkg->files[i].path);
 			if (pkg->files[i].flags & PKG_FILE_DIR) {
-				string_fmt(mkpath_path, "%s/%s", db->root, pkg->files[i].path) ;
-				kga_mkpath(mkpath_path, 0755);
+				pkg_mkdir(mkdir_stack, pkg->files[i].path);
 			} else {
 				scope_use_previous {
 					transaction.to = string_new_fmt("%s/%s", db->root, pkg->files[i].path);
 					transaction.from = string_new_fmt("%s/%s.pkg.transaction.new", db->root, pkg->files[i].path);
 					transaction.backup = string_new_fmt("%s/%s.pkg.transaction.backup", db->root, pkg->files[i].path);
+					transaction.exchanged = 0;
 				};
+				uint64_t hash;
+				struct stat st;
 				if (pkg->files[i].flags & PKG_FILE_LNK) {
-					pkg_symlink_install(file_path, transaction.from);
+					hash = pkg_symlink_install(file_path, transaction.from);
 				} else {
-					struct stat st;
 					kga_lstat(file_path, &st);
-					pkg_regular_file_install(file_path, transaction.from, st.st_mode & 0777);
+					hash = pkg_regular_file_install(file_path, transaction.from, st.st_mode & 0777);
 				};
+				// rename keeps the mtime, so the staged file already has the final one
+				kga_lstat(transaction.from, &st);
+				pkg_sum_set(&pkg->files[i].sum, &st, hash);
 				array_push(transactions, transaction);
 			};
 		};
@@ -347,81 +900,265 @@ struct pkg_fs_transaction *pkg_install_files(struct pkg_db *db, struct pkg *pkg,
 	return transactions;
 };
 
-int pkg_file_compare(const void *ptr1, const void *ptr2) {
-	const struct pkg_file *pkg_file1 = ptr1;
-	const struct pkg_file *pkg_file2 = ptr2;
-	return strcmp(pkg_file1->path, pkg_file2->path);
+struct pkg_walk {
+	char *names;
+	char *buffer;
+	size_t count;
 };
 
-struct pkg *pkg_load(struct pkg *pkg, const char *pkg_path, const char *sub_path) {
-	int need_sort = 0;
-	if (!pkg) {
-		need_sort = 1;
-		pkg = new(struct pkg);
-		pkg->path = pkg_path;
-		pkg->files = array_new(struct pkg_file, 0, ARRAY_NULL_TERMINATED);
-		scope {
-			char *name_path = string_new_fmt("%s/.name", pkg_path);
-			char *version_path = string_new_fmt("%s/.version", pkg_path);
-			scope_use_previous {
-				pkg->name = string_from_file(name_path);
-				pkg->version = string_from_file(version_path);
-			};
-		};
+/* Appends "<flags><dir path>/<name>\0" to walk->names and returns its offset. */
+static size_t pkg_walk_push(struct pkg_walk *walk, int flags, size_t dir_offset, size_t dir_length, const char *name, size_t name_length) {
+	size_t offset = array_length(walk->names);
+	size_t length = dir_length ? dir_length + 1 + name_length : name_length;
+	array_resize(walk->names, offset + length + 2);
+	char *entry = walk->names + offset;
+	entry[0] = flags;
+	if (dir_length) {
+		memcpy(entry + 1, walk->names + dir_offset + 1, dir_length);
+		entry[1 + dir_length] = '/';
 	};
+	memcpy(entry + 1 + length - name_length, name, name_length + 1);
+	walk->count++;
+	return offset;
+};
+
+/* Entries of a directory are recorded before descending, so one read buffer serves
+ * the whole walk and every lookup is relative to an already open directory. */
+static void pkg_walk_dir(struct pkg_walk *walk, int dir_fd, size_t dir_offset, size_t dir_length) {
 	scope {
-		char *file_full_path = string_new();
-		struct pkg_file pkg_file;
-		const char *files_path = sub_path ? string_new_fmt("%s/%s", pkg_path, sub_path) : pkg_path;
-		char *file_path = NULL;
-		DIR *files_dir = kga_opendir(files_path);
-		struct dirent *dirent;
-		while ((dirent = readdir(files_dir))) {
-			if (!sub_path || !*sub_path) {
-				if (dirent->d_name[0] == '.') continue;
-			} else {
-				if (dirent->d_name[0] == '.' && (dirent->d_name[1] == '\0' || (dirent->d_name[1] == '.' && dirent->d_name[2] == '\0'))) continue;
-			};
-			scope_use_previous {
-				if (sub_path && *sub_path) {
-					file_path = string_new_fmt("%s/%s", sub_path, dirent->d_name);
+		size_t *sub_dirs = array_new(size_t, 0, 0);
+		size_t readed;
+		while ((readed = kga_getdents64(dir_fd, walk->buffer, PKG_WALK_BUFFER_SIZE))) {
+			for (size_t position = 0; position < readed; ) {
+				struct kga_dirent64 *dirent = (struct kga_dirent64 *)(walk->buffer + position);
+				position += dirent->d_reclen;
+				if (!dir_length) {
+					if (dirent->d_name[0] == '.') continue;
 				} else {
-					file_path = string_new_set(dirent->d_name);
+					if (dirent->d_name[0] == '.' && (dirent->d_name[1] == '\0' || (dirent->d_name[1] == '.' && dirent->d_name[2] == '\0'))) continue;
 				};
-			};
-			string_fmt(file_full_path, "%s/%s", pkg_path, file_path);
-			pkg_file.flags = 0;
-			struct stat st;
-			kga_lstat(file_full_path, &st);
-			if (S_ISDIR(st.st_mode)) {
-				pkg_file.flags |= PKG_FILE_DIR;
-				scope_use_previous {
-					pkg_load(pkg, pkg_path, file_path);
+				int flags = 0;
+				unsigned char type = dirent->d_type;
+				if (type == DT_UNKNOWN) {
+					struct stat st;
+					kga_fstatat(dir_fd, dirent->d_name, &st);
+					type = S_ISDIR(st.st_mode) ? DT_DIR : (S_ISLNK(st.st_mode) ? DT_LNK : DT_REG);
 				};
+				if (type == DT_DIR) flags |= PKG_FILE_DIR;
+				if (type == DT_LNK) flags |= PKG_FILE_LNK;
+				size_t offset = pkg_walk_push(walk, flags, dir_offset, dir_length, dirent->d_name, strlen(dirent->d_name));
+				if (flags & PKG_FILE_DIR) array_push(sub_dirs, offset);
 			};
-			if (S_ISLNK(st.st_mode)) {
-				pkg_file.flags |= PKG_FILE_LNK;
+		};
+		array_foreach(sub_dirs, size_t *, each_offset) {
+			size_t length = strlen(walk->names + *each_offset + 1);
+			scope {
+				int sub_fd = kga_openat(dir_fd, walk->names + *each_offset + 1 + (dir_length ? dir_length + 1 : 0), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+				pkg_walk_dir(walk, sub_fd, *each_offset, length);
 			};
-			pkg_file.path = file_path;
-			array_push(pkg->files, pkg_file);
 		};
 	};
-	if (need_sort) {
-		array_sort(pkg->files, pkg_file_compare);
+};
+
+struct pkg *pkg_load(const char *pkg_path) {
+	struct pkg *pkg = new(struct pkg);
+	struct pkg_walk walk;
+	pkg->path = pkg_path;
+	walk.names = array_new(char, 0, 0);
+	walk.count = 0;
+	scope {
+		char *name_path = string_new_fmt("%s/.name", pkg_path);
+		char *version_path = string_new_fmt("%s/.version", pkg_path);
+		scope_use_previous {
+			pkg->name = string_from_file(name_path);
+			pkg->version = string_from_file(version_path);
+		};
+		walk.buffer = kga_malloc(PKG_WALK_BUFFER_SIZE);
+		scope_add(walk.buffer, free);
+		int pkg_fd = kga_openat(AT_FDCWD, pkg_path, O_RDONLY | O_DIRECTORY);
+		pkg_walk_dir(&walk, pkg_fd, 0, 0);
+	};
+	// names do not move any more, so paths can point into them
+	pkg->files = array_new(struct pkg_file, walk.count, ARRAY_NULL_TERMINATED);
+	scope {
+		char **paths = array_new(char *, walk.count, 0);
+		for (size_t i = 0, offset = 0; i < walk.count; i++) {
+			paths[i] = walk.names + offset + 1;
+			offset += strlen(paths[i]) + 2;
+		};
+		strings_sort(paths);
+		for (size_t i = 0; i < walk.count; i++) {
+			pkg->files[i].flags = paths[i][-1];
+			pkg->files[i].path = paths[i];
+		};
 	};
 	return pkg;
 };
 
-void pkg_install(const char *pkg_path, const char *root, const char *db_path, int flags, FILE *warning_stream) {
+struct pkg_hook {
+	const char *path;
+	const char *name;
+	char **after;
+	int serial;
+	int state;
+	pid_t pid;
+};
+
+#define PKG_HOOK_PENDING 0
+#define PKG_HOOK_RUNNING 1
+#define PKG_HOOK_DONE 2
+#define PKG_HOOK_HEADER_LINES 32
+
+/* Hooks may declare in their leading comment lines:
+ *   # pkg-hook: serial      run while no other hook is running
+ *   # pkg-hook: after NAME  run once hook NAME has finished */
+static void pkg_hook_read_header(struct pkg_hook *hook) {
 	scope {
-		struct pkg_fs_transaction *pkg_install_transactions = array_new(struct pkg_fs_transaction, 0, ARRAY_NULL_TERMINATED);
-		struct pkg_db *db = pkg_db_new(root, db_path);
-		struct pkg *pkg = pkg_load(NULL, pkg_path, NULL);
-		pkg_db_lock(db);
-		if (pkg_db_installed(db, pkg->name, pkg->version)) {
-			throw(exception_type_pkg_already_installed, 1, "this package already installed", NULL);
+		FILE *file = kga_fopen(hook->path, "r");
+		char line[1024];
+		for (int i = 0; i < PKG_HOOK_HEADER_LINES && fgets(line, sizeof(line), file); i++) {
+			if (line[0] != '#') break;
+			for (char *c = line; *c; c++) {
+				if (*c == '\t' || *c == '\n') *c = ' ';
+			};
+			char **words = string_split(line + 1, " ", STRING_SPLIT_WITHOUT_EMPTY);
+			if (array_length(words) < 2 || strcmp(words[0], "pkg-hook:")) continue;
+			if (!strcmp(words[1], "serial")) {
+				hook->serial = 1;
+			} else if (!strcmp(words[1], "after")) {
+				for (size_t j = 2, n = array_length(words); j < n; j++) {
+					scope_use_previous {
+						array_push(hook->after, string_new_set(words[j]));
+					};
+				};
+			};
 		};
-		pkg_db_load_pkgs(db, 1);
+	};
+};
+
+static struct pkg_hook *pkg_hooks_load(const char *root) {
+	struct pkg_hook *hooks = array_new(struct pkg_hook, 0, 0);
+	char *hooks_path = string_new_fmt("%s/usr/lib/pkg-hooks/*", root);
+	char **paths = kga_glob(hooks_path);
+	for (; *paths; paths++) {
+		struct pkg_hook hook;
+		hook.path = *paths;
+		hook.name = strrchr(*paths, '/') + 1;
+		hook.after = array_new(char *, 0, 0);
+		hook.serial = 0;
+		hook.state = PKG_HOOK_PENDING;
+		hook.pid = 0;
+		pkg_hook_read_header(&hook);
+		array_push(hooks, hook);
+	};
+	return hooks;
+};
+
+static int pkg_hook_ready(struct pkg_hook *hooks, struct pkg_hook *hook) {
+	array_foreach(hook->after, char **, each_after) {
+		array_foreach(hooks, struct pkg_hook *, each_hook) {
+			if (each_hook->state != PKG_HOOK_DONE && !strcmp(each_hook->name, *each_after)) return 0;
+		};
+	};
+	return 1;
+};
+
+static pid_t pkg_hook_spawn(struct pkg_hook *hook, const char *root, const char *cwd) {
+	pid_t pid = kga_fork();
+	if (!pid) {
+		if (cwd) kga_chdir(cwd);
+		if (unsetenv("ROOT")) throw_errno();
+		const char *script_copy = strdup(hook->path);
+		if (!script_copy) throw_errno();
+		if (root && *root && setenv("ROOT", root, 1)) throw_errno();
+		while (scope_current()) scope_end();
+		execl(script_copy, script_copy, NULL);
+		exit(EXIT_FAILURE);
+	};
+	return pid;
+};
+
+/* Runs in its own process, so waiting for any child only sees hooks. */
+static void pkg_hooks_schedule(struct pkg_hook *hooks, const char *root, const char *cwd, FILE *warning_stream) {
+	long int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t done = 0, running = 0, total = array_length(hooks);
+	int serial_running = 0;
+	if (jobs < 1) jobs = 1;
+	while (done < total) {
+		array_foreach(hooks, struct pkg_hook *, each_hook) {
+			if (serial_running || running >= (size_t)jobs) break;
+			if (each_hook->state != PKG_HOOK_PENDING) continue;
+			if (!pkg_hook_ready(hooks, each_hook)) continue;
+			// a serial hook waits for the running ones and holds back the rest
+			if (each_hook->serial && running) break;
+			each_hook->pid = pkg_hook_spawn(each_hook, root, cwd);
+			each_hook->state = PKG_HOOK_RUNNING;
+			serial_running = each_hook->serial;
+			running++;
+		};
+		if (!running) {
+			if (warning_stream) fprintf(warning_stream, "Post-install scripts have circular dependencies, skipping the rest\n");
+			break;
+		};
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+		if (pid < 0) throw_errno();
+		array_foreach(hooks, struct pkg_hook *, each_hook) {
+			if (each_hook->state != PKG_HOOK_RUNNING || each_hook->pid != pid) continue;
+			if (status && warning_stream) fprintf(warning_stream, "Post-install script %s failed\n", each_hook->name);
+			each_hook->state = PKG_HOOK_DONE;
+			if (each_hook->serial) serial_running = 0;
+			running--;
+			done++;
+		};
+	};
+};
+
+static void pkg_hooks_run(const char *root, const char *cwd, FILE *warning_stream) {
+	scope {
+		struct pkg_hook *hooks = NULL;
+		try {
+			hooks = pkg_hooks_load(root);
+		};
+		catch {
+			if (exception_type_is(exception_type_glob_aborted) || exception_type_is(exception_type_glob_nomatch)) {
+				if (warning_stream) fprintf(warning_stream, "Post-install scripts not available\n");
+			} else {
+				throw_proxy();
+			};
+		};
+		if (hooks) {
+			fflush(NULL);
+			pid_t pid = kga_fork();
+			if (!pid) {
+				int ret = EXIT_SUCCESS;
+				try {
+					pkg_hooks_schedule(hooks, root, cwd, warning_stream);
+				};
+				catch {
+					exception_print(stderr);
+					ret = EXIT_FAILURE;
+				};
+				fflush(NULL);
+				_exit(ret);
+			};
+			int status;
+			waitpid(pid, &status, 0);
+		};
+	};
+};
+
+/* Runs hooks deferred by PKG_DEFER_HOOKS once for all installed packages, from
+ * cwd like after a single install. With the package trees gone cwd is NULL
+ * and hooks stay in the current directory. */
+void pkg_finish_installs(const char *root, const char *cwd, FILE *warning_stream) {
+	size_t profile_mark = profile_begin("hooks", NULL);
+	pkg_hooks_run(root, cwd, warning_stream);
+	profile_end(profile_mark);
+};
+
+static void pkg_check_fs_conflicts(struct pkg *pkg, const char *root) {
+	scope {
 		char *file_fs_path = string_new();
 		important_check(pkg->files);
 		for (int i = 0, n = array_length(pkg->files); i < n; i++) {
@@ -437,136 +1174,377 @@ void pkg_install(const char *pkg_path, const char *root, const char *db_path, in
 				};
 			};
 		};
-		if (warning_stream) fprintf(warning_stream, "Searching conflicts\n");
-		struct pkg_db_conflict *conflicts = pkg_db_find_conflicts(db, pkg);
-		important_check(conflicts);
-		size_t conflicts_len = array_length(conflicts);
-		if (conflicts_len) {
-			char *conflict_description = string_new();
+	};
+};
+
+static int pkg_file_compare(const void *ptr1, const void *ptr2) {
+	return strcmp((*(struct pkg_file * const *)ptr1)->path, (*(struct pkg_file * const *)ptr2)->path);
+};
+
+/* Packages installed together may share directories only. */
+static void pkg_check_set_conflicts(struct pkg **pkgs) {
+	if (array_length(pkgs) < 2) return;
+	scope {
+		struct pkg_file **files = array_new(struct pkg_file *, 0, 0);
+		char *conflict_description = string_new();
+		array_foreach(pkgs, struct pkg **, each_pkg) {
+			for (size_t i = 0, n = array_length((*each_pkg)->files); i < n; i++) {
+				array_push(files, &(*each_pkg)->files[i]);
+			};
+		};
+		array_sort(files, pkg_file_compare);
+		for (size_t i = 1, n = array_length(files); i < n; i++) {
+			if (strcmp(files[i - 1]->path, files[i]->path)) continue;
+			if (files[i - 1]->flags == PKG_FILE_DIR && files[i]->flags == PKG_FILE_DIR) continue;
+			string_fmt(conflict_description, "%s %s\n", conflict_description, files[i]->path);
+		};
+		if (string_length(conflict_description)) {
+			throw(exception_type_pkg_files_conflict, 1, "Conflict between packages being installed", conflict_description);
+		};
+	};
+};
+
+static void pkg_check_db_conflicts(struct pkg_db *db, struct pkg *pkg, int flags, FILE *warning_stream) {
+	struct pkg_db_conflict *conflicts = pkg_db_find_conflicts(db, pkg);
+	important_check(conflicts);
+	size_t conflicts_len = array_length(conflicts);
+	if (conflicts_len) {
+		char *conflict_description = string_new();
+		for (size_t i = 0; i < conflicts_len; i++) {
+			string_fmt(conflict_description, "%s\n%s/%s:\n", conflict_description, conflicts[i].info->name, conflicts[i].info->version);
+			important_check(conflicts[i].files);
+			for (size_t j = 0, n = array_length(conflicts[i].files); j < n; j++) {
+				string_fmt(conflict_description, "%s %s\n", conflict_description, conflicts[i].files[j]);
+			};
+		};
+		if (!(flags & PKG_FORCE_INSTALL)) {
 			for (size_t i = 0; i < conflicts_len; i++) {
-				string_fmt(conflict_description, "%s\n%s/%s:\n", conflict_description, conflicts[i].info->name, conflicts[i].info->version);
-				important_check(conflicts[i].files);
-				for (size_t j = 0, n = array_length(conflicts[i].files); j < n; j++) {
-					string_fmt(conflict_description, "%s %s\n", conflict_description, conflicts[i].files[j]);
+				if (strcmp(conflicts[i].info->name, pkg->name)) {
+					throw(exception_type_pkg_files_conflict, 1, "Conflict with other packages", conflict_description);
 				};
-			};
-			if (!(flags & PKG_FORCE_INSTALL)) {
-				if (flags & PKG_UPGRADE) {
-					for (size_t i = 0; i < conflicts_len; i++) {
-						if (strcmp(conflicts[i].info->name, pkg->name)) {
-							throw(exception_type_pkg_files_conflict, 1, "Conflict with other packages", conflict_description);
-						};
-					};
-				} else {
+				if (!(flags & PKG_UPGRADE) && !((flags & PKG_REINSTALL) && !strcmp(conflicts[i].info->version, pkg->version))) {
 					throw(exception_type_pkg_files_conflict, 1, "Conflict with other packages", conflict_description);
 				};
 			};
-			struct pkg_fs_transaction *conflict_delete_transactions = array_new(struct pkg_fs_transaction, 0, ARRAY_NULL_TERMINATED);
-			if (array_length(conflict_delete_transactions) > 0) 
-				if (warning_stream) fprintf(warning_stream, "Cleaning conflicts\n");
-			conflict_delete_transactions = pkg_db_remove_conflicts(db, conflicts, conflict_delete_transactions);
-			try {
-				transaction_fs_transactions_commit(conflict_delete_transactions, warning_stream);
+		};
+		struct pkg_fs_transaction *conflict_delete_transactions = array_new(struct pkg_fs_transaction, 0, ARRAY_NULL_TERMINATED);
+		if (array_length(conflict_delete_transactions) > 0) 
+			if (warning_stream) fprintf(warning_stream, "Cleaning conflicts\n");
+		conflict_delete_transactions = pkg_db_remove_conflicts(db, conflicts, conflict_delete_transactions);
+		try {
+			pkg_db_write_begin(db);
+			transaction_fs_transactions_commit(conflict_delete_transactions, warning_stream);
+		};
+		catch {
+			transaction_fs_transactions_rollback(conflict_delete_transactions, warning_stream);
+			throw_proxy();
+		};
+		pkg_db_write_end(db);
+	};
+};
+
+/* Installs every package of the NULL terminated pkg_paths with one database load
+ * and one fs transaction, so either all of them get installed or none. */
+void pkg_install_many(char **pkg_paths, const char *root, const char *db_path, int flags, FILE *warning_stream) {
+	important_check(pkg_paths);
+	scope {
+		struct pkg_fs_transaction *pkg_install_transactions = array_new(struct pkg_fs_transaction, 0, ARRAY_NULL_TERMINATED);
+		struct pkg_db *db = pkg_db_new(root, db_path);
+		struct pkg **pkgs = array_new(struct pkg *, 0, 0);
+		size_t profile_mark = profile_begin("pkg_load", NULL);
+		for (char **each_path = pkg_paths; *each_path; each_path++) {
+			array_push(pkgs, pkg_load(*each_path));
+		};
+		profile_end(profile_mark);
+		pkg_db_lock(db);
+		for (size_t i = 0, n = array_length(pkgs); i < n; i++) {
+			if (!(flags & PKG_REINSTALL) && pkg_db_installed(db, pkgs[i]->name, pkgs[i]->version)) {
+				throw(exception_type_pkg_already_installed, 1, "this package already installed", pkgs[i]->path);
 			};
-			catch {
-				transaction_fs_transactions_rollback(conflict_delete_transactions, warning_stream);
-				throw_proxy();
+			for (size_t j = 0; j < i; j++) {
+				if (!strcmp(pkgs[i]->name, pkgs[j]->name)) {
+					throw(exception_type_pkg_files_conflict, 1, "same package given twice", pkgs[i]->name);
+				};
 			};
 		};
+		profile_mark = profile_begin("db_load", NULL);
+		pkg_db_load_pkgs(db, PKG_DB_LOAD_BLOOMS);
+		// staging adds the new packages after these
+		size_t installed = array_length(db->pkgs);
+		if (flags & PKG_REINSTALL) {
+			// the commit replaces the list of a version installed again, the old one is needed after
+			array_foreach(pkgs, struct pkg **, each_pkg) {
+				array_foreach(db->pkgs, struct pkg_info *, each_pkg_info) {
+					if (!strcmp(each_pkg_info->name, (*each_pkg)->name) && !strcmp(each_pkg_info->version, (*each_pkg)->version)) pkg_db_files(db, each_pkg_info);
+				};
+			};
+		};
+		profile_end(profile_mark);
+		profile_mark = profile_begin("conflicts", NULL);
+		array_foreach(pkgs, struct pkg **, each_pkg) {
+			pkg_check_fs_conflicts(*each_pkg, root);
+		};
+		if (warning_stream) fprintf(warning_stream, "Searching conflicts\n");
+		pkg_check_set_conflicts(pkgs);
+		if (flags & PKG_INCREMENTAL) {
+			array_foreach(pkgs, struct pkg **, each_pkg) {
+				pkg_mark_unchanged(db, *each_pkg);
+			};
+		};
+		array_foreach(pkgs, struct pkg **, each_pkg) {
+			pkg_check_db_conflicts(db, *each_pkg, flags, warning_stream);
+		};
+		profile_end(profile_mark);
 		if (warning_stream) fprintf(warning_stream, "Preparing transaction\n");
-		pkg_install_transactions = pkg_install_files(db, pkg, pkg_install_transactions);
-		pkg_install_transactions = pkg_db_write_pkg(db, pkg, pkg_install_transactions);
+		profile_mark = profile_begin("staging", NULL);
+		array_foreach(pkgs, struct pkg **, each_pkg) {
+			pkg_install_transactions = pkg_install_files(db, *each_pkg, pkg_install_transactions);
+			pkg_install_transactions = pkg_db_write_pkg(db, *each_pkg, pkg_install_transactions);
+		};
+		profile_end(profile_mark);
 		try {
-			if (pkg_confirm && !pkg_confirm("Process fs transaction for %s/%s?", pkg->name, pkg->version)) {
-				throw(pkg_aborted_by_user, 1, "Aborted by user", NULL);
+			if (pkg_confirm) {
+				int confirmed = array_length(pkgs) == 1 ?
+						pkg_confirm("Process fs transaction for %s/%s?", pkgs[0]->name, pkgs[0]->version) :
+						pkg_confirm("Process fs transaction for %zu packages?", array_length(pkgs));
+				if (!confirmed) throw(pkg_aborted_by_user, 1, "Aborted by user", NULL);
 			};
+			profile_mark = profile_begin("commit", NULL);
+			pkg_db_write_begin(db);
 			transaction_fs_transactions_commit(pkg_install_transactions, warning_stream);
+			profile_end(profile_mark);
 		};
 		catch {
 			transaction_fs_transactions_rollback(pkg_install_transactions, warning_stream);
 			throw_proxy();
 		};
+		pkg_db_write_end(db);
+		// the packages are in, what fails from here on is told apart from a failed install
 		try {
-			char *scripts_path = string_new_fmt("%s/usr/lib/pkg-hooks/*", db->root);
-			char **script = kga_glob(scripts_path);
-			for (; *script; script++) {
-				int status;
-				pid_t script_pid = kga_fork();
-				if (!script_pid) {
-					kga_chdir(pkg_path);
-					if (unsetenv("ROOT")) throw_errno();
-					const char *script_copy = strdup(*script);
-					if (!script_copy) throw_errno();
-					if (db->root && *db->root && setenv("ROOT", db->root, 1)) throw_errno();
-					while (scope_current()) scope_end();
-					execl(script_copy, script_copy, NULL);
-					exit(EXIT_FAILURE);
+			if (!(flags & PKG_DEFER_HOOKS)) pkg_finish_installs(db->root, pkgs[0]->path, warning_stream);
+			profile_mark = profile_begin("drop_old", NULL);
+			if (flags & (PKG_UPGRADE | PKG_REINSTALL)) {
+				// in one go, a version dropped before would still own its files for the next drop
+				struct pkg_info **old = array_new(struct pkg_info *, 0, 0);
+				array_foreach(pkgs, struct pkg **, each_pkg) {
+					for (size_t i = 0; i < installed; i++) {
+						struct pkg_info *each_pkg_info = &db->pkgs[i];
+						if (strcmp(each_pkg_info->name, (*each_pkg)->name)) continue;
+						if (!strcmp(each_pkg_info->version, (*each_pkg)->version)) {
+							// the new package owns what it still has, the rest goes
+							if (flags & PKG_REINSTALL) array_push(old, each_pkg_info);
+						} else if (flags & PKG_UPGRADE) {
+							if (pkg_confirm && !pkg_confirm("Remove package %s/%s?", each_pkg_info->name, each_pkg_info->version)) continue;
+							array_push(old, each_pkg_info);
+						};
+					};
 				};
-				waitpid(script_pid, &status, 0);
+				if (array_length(old)) pkg_db_drop_many(db, old, warning_stream);
 			};
+			profile_end(profile_mark);
 		};
 		catch {
-			if (exception_type_is(exception_type_glob_aborted) || exception_type_is(exception_type_glob_nomatch)) {
-				if (warning_stream) fprintf(warning_stream, "Post-install scripts not available\n");
-			} else {
-				throw_proxy();
-			};
-		};
-	
-		if (flags & PKG_UPGRADE) {
-			array_foreach(db->pkgs, struct pkg_info *, each_pkg_info) {
-				if (!strcmp(each_pkg_info->name, pkg->name) && strcmp(each_pkg_info->version, pkg->version)) {
-					if (pkg_confirm && !pkg_confirm("Remove package %s/%s?", each_pkg_info->name, each_pkg_info->version)) continue;
-					pkg_db_drop(db, each_pkg_info, warning_stream);
-				};
-			};
+			exception_print(stderr);
+			throw(exception_type_pkg_finish_failed, 1, "Packages installed, finishing the install failed.", NULL);
 		};
 	};
 };
 
-int string_compare(const void *foo, const void *bar) {
-	return strcmp(*(char **)foo, *(char **)bar);
+void pkg_install(const char *pkg_path, const char *root, const char *db_path, int flags, FILE *warning_stream) {
+	scope {
+		char **pkg_paths = array_new(char *, 0, ARRAY_NULL_TERMINATED);
+		array_push(pkg_paths, (char *)pkg_path);
+		pkg_install_many(pkg_paths, root, db_path, flags, warning_stream);
+	};
 };
 
 struct pkg_info *pkg_db_find_info(struct pkg_db *db, const char *name, const char *version) {
 	return NULL;
 };
 
-void pkg_db_drop(struct pkg_db *db, struct pkg_info *pkg_info, FILE *warning_stream) {
+struct pkg_unlinker {
+	const char *root;
+	char *dir;
+	char *dir_path;
+	int fd;
+};
+
+static void pkg_unlinker_close(void *ptr) {
+	struct pkg_unlinker *unlinker = ptr;
+	if (unlinker->fd >= 0) close(unlinker->fd);
+	unlinker->fd = -1;
+};
+
+static struct pkg_unlinker *pkg_unlinker_new(const char *root) {
+	struct pkg_unlinker *unlinker = new(struct pkg_unlinker);
+	unlinker->root = root;
+	unlinker->dir = string_new();
+	unlinker->dir_path = string_new();
+	unlinker->fd = -1;
+	scope_add(unlinker, pkg_unlinker_close);
+	return unlinker;
+};
+
+/* Removes a file or an empty directory relative to the directory of the previous
+ * one, sorted file lists make neighbours share it. */
+static int pkg_unlink(struct pkg_unlinker *unlinker, const char *path) {
+	const char *slash = strrchr(path, '/');
+	int dir_length = slash ? slash - path : 0;
+	if (unlinker->fd < 0 || (int)string_length(unlinker->dir) != dir_length || strncmp(unlinker->dir, path, dir_length)) {
+		pkg_unlinker_close(unlinker);
+		string_fmt(unlinker->dir, "%.*s", dir_length, path);
+		string_fmt(unlinker->dir_path, "%s/%s", unlinker->root, unlinker->dir);
+		if ((unlinker->fd = open(unlinker->dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) return -1;
+	};
+	const char *name = slash ? slash + 1 : path;
+	if (unlinkat(unlinker->fd, name, 0)) {
+		if (errno != EISDIR && errno != EPERM) return -1;
+		return unlinkat(unlinker->fd, name, AT_REMOVEDIR);
+	};
+	return 0;
+};
+
+/* name or name/version, a NULL or empty names list selects everything. */
+int pkg_info_selected(struct pkg_info *pkg_info, char **names) {
+	if (!names || !*names) return 1;
+	for (; *names; names++) {
+		const char *slash = strchr(*names, '/');
+		if (!slash && !strcmp(*names, pkg_info->name)) return 1;
+		if (slash && (size_t)(slash - *names) == strlen(pkg_info->name) && !strncmp(*names, pkg_info->name, slash - *names) && !strcmp(slash + 1, pkg_info->version)) return 1;
+	};
+	return 0;
+};
+
+static int pkg_db_dropped(struct pkg_info **drop, struct pkg_info *pkg_info) {
+	array_foreach(drop, struct pkg_info **, each_drop) {
+		if (*each_drop == pkg_info) return 1;
+	};
+	return 0;
+};
+
+/* Another entry of the same version stays, the one installed again. */
+static int pkg_db_drop_replaced(struct pkg_db *db, struct pkg_info **drop, struct pkg_info *pkg_info) {
+	array_foreach(db->pkgs, struct pkg_info *, each_pkg_info) {
+		if (pkg_db_dropped(drop, each_pkg_info)) continue;
+		if (!strcmp(each_pkg_info->name, pkg_info->name) && !strcmp(each_pkg_info->version, pkg_info->version)) return 1;
+	};
+	return 0;
+};
+
+/* Drops several packages with one pass over the files. A file goes away when
+ * no package staying has it; both lists are sorted, so ownership is one merge
+ * per staying package instead of a search per file. The database entry of a
+ * version installed again belongs to the staying one. */
+static void pkg_db_drop_many(struct pkg_db *db, struct pkg_info **drop, FILE *warning_stream) {
 	scope {
-		char *pkg_info_path = string_new_fmt("%s/%s/%s", db->path, pkg_info->name, pkg_info->version);
-		char *file_path = string_new();;
-		array_foreach_reverse(pkg_info->files, char **, each_file) {
-			array_foreach(db->pkgs, struct pkg_info *, each_pkg_info) {
-				if (each_pkg_info == pkg_info) continue;
-				array_foreach(each_pkg_info->files, char **, each_pkg_info_file) {
-					if (!strcmp(*each_file, *each_pkg_info_file)) goto skip_file_remove;
+		char **files = array_new(char *, 0, 0);
+		struct pathlist_iter iter;
+		array_foreach(drop, struct pkg_info **, each_drop) {
+			pathlist_iter_init(&iter, pkg_db_files(db, *each_drop));
+			for (const char *path; (path = pathlist_next(&iter)); ) {
+				array_push(files, string_new_set(path));
+			};
+		};
+		strings_sort(files);
+		// packages dropped together may share files
+		size_t length = 0;
+		array_foreach(files, char **, each_file) {
+			if (!length || strcmp(files[length - 1], *each_file)) files[length++] = *each_file;
+		};
+		array_resize(files, length);
+		uint64_t *hashes = array_new(uint64_t, 0, 0);
+		array_foreach(files, char **, each_file) {
+			array_push(hashes, pkg_path_hash(*each_file));
+		};
+		char *owned = kga_malloc(array_length(files) + 1);
+		scope_add(owned, free);
+		memset(owned, 0, array_length(files) + 1);
+		array_foreach(db->pkgs, struct pkg_info *, each_pkg_info) {
+			if (pkg_db_dropped(drop, each_pkg_info) || !pkg_info_may_have(each_pkg_info, hashes)) continue;
+			pathlist_iter_init(&iter, pkg_db_files(db, each_pkg_info));
+			const char *path = pathlist_next(&iter);
+			for (size_t i = 0, n = array_length(files); i < n && path; ) {
+				int compare = strcmp(files[i], path);
+				if (compare < 0) {
+					i++;
+				} else if (compare > 0) {
+					path = pathlist_next(&iter);
+				} else {
+					owned[i++] = 1;
 				};
 			};
-			string_fmt(file_path, "%s/%s", db->root, *each_file);
+		};
+		char *file_path = string_new();
+		struct pkg_unlinker *unlinker = pkg_unlinker_new(db->root);
+		// odd before the first unlink, lists naming files already gone are no snapshot
+		pkg_db_write_begin(db);
+		for (size_t i = array_length(files); i-- > 0; ) {
+			if (owned[i]) continue;
+			string_fmt(file_path, "%s/%s", db->root, files[i]);
 			if (warning_stream) fprintf(warning_stream, "Removing %s\n", file_path);
-			if (remove(file_path) && warning_stream) {
+			if (pkg_unlink(unlinker, files[i]) && warning_stream) {
 				fprintf(warning_stream, "remove: %s: %s\n", file_path, strerror(errno));
 			};
-			skip_file_remove:;
 		};
-		if (warning_stream) fprintf(warning_stream, "Removing %s\n", pkg_info_path);
-		if (remove(pkg_info_path) && warning_stream) {
-			fprintf(warning_stream, "remove: %s: %s\n", pkg_info_path, strerror(errno));
+		char *pkg_info_path = string_new();
+		array_foreach(drop, struct pkg_info **, each_drop) {
+			if (pkg_db_drop_replaced(db, drop, *each_drop)) continue;
+			string_fmt(pkg_info_path, "%s/%s/%s", db->path, (*each_drop)->name, (*each_drop)->version);
+			if (warning_stream) fprintf(warning_stream, "Removing %s\n", pkg_info_path);
+			if (remove(pkg_info_path) && warning_stream) {
+				fprintf(warning_stream, "remove: %s: %s\n", pkg_info_path, strerror(errno));
+			};
+			string_fmt(pkg_info_path, "%s/%s/" PKG_DB_SUMS_NAME, db->path, (*each_drop)->name, (*each_drop)->version);
+			if (remove(pkg_info_path) && errno != ENOENT && warning_stream) {
+				fprintf(warning_stream, "remove: %s: %s\n", pkg_info_path, strerror(errno));
+			};
+			string_fmt(pkg_info_path, "%s/%s/" PKG_DB_BLOOM_NAME, db->path, (*each_drop)->name, (*each_drop)->version);
+			if (remove(pkg_info_path) && errno != ENOENT && warning_stream) {
+				fprintf(warning_stream, "remove: %s: %s\n", pkg_info_path, strerror(errno));
+			};
 		};
+		pkg_db_write_end(db);
 	};
 };
 
-void pkg_drop(const char *root, const char *db_path, const char *name, const char *version, FILE *warning_stream) {
+void pkg_db_drop(struct pkg_db *db, struct pkg_info *pkg_info, FILE *warning_stream) {
+	scope {
+		struct pkg_info **drop = array_new(struct pkg_info *, 0, 0);
+		array_push(drop, pkg_info);
+		pkg_db_drop_many(db, drop, warning_stream);
+	};
+};
+
+/* names are name or name/version, NULL terminated. */
+void pkg_drop_many(const char *root, const char *db_path, char **names, FILE *warning_stream) {
+	important_check(names);
+	if (!*names) return;
 	scope {
 		struct pkg_db *db = pkg_db_new(root, db_path);
 		pkg_db_lock(db);
-		pkg_db_load_pkgs(db, 1);
+		pkg_db_load_pkgs(db, PKG_DB_LOAD_BLOOMS);
+		struct pkg_info **drop = array_new(struct pkg_info *, 0, 0);
 		array_foreach(db->pkgs, struct pkg_info *, each_pkg_info) {
-			if (!strcmp(each_pkg_info->name, name) && (!version || !strcmp(each_pkg_info->version, version))) {
-				pkg_db_drop(db, each_pkg_info, warning_stream);
+			if (pkg_info_selected(each_pkg_info, names)) array_push(drop, each_pkg_info);
+		};
+		if (warning_stream) {
+			for (char **each_name = names; *each_name; each_name++) {
+				char *single[] = {*each_name, NULL};
+				int found = 0;
+				array_foreach(drop, struct pkg_info **, each_drop) {
+					if (pkg_info_selected(*each_drop, single)) found = 1;
+				};
+				if (!found) fprintf(warning_stream, "Package %s is not installed\n", *each_name);
 			};
 		};
+		pkg_db_drop_many(db, drop, warning_stream);
+	};
+};
+
+void pkg_drop(const char *root, const char *db_path, const char *name, const char *version, FILE *warning_stream) {
+	scope {
+		char *names[] = {version ? string_new_fmt("%s/%s", name, version) : string_new_set(name), NULL};
+		pkg_drop_many(root, db_path, names, warning_stream);
 	};
 };
 
@@ -582,3 +1560,173 @@ struct pkg_list_item *pkg_db_list(const char *pkg_root, const char *db_path) {
 	};
 	return list;
 };
+
+struct pkg_files_read {
+	char **names;
+	struct pathlist **lists;
+	char **missing;
+};
+
+static void pkg_files_read(struct pkg_db *db, void *data) {
+	struct pkg_files_read *read = data;
+	array_resize(read->lists, 0);
+	array_resize(read->missing, 0);
+	for (char **each_name = read->names; *each_name; each_name++) {
+		char *single[] = {*each_name, NULL};
+		int found = 0;
+		array_foreach(db->pkgs, struct pkg_info *, each_pkg_info) {
+			if (!pkg_info_selected(each_pkg_info, single)) continue;
+			found = 1;
+			array_push(read->lists, pkg_db_files(db, each_pkg_info));
+		};
+		if (!found) array_push(read->missing, *each_name);
+	};
+};
+
+/* Prints the files of the selected packages, nonzero when one is missing. */
+int pkg_files(const char *root, const char *db_path, char **names, FILE *out, FILE *warning_stream) {
+	int ret = 0;
+	scope {
+		struct pkg_db *db = pkg_db_new(root, db_path);
+		struct pkg_files_read read = {names, array_new(struct pathlist *, 0, 0), array_new(char *, 0, 0)};
+		pkg_db_read(db, 0, pkg_files_read, &read);
+		array_foreach(read.lists, struct pathlist **, each_list) {
+			struct pathlist_iter iter;
+			pathlist_iter_init(&iter, *each_list);
+			for (const char *path; (path = pathlist_next(&iter)); ) {
+				fprintf(out, "/%s\n", path);
+			};
+		};
+		array_foreach(read.missing, char **, each_missing) {
+			if (warning_stream) fprintf(warning_stream, "Package %s is not installed\n", *each_missing);
+			ret = 1;
+		};
+	};
+	return ret;
+};
+
+struct pkg_verify_entry {
+	const char *pkg;
+	const char *path;
+	struct pkg_sum sum;
+};
+
+struct pkg_verify_read {
+	char **names;
+	struct pkg_verify_entry *entries;
+	char **unsummed;
+};
+
+static void pkg_verify_entries_load(struct pkg_db *db, void *data) {
+	struct pkg_verify_read *read = data;
+	array_resize(read->entries, 0);
+	array_resize(read->unsummed, 0);
+	array_foreach(db->pkgs, struct pkg_info *, each_pkg_info) {
+		if (!pkg_info_selected(each_pkg_info, read->names)) continue;
+		char *pkg = string_new_fmt("%s/%s", each_pkg_info->name, each_pkg_info->version);
+		struct pkg_file *files = pkg_db_info_sums(db, each_pkg_info);
+		if (!files) {
+			array_push(read->unsummed, pkg);
+			continue;
+		};
+		array_foreach(files, struct pkg_file *, each_file) {
+			struct pkg_verify_entry entry = {pkg, each_file->path, each_file->sum};
+			array_push(read->entries, entry);
+		};
+	};
+};
+
+static const char *pkg_verify_entry_check(const char *root, struct pkg_verify_entry *entry, int flags) {
+	const char *problem = NULL;
+	scope {
+		char *path = string_new_fmt("%s/%s", root, entry->path);
+		struct stat st;
+		if (lstat(path, &st)) {
+			problem = errno == ENOENT ? "missing" : strerror(errno);
+		} else if ((st.st_mode & S_IFMT) != (entry->sum.mode & S_IFMT)) {
+			problem = "type changed";
+		} else if ((st.st_mode & 07777) != (entry->sum.mode & 07777)) {
+			problem = "mode changed";
+		} else if (S_ISLNK(st.st_mode)) {
+			char *target = kga_readlink(path);
+			if (hash_data(target, strlen(target)) != entry->sum.hash) problem = "target changed";
+		} else if (st.st_size != entry->sum.size) {
+			problem = "size changed";
+		} else if (!(flags & PKG_VERIFY_QUICK) || st.st_mtime != entry->sum.mtime) {
+			if (hash_file(path) != entry->sum.hash) problem = "content changed";
+		};
+	};
+	return problem;
+};
+
+/* Each worker checks every jobs-th entry and reports problems through a shared
+ * pipe as lines of the entry index and the problem. Paths stay out and the
+ * problem is cut short, so a line is one write below PIPE_BUF and lines of
+ * different workers can not interleave. */
+static void pkg_verify_worker(const char *root, struct pkg_verify_entry *entries, long int worker, long int jobs, int flags, int fd) {
+	char line[PIPE_BUF];
+	for (size_t i = worker, n = array_length(entries); i < n; i += jobs) {
+		const char *problem;
+		try problem = pkg_verify_entry_check(root, &entries[i], flags);
+		catch problem = exception()->message;
+		if (!problem) continue;
+		int length = snprintf(line, PIPE_BUF, "%zu %.*s\n", i, PIPE_BUF / 2, problem);
+		if (write(fd, line, length) < 0) throw_errno();
+	};
+};
+
+int pkg_verify(const char *root, const char *db_path, char **names, long int jobs, int flags, FILE *out, FILE *warning_stream) {
+	int problems = 0;
+	scope {
+		struct pkg_db *db = pkg_db_new(root, db_path);
+		struct pkg_verify_read read = {names, array_new(struct pkg_verify_entry, 0, 0), array_new(char *, 0, 0)};
+		pkg_db_read(db, 0, pkg_verify_entries_load, &read);
+		array_foreach(read.unsummed, char **, each_pkg) {
+			if (warning_stream) fprintf(warning_stream, "No checksums for %s\n", *each_pkg);
+		};
+		struct pkg_verify_entry *entries = read.entries;
+		if (jobs < 1) jobs = 1;
+		if ((size_t)jobs > array_length(entries)) jobs = array_length(entries) ? array_length(entries) : 1;
+		int *fds = kga_pipe();
+		pid_t *workers = array_new(pid_t, 0, 0);
+		fflush(NULL);
+		for (long int worker = 0; worker < jobs; worker++) {
+			pid_t pid = kga_fork();
+			if (!pid) {
+				int ret = EXIT_SUCCESS;
+				close(fds[0]);
+				try pkg_verify_worker(root, entries, worker, jobs, flags, fds[1]);
+				catch {
+					exception_print(stderr);
+					ret = EXIT_FAILURE;
+				};
+				_exit(ret);
+			};
+			array_push(workers, pid);
+		};
+		close(fds[1]);
+		fds[1] = -1;
+		FILE *report = kga_fdopen(fds[0], "r");
+		fds[0] = -1;
+		char *line = string_new();
+		for (int c; (c = fgetc(report)) != EOF; ) {
+			if (c != '\n') {
+				string_push(line, c);
+				continue;
+			};
+			char *problem;
+			size_t i = strtoul(line, &problem, 10);
+			if (i < array_length(entries) && *problem == ' ') {
+				if (out) fprintf(out, "%s: %s: %s\n", entries[i].pkg, entries[i].path, problem + 1);
+				problems++;
+			};
+			string_set(line, "");
+		};
+		array_foreach(workers, pid_t *, each_worker) {
+			int status;
+			waitpid(*each_worker, &status, 0);
+			if (status) throw(exception_type_pkg_verify_failed, 1, "verify worker failed", NULL);
+		};
+	};
+	return problems;
+};
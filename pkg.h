@@ -5,20 +5,36 @@
 
 #define PKG_UPGRADE 1
 #define PKG_FORCE_INSTALL 2
+#define PKG_DEFER_HOOKS 4
+#define PKG_INCREMENTAL 8
+#define PKG_REINSTALL 16
+
+#define PKG_VERIFY_QUICK 1
 
 exception_type_t exception_type_pkg_files_conflict;
 exception_type_t exception_type_pkg_db_already_locked;
 exception_type_t exception_type_pkg_already_installed;
+exception_type_t exception_type_pkg_verify_failed;
+/* Thrown by installs failing after the commit, the packages are installed. */
+exception_type_t exception_type_pkg_finish_failed;
 
 int (*pkg_confirm)(const char *fmt, ...);
+/* Seconds to wait for the package database, -1 waits forever for the lock
+ * and PKG_READ_TIMEOUT for a commit to end. */
+long int pkg_lock_timeout;
+#define PKG_READ_TIMEOUT 30
 
 struct pkg_list_item {
 	const char *name, *version;
 };
 
 void pkg_install(const char *pkg_path, const char *root, const char *db_path, int flags, FILE *warning_stream);
-void pkg_finish_installs(const char *root);
+void pkg_install_many(char **pkg_paths, const char *root, const char *db_path, int flags, FILE *warning_stream);
+void pkg_finish_installs(const char *root, const char *cwd, FILE *warning_stream);
 void pkg_drop(const char *root, const char *db_path, const char *name, const char *version, FILE *warning_stream);
+void pkg_drop_many(const char *root, const char *db_path, char **names, FILE *warning_stream);
 int pkg_installed(const char *pkg_root, const char *db_path, const char *name, const char *version);
+int pkg_verify(const char *root, const char *db_path, char **names, long int jobs, int flags, FILE *out, FILE *warning_stream);
 struct pkg_list_item *pkg_db_list(const char *pkg_root, const char *db_path);
+int pkg_files(const char *root, const char *db_path, char **names, FILE *out, FILE *warning_stream);
 #endif
@@ -0,0 +1,95 @@
+#ifndef _PKG_INTERNAL_H_
+#define _PKG_INTERNAL_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "pathlist.h"
+#include "bloom.h"
+
+#define PKG_FILE_DIR 1
+#define PKG_FILE_LNK 2
+#define PKG_FILE_UNCHANGED 4
+#define PKG_WALK_BUFFER_SIZE 65536
+#define PKG_DB_SORTED_HEADER "/sorted"
+#define PKG_DB_SUMS_NAME ".%s.sums"
+#define PKG_DB_BLOOM_NAME ".%s.bloom"
+#define PKG_DB_LOCK_NAME ".lock"
+#define PKG_DB_LEGACY_LOCK_NAME ".LOCK"
+#define PKG_DB_LEGACY_LOCK_MARK_NAME ".LOCK/ofd"
+#define PKG_DB_GENERATION_NAME ".generation"
+#define PKG_DB_INDEX_NAME ".index"
+#define PKG_DB_INDEX_MAGIC "PKGIDX1"
+#define PKG_DB_POLL_INTERVAL 10000
+#define PKG_DB_LOAD_FILES 1
+#define PKG_DB_LOAD_BLOOMS 2
+
+struct pkg_sum {
+	uint64_t hash;
+	long long int size;
+	unsigned int mode;
+	long long int mtime;
+};
+
+struct pkg_file {
+	int flags;
+	char *path;
+	struct pkg_sum sum;
+};
+
+struct pkg_fs_transaction {
+	const char *from, *to, *backup;
+	int exchanged;
+};
+
+struct pkg {
+	const char *path;
+	const char *name;
+	const char *version;
+	struct pkg_file *files;
+};
+
+/* files may be NULL until pkg_db_files reads it, bloom is NULL for
+ * packages installed before filters were kept. */
+struct pkg_info {
+	const char *name;
+	const char *version;
+	struct pathlist *files;
+	struct bloom *bloom;
+};
+
+struct pkg_db {
+	const char *lock_path;
+	const char *legacy_lock_path;
+	const char *legacy_lock_mark_path;
+	const char *path;
+	const char *root;
+	int lock_counter;
+	int lock_fd;
+	pid_t lock_pid;
+	unsigned long long int generation;
+	void *pool;
+	struct pkg_info *pkgs;
+};
+
+struct pkg_db_conflict {
+	struct pkg_info *info;
+	char **files;
+};
+
+struct pkg_db *pkg_db_new(const char *root, const char *db_path);
+void pkg_db_load_pkgs(struct pkg_db *db, int load);
+struct pathlist *pkg_db_info_files(const char *path);
+struct pathlist *pkg_pathlist_new(char **paths, size_t count);
+struct bloom *pkg_bloom_new(const struct pathlist *files);
+struct pathlist *pkg_db_files(struct pkg_db *db, struct pkg_info *pkg_info);
+unsigned long long int pkg_db_generation(struct pkg_db *db);
+int pkg_info_selected(struct pkg_info *pkg_info, char **names);
+int pkgdb_read_generation(const char *db_dir, unsigned long long int *generation);
+int pkgdb_writer_alive(const char *db_dir);
+struct pkg *pkg_load(const char *pkg_path);
+struct pkg_db_conflict *pkg_db_find_conflicts(struct pkg_db *db, struct pkg *pkg);
+void pkg_db_drop(struct pkg_db *db, struct pkg_info *pkg_info, FILE *warning_stream);
+void transaction_fs_transactions_commit(struct pkg_fs_transaction *transactions, FILE *warning_stream);
+void transaction_fs_transactions_rollback(struct pkg_fs_transaction *transactions, FILE *warning_stream);
+#endif
@@ -1,21 +1,80 @@
+#define _POSIX_C_SOURCE 200809L
 #include <kga/array.h>
 #include <kga/kga.h>
+#include <kga/string.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <getopt.h>
 #include <signal.h>
+#include <unistd.h>
 #include "pkg.h"
 #include "misc.h"
 #include "config.h"
 #include "main_common.h"
+#include "profile.h"
+#include "pkgd.h"
+#include "pkgdb.h"
 
 exception_type_t pkg_main_incorrect_cmd;
 
 static const char *root = "";
 static const char *db_path = PKG_DB_DEFAULT_PATH;
+static long int jobs = 0;
+static int verify_flags = 0;
+static int direct = 0;
 
 void usage(FILE *out) {
 };
 
+/* Arguments after the subcommand, or lines of stdin for none or "-". */
+static char **pkg_main_args(int argc, char **argv) {
+	if (argc > 2 || (argc == 2 && strcmp(argv[1], "-"))) return argv;
+	char **args = array_new(char *, 0, ARRAY_NULL_TERMINATED);
+	array_push(args, argv[0]);
+	char **lines = file_lines("/dev/stdin");
+	array_foreach(lines, char **, each_line) {
+		array_push(args, *each_line);
+	};
+	return args;
+};
+
+static void pkg_main_index_close(void *index) {
+	pkgdb_index_close(index);
+};
+
+static int pkg_main_owns(char **paths) {
+	int ret = 0;
+	scope {
+		pkgdb_index_t *index;
+		int error = pkgdb_index_open(root, db_path, (pkg_lock_timeout < 0 ? PKG_READ_TIMEOUT : pkg_lock_timeout) * 1000, &index);
+		if (error) {
+			errno = error;
+			throw_errno_verbose(db_path);
+		};
+		scope_add(index, pkg_main_index_close);
+		pkgdb_iter_t iter;
+		const char *owner;
+		for (char **each_path = paths; *each_path; each_path++) {
+			if (!pkgdb_index_owners(index, *each_path, &iter)) {
+				fprintf(stderr, "%s is not owned by any package\n", *each_path);
+				ret = 1;
+			};
+			while ((owner = pkgdb_next_owner(&iter))) printf("%s %s\n", *each_path, owner);
+		};
+	};
+	return ret;
+};
+
+/* Hands the request to pkgd when one runs for this database, 0 when it has
+ * to be done here. */
+static int pkg_main_daemon(char **args, int *ret) {
+	if (direct || pkg_confirm || profile_enabled()) return 0;
+	int status = pkgd_call(root, db_path, args, stdout, stderr);
+	if (status < 0) return 0;
+	if (status) *ret = EXIT_FAILURE;
+	return 1;
+};
+
 int main(int argc, char **argv) {
 	int ret = EXIT_SUCCESS;
 	int opt;
@@ -24,7 +83,7 @@ int main(int argc, char **argv) {
 	set_signal_handler(SIGINT, interrupted);
 	set_signal_handler(SIGTERM, interrupted);
 	try_scope {
-		while ((opt = getopt(argc, argv, "r:d:ti")) != -1) {
+		while ((opt = getopt(argc, argv, "r:d:tiPT:j:mw:D")) != -1) {
 			switch(opt) {
 			case 'i':
 				pkg_confirm = common_confirm;
@@ -35,6 +94,24 @@ int main(int argc, char **argv) {
 			case 'd':
 				db_path = optarg;
 				break;
+			case 'P':
+				profile_enable(NULL);
+				break;
+			case 'T':
+				profile_enable(optarg);
+				break;
+			case 'j':
+				jobs = strtol(optarg, NULL, 10);
+				break;
+			case 'm':
+				verify_flags |= PKG_VERIFY_QUICK;
+				break;
+			case 'w':
+				pkg_lock_timeout = strtol(optarg, NULL, 10);
+				break;
+			case 'D':
+				direct = 1;
+				break;
 			default:
 				throw(pkg_main_incorrect_cmd, 1, "unknown option", NULL);
 				break;
@@ -45,27 +122,64 @@ int main(int argc, char **argv) {
 		if (!real_argc) {
 			throw(pkg_main_incorrect_cmd, 1, "no subcommand", NULL);
 		} else if (!strcmp(real_argv[0], "install")) {
-			if (real_argc != 2) {
+			if (real_argc < 2) {
 				throw(pkg_main_incorrect_cmd, 1, "incorrect subcommand", NULL);
 			};
-			pkg_install(real_argv[1], root, db_path, 0, stderr);
+			if (!pkg_main_daemon(real_argv, &ret)) pkg_install_many(&real_argv[1], root, db_path, 0, stderr);
 		} else if (!strcmp(real_argv[0], "upgrade")) {
-			if (real_argc != 2) {
+			if (real_argc < 2) {
 				throw(pkg_main_incorrect_cmd, 1, "incorrect subcommand", NULL);
 			};
-			pkg_install(real_argv[1], root, db_path, PKG_UPGRADE, stderr);
+			if (!pkg_main_daemon(real_argv, &ret)) pkg_install_many(&real_argv[1], root, db_path, PKG_UPGRADE | PKG_INCREMENTAL, stderr);
 		} else if (!strcmp(real_argv[0], "drop")) {
-			if (real_argc < 2 || real_argc > 3) {
+			if (real_argc < 2) {
+				throw(pkg_main_incorrect_cmd, 1, "incorrect subcommand", NULL);
+			};
+			if (real_argc == 3 && !strchr(real_argv[1], '/') && !strchr(real_argv[2], '/')) {
+				if (pkg_installed(root, db_path, real_argv[1], real_argv[2])) {
+					// old "drop name version" form
+					real_argv[1] = string_new_fmt("%s/%s", real_argv[1], real_argv[2]);
+					real_argv[2] = NULL;
+				} else if (!pkg_installed(root, db_path, real_argv[2], NULL)) {
+					// a version that is not there would drop every version of the name
+					throw(pkg_main_incorrect_cmd, 1, "neither a version nor a package, give name/version", real_argv[2]);
+				};
+			};
+			if (!pkg_main_daemon(real_argv, &ret)) pkg_drop_many(root, db_path, &real_argv[1], stderr);
+		} else if (!strcmp(real_argv[0], "installed")) {
+			if (real_argc < 2) {
 				throw(pkg_main_incorrect_cmd, 1, "incorrect subcommand", NULL);
 			};
-			char *slash;
-			if ((slash = strchr(real_argv[1], '/'))) {
-				*slash = '\0';
-				pkg_drop(root, db_path, real_argv[1], &slash[1], stderr);
-				
-			} else {
-				pkg_drop(root, db_path, real_argv[1], real_argc == 2 ? NULL : real_argv[2], stderr);
-			}
+			if (!pkg_main_daemon(real_argv, &ret)) {
+				for (char **each_spec = &real_argv[1]; *each_spec; each_spec++) {
+					char *slash = strchr(*each_spec, '/');
+					if (slash) *slash = '\0';
+					if (!pkg_installed(root, db_path, *each_spec, slash ? &slash[1] : NULL)) ret = EXIT_FAILURE;
+				};
+			};
+		} else if (!strcmp(real_argv[0], "owns")) {
+			char **args = pkg_main_args(real_argc, real_argv);
+			if (!pkg_main_daemon(args, &ret) && pkg_main_owns(&args[1])) ret = EXIT_FAILURE;
+		} else if (!strcmp(real_argv[0], "files")) {
+			char **args = pkg_main_args(real_argc, real_argv);
+			if (!pkg_main_daemon(args, &ret) && pkg_files(root, db_path, &args[1], stdout, stderr)) ret = EXIT_FAILURE;
+		} else if (!strcmp(real_argv[0], "list")) {
+			if (!pkg_main_daemon(real_argv, &ret)) {
+				char **names = array_new(char *, 0, 0);
+				struct pkg_list_item *list = pkg_db_list(root, db_path);
+				array_foreach(list, struct pkg_list_item *, each_item) {
+					array_push(names, string_new_fmt("%s/%s", each_item->name, each_item->version));
+				};
+				strings_sort(names);
+				array_foreach(names, char **, each_name) {
+					printf("%s\n", *each_name);
+				};
+			};
+		} else if (!strcmp(real_argv[0], "daemon")) {
+			pkgd_serve(root, db_path, stderr);
+		} else if (!strcmp(real_argv[0], "verify")) {
+			if (jobs < 1) jobs = sysconf(_SC_NPROCESSORS_ONLN);
+			if (pkg_verify(root, db_path, &real_argv[1], jobs, verify_flags, stdout, stderr)) ret = EXIT_FAILURE;
 		} else {
 			throw(pkg_main_incorrect_cmd, 1, "unknown subcommand", NULL);
 		};
@@ -79,5 +193,13 @@ int main(int argc, char **argv) {
 		};
 		ret = EXIT_FAILURE;
 	};
+	try {
+		profile_report(stderr);
+		profile_trace_write();
+	};
+	catch {
+		exception_print(stderr);
+		ret = EXIT_FAILURE;
+	};
 	return ret;
 };
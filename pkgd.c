@@ -0,0 +1,504 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <kga/kga.h>
+#include <kga/scope.h>
+#include <kga/string.h>
+#include <kga/array.h>
+#include "pkg.h"
+#include "pkg_internal.h"
+#include "pkgd.h"
+#include "kga_wrappers.h"
+
+/* The daemon keeps every file list and a path to owner index in memory and
+ * answers queries from them. Requests are one argument per line ended by an
+ * empty line, replies are a "status out_size err_size" line and the output.
+ * Installs and drops run in a forked child, so queries keep being answered
+ * from the last consistent snapshot meanwhile. A request may start with "-w"
+ * and the seconds to wait, the -w of the client. */
+
+struct pkgd_pkg {
+	scope_pool_t *pool;
+	struct pkg_info info;
+	// the list file, a version dropped and installed again is another one
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	int seen;
+};
+
+/* Paths stay front coded in the file lists, an owner is an entry of one. */
+struct pkgd_owner {
+	struct pkgd_pkg *pkg;
+	size_t index;
+};
+
+struct pkgd {
+	const char *root;
+	const char *db_path;
+	struct pkg_db *db;
+	scope_pool_t *index_pool;
+	struct pkgd_pkg **pkgs;
+	struct pkgd_owner *owners;
+	unsigned long long int generation;
+	int loaded;
+	int valid;
+	int stop;
+	long int lock_timeout;
+	pid_t pid;
+};
+
+exception_type_t exception_type_pkgd_error = {};
+
+static void pkgd_close_fd(void *ptr) {
+	close(*(int *)ptr);
+};
+
+static int pkgd_pkg_compare(const void *ptr1, const void *ptr2) {
+	const struct pkgd_pkg *pkg1 = *(struct pkgd_pkg * const *)ptr1;
+	const struct pkgd_pkg *pkg2 = *(struct pkgd_pkg * const *)ptr2;
+	int ret = strcmp(pkg1->info.name, pkg2->info.name);
+	return ret ? ret : strcmp(pkg1->info.version, pkg2->info.version);
+};
+
+/* iter is reused while the owners come from one list. */
+static const char *pkgd_owner_path(const struct pkgd_owner *owner, struct pathlist_iter *iter) {
+	if (iter->list != owner->pkg->info.files) pathlist_iter_init(iter, owner->pkg->info.files);
+	return pathlist_get(iter, owner->index);
+};
+
+struct pkgd_merge {
+	struct pkgd_pkg **pkgs;
+	struct pkgd_owner *owners;
+};
+
+static void pkgd_merge_owner(void *data, size_t list, size_t index, const char *path) {
+	struct pkgd_merge *merge = data;
+	struct pkgd_owner owner = {merge->pkgs[list], index};
+	(void)path;
+	array_push(merge->owners, owner);
+};
+
+static void pkgd_pkg_free(struct pkgd_pkg *pkg) {
+	scope_pool_free(pkg->pool);
+	free(pkg);
+};
+
+/* First package with the name, or the name and version, and their count. */
+static struct pkgd_pkg **pkgd_lookup(struct pkgd *pkgd, const char *spec, size_t *count) {
+	const char *slash = strchr(spec, '/');
+	size_t name_length = slash ? (size_t)(slash - spec) : strlen(spec);
+	size_t low = 0, high = array_length(pkgd->pkgs);
+	while (low < high) {
+		size_t middle = (low + high) / 2;
+		const char *name = pkgd->pkgs[middle]->info.name;
+		int ret = strncmp(name, spec, name_length);
+		if (!ret && name[name_length]) ret = 1;
+		if (!ret && slash) ret = strcmp(pkgd->pkgs[middle]->info.version, slash + 1);
+		if (ret < 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		};
+	};
+	*count = 0;
+	char *names[] = {(char *)spec, NULL};
+	while (low + *count < array_length(pkgd->pkgs) && pkg_info_selected(&pkgd->pkgs[low + *count]->info, names)) (*count)++;
+	return &pkgd->pkgs[low];
+};
+
+static struct pkgd_owner *pkgd_owners(struct pkgd *pkgd, const char *path, size_t *count) {
+	while (*path == '/') path++;
+	struct pathlist_iter iter = {NULL};
+	size_t low = 0, high = array_length(pkgd->owners);
+	while (low < high) {
+		size_t middle = (low + high) / 2;
+		if (strcmp(pkgd_owner_path(&pkgd->owners[middle], &iter), path) < 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		};
+	};
+	*count = 0;
+	while (low + *count < array_length(pkgd->owners) && !strcmp(pkgd_owner_path(&pkgd->owners[low + *count], &iter), path)) (*count)++;
+	return &pkgd->owners[low];
+};
+
+/* Loads file lists of packages that appeared since the last refresh and
+ * forgets the ones that went away, the index is merged rather than rebuilt.
+ * While a writer commits the last snapshot is still the answer. */
+static void pkgd_refresh(struct pkgd *pkgd) {
+	unsigned long long int generation = pkg_db_generation(pkgd->db);
+	if (pkgd->valid && generation == pkgd->generation) return;
+	if (pkgd->loaded && (generation & 1) && pkgdb_writer_alive(pkgd->db->path)) return;
+	scope {
+		struct pkg_db *db = pkg_db_new(pkgd->root, pkgd->db_path);
+		pkg_db_load_pkgs(db, 0);
+		int valid = 1;
+		array_foreach(pkgd->pkgs, struct pkgd_pkg **, each_pkg) {
+			(*each_pkg)->seen = 0;
+		};
+		struct pkgd_pkg **added = array_new(struct pkgd_pkg *, 0, 0);
+		char *version_path = string_new();
+		array_foreach(db->pkgs, struct pkg_info *, each_info) {
+			size_t count;
+			char *spec = string_new_fmt("%s/%s", each_info->name, each_info->version);
+			struct pkgd_pkg **found = pkgd_lookup(pkgd, spec, &count);
+			struct stat st;
+			string_fmt(version_path, "%s/%s/%s", db->path, each_info->name, each_info->version);
+			if (stat(version_path, &st)) {
+				if (errno != ENOENT) throw_errno_verbose(version_path);
+				// dropped since the listing, the next request looks again
+				valid = 0;
+				continue;
+			};
+			if (count && (*found)->dev == st.st_dev && (*found)->ino == st.st_ino &&
+					(*found)->mtime.tv_sec == st.st_mtim.tv_sec && (*found)->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+				(*found)->seen = 1;
+				continue;
+			};
+			struct pkgd_pkg *pkg = kga_malloc(sizeof(struct pkgd_pkg));
+			pkg->pool = scope_pool_new(0);
+			pkg->dev = st.st_dev;
+			pkg->ino = st.st_ino;
+			pkg->mtime = st.st_mtim;
+			pkg->seen = 1;
+			int loaded = 0;
+			try scope_use(pkg->pool) {
+				pkg->info.name = string_new_set(each_info->name);
+				pkg->info.version = string_new_set(each_info->version);
+				pkg->info.files = pkg_db_info_files(version_path);
+				pkg->info.bloom = NULL;
+				loaded = 1;
+			};
+			// dropped since the listing, the next request looks again
+			catch if (!exception_type_is(exception_type_fopen_no_such_file)) throw_proxy();
+			if (loaded) {
+				array_push(added, pkg);
+			} else {
+				pkgd_pkg_free(pkg);
+				valid = 0;
+			};
+		};
+		array_sort(added, pkgd_pkg_compare);
+		const struct pathlist **lists = array_new(const struct pathlist *, 0, 0);
+		array_foreach(added, struct pkgd_pkg **, each_pkg) {
+			array_push(lists, (*each_pkg)->info.files);
+		};
+		struct pkgd_merge merge = {added, array_new(struct pkgd_owner, 0, 0)};
+		if ((errno = pathlist_merge(lists, array_length(lists), pkgd_merge_owner, &merge))) throw_errno();
+		struct pkgd_owner *new_owners = merge.owners;
+		struct pathlist_iter old_iter = {NULL}, new_iter = {NULL};
+		scope_pool_t *index_pool = scope_pool_new(0);
+		scope_use(index_pool) {
+			struct pkgd_pkg **pkgs = array_new(struct pkgd_pkg *, 0, 0);
+			array_foreach(pkgd->pkgs, struct pkgd_pkg **, each_pkg) {
+				if ((*each_pkg)->seen) array_push(pkgs, *each_pkg);
+			};
+			array_foreach(added, struct pkgd_pkg **, each_pkg) {
+				array_push(pkgs, *each_pkg);
+			};
+			array_sort(pkgs, pkgd_pkg_compare);
+			struct pkgd_owner *owners = array_new(struct pkgd_owner, 0, 0);
+			size_t i = 0, j = 0, n = array_length(pkgd->owners), m = array_length(new_owners);
+			const char *old_path = NULL, *new_path = m ? pkgd_owner_path(&new_owners[0], &new_iter) : NULL;
+			while (i < n || j < m) {
+				if (i < n && !pkgd->owners[i].pkg->seen) {
+					i++;
+					old_path = NULL;
+					continue;
+				};
+				if (i < n && !old_path) old_path = pkgd_owner_path(&pkgd->owners[i], &old_iter);
+				int compare = j >= m ? -1 : i >= n ? 1 : strcmp(old_path, new_path);
+				if (!compare) compare = pkgd_pkg_compare(&pkgd->owners[i].pkg, &new_owners[j].pkg);
+				if (compare <= 0) {
+					array_push(owners, pkgd->owners[i++]);
+					old_path = NULL;
+				} else {
+					array_push(owners, new_owners[j++]);
+					if (j < m) new_path = pkgd_owner_path(&new_owners[j], &new_iter);
+				};
+			};
+			array_foreach(pkgd->pkgs, struct pkgd_pkg **, each_pkg) {
+				if (!(*each_pkg)->seen) pkgd_pkg_free(*each_pkg);
+			};
+			pkgd->pkgs = pkgs;
+			pkgd->owners = owners;
+		};
+		scope_pool_free(pkgd->index_pool);
+		pkgd->index_pool = index_pool;
+		// a writer may have started while the lists were read
+		pkgd->generation = db->generation;
+		pkgd->loaded = 1;
+		pkgd->valid = valid && pkg_db_generation(db) == db->generation;
+	};
+};
+
+static int pkgd_run(struct pkgd *pkgd, char **args, FILE *out, FILE *err) {
+	int status = 0;
+	const char *cmd = args[0];
+	char **rest = &args[1];
+	if (!strcmp(cmd, "install") || !strcmp(cmd, "upgrade")) {
+		pkg_install_many(rest, pkgd->root, pkgd->db_path, !strcmp(cmd, "upgrade") ? PKG_UPGRADE | PKG_INCREMENTAL : 0, err);
+		return 0;
+	} else if (!strcmp(cmd, "drop")) {
+		pkg_drop_many(pkgd->root, pkgd->db_path, rest, err);
+		return 0;
+	} else if (!strcmp(cmd, "stop")) {
+		pkgd->stop = 1;
+		return 0;
+	};
+	pkgd_refresh(pkgd);
+	size_t count;
+	if (!strcmp(cmd, "installed")) {
+		for (char **each_spec = rest; *each_spec; each_spec++) {
+			pkgd_lookup(pkgd, *each_spec, &count);
+			if (!count) status = 1;
+		};
+	} else if (!strcmp(cmd, "list")) {
+		array_foreach(pkgd->pkgs, struct pkgd_pkg **, each_pkg) {
+			fprintf(out, "%s/%s\n", (*each_pkg)->info.name, (*each_pkg)->info.version);
+		};
+	} else if (!strcmp(cmd, "files")) {
+		for (char **each_spec = rest; *each_spec; each_spec++) {
+			struct pkgd_pkg **found = pkgd_lookup(pkgd, *each_spec, &count);
+			if (!count) {
+				fprintf(err, "Package %s is not installed\n", *each_spec);
+				status = 1;
+			};
+			for (size_t i = 0; i < count; i++) {
+				struct pathlist_iter iter;
+				pathlist_iter_init(&iter, found[i]->info.files);
+				for (const char *path; (path = pathlist_next(&iter)); ) {
+					fprintf(out, "/%s\n", path);
+				};
+			};
+		};
+	} else if (!strcmp(cmd, "owns")) {
+		for (char **each_path = rest; *each_path; each_path++) {
+			struct pkgd_owner *found = pkgd_owners(pkgd, *each_path, &count);
+			if (!count) {
+				fprintf(err, "%s is not owned by any package\n", *each_path);
+				status = 1;
+			};
+			for (size_t i = 0; i < count; i++) {
+				fprintf(out, "%s %s/%s\n", *each_path, found[i].pkg->info.name, found[i].pkg->info.version);
+			};
+		};
+	} else {
+		fprintf(err, "Unknown request %s\n", cmd);
+		status = 2;
+	};
+	return status;
+};
+
+static void pkgd_reply(struct pkgd *pkgd, int client, char **args) {
+	char *out_buffer = NULL, *err_buffer = NULL;
+	size_t out_size = 0, err_size = 0;
+	FILE *out = open_memstream(&out_buffer, &out_size);
+	FILE *err = open_memstream(&err_buffer, &err_size);
+	int status = 1;
+	if (out && err) {
+		try status = pkgd_run(pkgd, args, out, err);
+		catch {
+			exception_print(err);
+			status = 1;
+		};
+	};
+	if (out) fclose(out);
+	if (err) fclose(err);
+	scope {
+		FILE *reply = kga_fdopen(kga_dup(client), "w");
+		kga_fprintf(reply, "%i %zu %zu\n", status, out_size, err_size);
+		if (out_size) kga_fwrite(out_buffer, 1, out_size, reply);
+		if (err_size) kga_fwrite(err_buffer, 1, err_size, reply);
+	};
+	free(out_buffer);
+	free(err_buffer);
+};
+
+static char **pkgd_read_args(FILE *file) {
+	char **args = array_new(char *, 0, ARRAY_NULL_TERMINATED);
+	char *line = string_new();
+	for (int c; (c = fgetc(file)) != EOF; ) {
+		if (c != '\n') {
+			string_push(line, c);
+		} else if (!string_length(line)) {
+			break;
+		} else {
+			array_push(args, line);
+			line = string_new();
+		};
+	};
+	return args;
+};
+
+static void pkgd_handle(struct pkgd *pkgd, int client) {
+	scope {
+		char **args = pkgd_read_args(kga_fdopen(kga_dup(client), "r"));
+		pkg_lock_timeout = pkgd->lock_timeout;
+		if (array_length(args) >= 2 && !strcmp(args[0], "-w")) {
+			pkg_lock_timeout = strtol(args[1], NULL, 10);
+			args += 2;
+		};
+		if (!*args) {
+			// nothing asked
+		} else if (!strcmp(args[0], "install") || !strcmp(args[0], "upgrade") || !strcmp(args[0], "drop")) {
+			if (!kga_fork()) {
+				try pkgd_reply(pkgd, client, args);
+				_exit(EXIT_SUCCESS);
+			};
+		} else {
+			pkgd_reply(pkgd, client, args);
+		};
+	};
+};
+
+static int pkgd_connect(const char *socket_path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) return -1;
+	strcpy(addr.sun_path, socket_path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	};
+	return fd;
+};
+
+static void pkgd_stop(void *ptr) {
+	struct pkgd *pkgd = ptr;
+	if (pkgd->pid != getpid()) return;
+	scope {
+		unlink(string_new_fmt("%s/" PKGD_SOCKET_NAME, pkgd->db->path));
+	};
+	array_foreach(pkgd->pkgs, struct pkgd_pkg **, each_pkg) {
+		pkgd_pkg_free(*each_pkg);
+	};
+	scope_pool_free(pkgd->index_pool);
+};
+
+void pkgd_serve(const char *root, const char *db_path, FILE *warning_stream) {
+	scope {
+		struct pkgd *pkgd = new(struct pkgd);
+		memset(pkgd, 0, sizeof(struct pkgd));
+		pkgd->root = root;
+		pkgd->db_path = db_path;
+		pkgd->db = pkg_db_new(root, db_path);
+		pkgd->pid = getpid();
+		pkgd->lock_timeout = pkg_lock_timeout;
+		pkgd->index_pool = scope_pool_new(0);
+		scope_use(pkgd->index_pool) {
+			pkgd->pkgs = array_new(struct pkgd_pkg *, 0, 0);
+			pkgd->owners = array_new(struct pkgd_owner, 0, 0);
+		};
+		kga_mkpath(pkgd->db->path, 0755);
+		char *socket_path = string_new_fmt("%s/" PKGD_SOCKET_NAME, pkgd->db->path);
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+			throw(exception_type_pkgd_error, 1, "Socket path is too long.", socket_path);
+		};
+		strcpy(addr.sun_path, socket_path);
+		int connected = pkgd_connect(socket_path);
+		if (connected >= 0) {
+			close(connected);
+			throw(exception_type_pkgd_error, 1, "Daemon already running.", socket_path);
+		};
+		unlink(socket_path);
+		int *fd = kga_malloc(sizeof(int));
+		if ((*fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) throw_errno();
+		scope_add(fd, pkgd_close_fd);
+		mode_t mask = umask(077);
+		int ret = bind(*fd, (struct sockaddr *)&addr, sizeof(addr));
+		umask(mask);
+		if (ret) throw_errno_verbose(socket_path);
+		scope_add(pkgd, pkgd_stop);
+		if (listen(*fd, 64)) throw_errno();
+		pkgd_refresh(pkgd);
+		if (warning_stream) fprintf(warning_stream, "Serving %s\n", socket_path);
+		while (!pkgd->stop) {
+			while (waitpid(-1, NULL, WNOHANG) > 0);
+			int *client = kga_malloc(sizeof(int));
+			if ((*client = accept(*fd, NULL, NULL)) < 0) {
+				if (errno == EINTR) continue;
+				throw_errno();
+			};
+			scope {
+				scope_add(client, pkgd_close_fd);
+				try pkgd_handle(pkgd, *client);
+				catch exception_print(warning_stream ? warning_stream : stderr);
+			};
+		};
+	};
+};
+
+static void pkgd_write(int fd, const char *data, size_t size) {
+	while (size) {
+		ssize_t written = write(fd, data, size);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			throw_errno();
+		};
+		data += written;
+		size -= written;
+	};
+};
+
+/* Returns the status of the request, or -1 when no daemon listens. */
+int pkgd_call(const char *root, const char *db_path, char **args, FILE *out, FILE *err) {
+	int status = -1;
+	scope {
+		char *socket_path = string_new_fmt("%s/%s/" PKGD_SOCKET_NAME, root, db_path);
+		int *fd = kga_malloc(sizeof(int));
+		if ((*fd = pkgd_connect(socket_path)) >= 0) {
+			scope_add(fd, pkgd_close_fd);
+			int paths = !strcmp(args[0], "install") || !strcmp(args[0], "upgrade");
+			char *request = string_new();
+			char *cwd = NULL;
+			if (pkg_lock_timeout >= 0) string_fmt(request, "-w\n%ld\n", pkg_lock_timeout);
+			for (char **each_arg = args; *each_arg; each_arg++) {
+				if (strchr(*each_arg, '\n') || !**each_arg) {
+					throw(exception_type_pkgd_error, 1, "Argument can not be sent to the daemon.", *each_arg);
+				};
+				// the daemon has its own working directory
+				if (paths && each_arg != args && **each_arg != '/') {
+					if (!cwd && !(cwd = getcwd(NULL, 0))) throw_errno();
+					string_cat(request, cwd);
+					string_cat(request, "/");
+				};
+				string_cat(request, *each_arg);
+				string_cat(request, "\n");
+			};
+			free(cwd);
+			string_cat(request, "\n");
+			pkgd_write(*fd, request, string_length(request));
+			FILE *reply = kga_fdopen(kga_dup(*fd), "r");
+			size_t sizes[2];
+			if (fscanf(reply, "%i %zu %zu", &status, &sizes[0], &sizes[1]) != 3 || fgetc(reply) != '\n') {
+				throw(exception_type_pkgd_error, 1, "Invalid reply from the daemon.", socket_path);
+			};
+			FILE *streams[2] = {out, err};
+			char buffer[4096];
+			for (int i = 0; i < 2; i++) {
+				for (size_t readed; sizes[i] && (readed = kga_fread(buffer, 1, sizes[i] < sizeof(buffer) ? sizes[i] : sizeof(buffer), reply)) > 0; sizes[i] -= readed) {
+					if (streams[i]) fwrite(buffer, 1, readed, streams[i]);
+				};
+			};
+		};
+	};
+	return status;
+};
@@ -0,0 +1,10 @@
+#ifndef _PKGD_H_
+#define _PKGD_H_
+
+#include <stdio.h>
+
+#define PKGD_SOCKET_NAME ".pkgd.sock"
+
+void pkgd_serve(const char *root, const char *db_path, FILE *warning_stream);
+int pkgd_call(const char *root, const char *db_path, char **args, FILE *out, FILE *err);
+#endif
@@ -0,0 +1,564 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include "pkgdb.h"
+#include "pkg_internal.h"
+
+/* Plain C without libkga, so the library can be linked into anything. Every
+ * file list is read whole into one block and kept front coded, text lists of
+ * older databases are coded on load. */
+
+#ifndef F_OFD_GETLK
+#define F_OFD_GETLK 36
+#endif
+
+#define PKGDB_ITER_PKGS 1
+#define PKGDB_ITER_OWNERS 2
+#define PKGDB_ITER_FILES 3
+#define PKGDB_ITER_INDEX 4
+#define PKGDB_INDEX_HEADER_SIZE 24
+
+struct pkgdb_pkg {
+	const char *name;
+	const char *version;
+	struct pathlist files;
+};
+
+struct pkgdb_owner {
+	const struct pkgdb_pkg *pkg;
+	size_t index;
+};
+
+typedef char pkgdb_iter_state_fits[sizeof(struct pathlist_iter) <= PKGDB_ITER_STATE_SIZE ? 1 : -1];
+
+struct pkgdb {
+	char *path;
+	unsigned long long int generation;
+	struct pkgdb_pkg *pkgs;
+	size_t count;
+	struct pkgdb_owner *owners;
+	size_t owners_count;
+	void **blocks;
+	size_t blocks_count;
+	size_t blocks_size;
+};
+
+/* The index file is a header of magic, generation and record count, then
+ * an offset per record and the records, "path\0name/version\0" sorted by
+ * path. */
+struct pkgdb_index {
+	char *data;
+	size_t size;
+	int mapped;
+	uint64_t count;
+	const uint64_t *offsets;
+};
+
+int pkgdb_read_generation(const char *db_dir, unsigned long long int *generation) {
+	char path[PATH_MAX];
+	char buffer[32];
+	*generation = 0;
+	if (snprintf(path, sizeof(path), "%s/" PKG_DB_GENERATION_NAME, db_dir) >= (int)sizeof(path)) return ENAMETOOLONG;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return errno == ENOENT ? 0 : errno;
+	ssize_t readed = read(fd, buffer, sizeof(buffer) - 1);
+	int ret = readed < 0 ? errno : 0;
+	close(fd);
+	if (readed > 0) {
+		buffer[readed] = '\0';
+		*generation = strtoull(buffer, NULL, 10);
+	};
+	return ret;
+};
+
+/* A writer that died leaves an odd generation but no lock behind. */
+int pkgdb_writer_alive(const char *db_dir) {
+	char path[PATH_MAX];
+	int alive = 0;
+	if (snprintf(path, sizeof(path), "%s/" PKG_DB_LOCK_NAME, db_dir) >= (int)sizeof(path)) return 0;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+	struct flock lock;
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+	if (!fcntl(fd, F_OFD_GETLK, &lock)) alive = lock.l_type != F_UNLCK;
+	close(fd);
+	return alive;
+};
+
+/* The block is freed with the db from now on, or right away on failure. */
+static int pkgdb_adopt(struct pkgdb *db, void *block) {
+	if (db->blocks_count == db->blocks_size) {
+		size_t blocks_size = db->blocks_size ? db->blocks_size * 2 : 64;
+		void **blocks = realloc(db->blocks, blocks_size * sizeof(void *));
+		if (!blocks) {
+			free(block);
+			return ENOMEM;
+		};
+		db->blocks = blocks;
+		db->blocks_size = blocks_size;
+	};
+	db->blocks[db->blocks_count++] = block;
+	return 0;
+};
+
+static void *pkgdb_alloc(struct pkgdb *db, size_t size) {
+	void *block = malloc(size ? size : 1);
+	if (!block || pkgdb_adopt(db, block)) return NULL;
+	return block;
+};
+
+static void pkgdb_clear(struct pkgdb *db) {
+	for (size_t i = 0; i < db->blocks_count; i++) free(db->blocks[i]);
+	db->blocks_count = 0;
+	free(db->pkgs);
+	free(db->owners);
+	db->pkgs = NULL;
+	db->owners = NULL;
+	db->count = 0;
+	db->owners_count = 0;
+};
+
+static int pkgdb_pkg_compare(const void *ptr1, const void *ptr2) {
+	const struct pkgdb_pkg *pkg1 = ptr1;
+	const struct pkgdb_pkg *pkg2 = ptr2;
+	int ret = strcmp(pkg1->name, pkg2->name);
+	return ret ? ret : strcmp(pkg1->version, pkg2->version);
+};
+
+/* iter is reused while the owners come from one list. */
+static const char *pkgdb_owner_path(const struct pkgdb_owner *owner, struct pathlist_iter *iter) {
+	if (iter->list != &owner->pkg->files) pathlist_iter_init(iter, &owner->pkg->files);
+	return pathlist_get(iter, owner->index);
+};
+
+static void pkgdb_merge_owner(void *data, size_t list, size_t index, const char *path) {
+	struct pkgdb *db = data;
+	struct pkgdb_owner *owner = &db->owners[db->owners_count++];
+	(void)path;
+	owner->pkg = &db->pkgs[list];
+	owner->index = index;
+};
+
+/* Text lists, with the "/sorted" header or without. */
+static int pkgdb_code_lines(struct pathlist *list, char *data, size_t size) {
+	size_t lines = 0, count = 0;
+	for (size_t i = 0; i < size; i++) {
+		if (data[i] == '\n') lines++;
+	};
+	char **paths = malloc((lines + 1) * sizeof(char *));
+	if (!paths) return ENOMEM;
+	for (char *line = data, *end; line < data + size; line = end + 1) {
+		if (!(end = strchr(line, '\n'))) end = data + size;
+		*end = '\0';
+		if (*line) paths[count++] = line;
+	};
+	size_t skip = count && !strcmp(paths[0], PKG_DB_SORTED_HEADER);
+	int ret = pathlist_build(list, paths + skip, count - skip);
+	free(paths);
+	return ret;
+};
+
+static int pkgdb_load_files(struct pkgdb *db, int dir_fd, struct pkgdb_pkg *pkg) {
+	int fd = openat(dir_fd, pkg->version, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return errno;
+	struct stat st;
+	char *data = NULL;
+	size_t size = 0;
+	int ret = 0;
+	if (fstat(fd, &st)) {
+		ret = errno;
+	} else if (!(data = malloc(st.st_size + 1))) {
+		ret = ENOMEM;
+	} else {
+		while (size < (size_t)st.st_size) {
+			ssize_t readed = read(fd, data + size, st.st_size - size);
+			if (readed < 0 && errno == EINTR) continue;
+			if (readed < 0) ret = errno;
+			if (readed <= 0) break;
+			size += readed;
+		};
+	};
+	close(fd);
+	if (!ret && pathlist_encoded(data, size)) {
+		if (!(ret = pathlist_parse(&pkg->files, (unsigned char *)data, size))) return pkgdb_adopt(db, data);
+	} else if (!ret) {
+		data[size] = '\0';
+		if (!(ret = pkgdb_code_lines(&pkg->files, data, size))) ret = pkgdb_adopt(db, pkg->files.buffer);
+	};
+	free(data);
+	return ret;
+};
+
+static int pkgdb_add(struct pkgdb *db, size_t *size, const char *name, int dir_fd, const char *version) {
+	if (db->count == *size) {
+		*size = *size ? *size * 2 : 256;
+		struct pkgdb_pkg *pkgs = realloc(db->pkgs, *size * sizeof(struct pkgdb_pkg));
+		if (!pkgs) return ENOMEM;
+		db->pkgs = pkgs;
+	};
+	size_t name_length = strlen(name), version_length = strlen(version);
+	char *strings = pkgdb_alloc(db, name_length + version_length + 2);
+	if (!strings) return ENOMEM;
+	struct pkgdb_pkg *pkg = &db->pkgs[db->count];
+	memcpy(strings, name, name_length + 1);
+	memcpy(strings + name_length + 1, version, version_length + 1);
+	pkg->name = strings;
+	pkg->version = strings + name_length + 1;
+	int ret = pkgdb_load_files(db, dir_fd, pkg);
+	if (!ret) db->count++;
+	return ret;
+};
+
+static int pkgdb_load(struct pkgdb *db) {
+	DIR *pkgs_dir = opendir(db->path);
+	if (!pkgs_dir) return errno;
+	int ret = 0;
+	size_t size = 0;
+	struct dirent *dirent;
+	while (!ret && (dirent = readdir(pkgs_dir))) {
+		if (dirent->d_name[0] == '.') continue;
+		int dir_fd = openat(dirfd(pkgs_dir), dirent->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		DIR *versions_dir = dir_fd < 0 ? NULL : fdopendir(dir_fd);
+		if (!versions_dir) {
+			ret = errno;
+			if (dir_fd >= 0) close(dir_fd);
+			break;
+		};
+		struct dirent *version_dirent;
+		while (!ret && (version_dirent = readdir(versions_dir))) {
+			if (version_dirent->d_name[0] == '.') continue;
+			ret = pkgdb_add(db, &size, dirent->d_name, dir_fd, version_dirent->d_name);
+		};
+		closedir(versions_dir);
+	};
+	closedir(pkgs_dir);
+	if (ret) return ret;
+	qsort(db->pkgs, db->count, sizeof(struct pkgdb_pkg), pkgdb_pkg_compare);
+	size_t owners_count = 0;
+	const struct pathlist **lists = malloc((db->count ? db->count : 1) * sizeof(struct pathlist *));
+	for (size_t i = 0; lists && i < db->count; i++) {
+		lists[i] = &db->pkgs[i].files;
+		owners_count += db->pkgs[i].files.count;
+	};
+	if (!lists || !(db->owners = malloc((owners_count ? owners_count : 1) * sizeof(struct pkgdb_owner)))) {
+		free(lists);
+		return ENOMEM;
+	};
+	// the lists are sorted already, a merge orders the owners
+	ret = pathlist_merge(lists, db->count, pkgdb_merge_owner, db);
+	free(lists);
+	return ret;
+};
+
+static long long int pkgdb_now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long int)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+};
+
+int pkgdb_open(const char *root, const char *db_path, long int timeout_ms, pkgdb_t **out) {
+	struct pkgdb *db = calloc(1, sizeof(struct pkgdb));
+	if (!db) return ENOMEM;
+	size_t length = strlen(root) + strlen(db_path) + 2;
+	if (!(db->path = malloc(length))) {
+		free(db);
+		return ENOMEM;
+	};
+	snprintf(db->path, length, "%s/%s", root, db_path);
+	long long int start = pkgdb_now_ms();
+	int ret;
+	while (1) {
+		unsigned long long int generation, after;
+		if ((ret = pkgdb_read_generation(db->path, &generation))) break;
+		if (!(generation & 1) || !pkgdb_writer_alive(db->path)) {
+			int load_ret = pkgdb_load(db);
+			if ((ret = pkgdb_read_generation(db->path, &after))) break;
+			// files may go away under a writer, that shows in the generation
+			if (after == generation) {
+				db->generation = generation;
+				ret = load_ret;
+				break;
+			};
+		};
+		pkgdb_clear(db);
+		if (timeout_ms >= 0 && pkgdb_now_ms() - start >= timeout_ms) {
+			ret = EAGAIN;
+			break;
+		};
+		struct timespec ts = {0, PKG_DB_POLL_INTERVAL * 1000};
+		nanosleep(&ts, NULL);
+	};
+	if (ret) {
+		pkgdb_close(db);
+		return ret;
+	};
+	*out = db;
+	return 0;
+};
+
+void pkgdb_close(pkgdb_t *db) {
+	if (!db) return;
+	pkgdb_clear(db);
+	free(db->blocks);
+	free(db->path);
+	free(db);
+};
+
+int pkgdb_stale(const pkgdb_t *db) {
+	unsigned long long int generation;
+	return pkgdb_read_generation(db->path, &generation) || generation != db->generation;
+};
+
+size_t pkgdb_count(const pkgdb_t *db) {
+	return db->count;
+};
+
+void pkgdb_list(const pkgdb_t *db, pkgdb_iter_t *iter) {
+	iter->db = db;
+	iter->pos = db->pkgs;
+	iter->end = db->pkgs + db->count;
+	iter->base = NULL;
+	iter->kind = PKGDB_ITER_PKGS;
+};
+
+/* Any version when version is NULL. */
+size_t pkgdb_lookup(const pkgdb_t *db, const char *name, const char *version, pkgdb_iter_t *iter) {
+	size_t low = 0, high = db->count;
+	while (low < high) {
+		size_t middle = (low + high) / 2;
+		int ret = strcmp(db->pkgs[middle].name, name);
+		if (!ret && version) ret = strcmp(db->pkgs[middle].version, version);
+		if (ret < 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		};
+	};
+	size_t end = low;
+	while (end < db->count && !strcmp(db->pkgs[end].name, name) && (!version || !strcmp(db->pkgs[end].version, version))) end++;
+	iter->db = db;
+	iter->pos = db->pkgs + low;
+	iter->end = db->pkgs + end;
+	iter->base = NULL;
+	iter->kind = PKGDB_ITER_PKGS;
+	return end - low;
+};
+
+size_t pkgdb_owners(const pkgdb_t *db, const char *path, pkgdb_iter_t *iter) {
+	while (*path == '/') path++;
+	struct pathlist_iter path_iter = {NULL};
+	size_t low = 0, high = db->owners_count;
+	while (low < high) {
+		size_t middle = (low + high) / 2;
+		if (strcmp(pkgdb_owner_path(&db->owners[middle], &path_iter), path) < 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		};
+	};
+	size_t end = low;
+	while (end < db->owners_count && !strcmp(pkgdb_owner_path(&db->owners[end], &path_iter), path)) end++;
+	iter->db = db;
+	iter->pos = db->owners + low;
+	iter->end = db->owners + end;
+	iter->base = NULL;
+	iter->kind = PKGDB_ITER_OWNERS;
+	return end - low;
+};
+
+void pkgdb_files(const pkgdb_t *db, const pkgdb_pkg_t *pkg, pkgdb_iter_t *iter) {
+	iter->db = db;
+	iter->pos = pkg;
+	iter->end = NULL;
+	iter->base = NULL;
+	iter->kind = PKGDB_ITER_FILES;
+	pathlist_iter_init((struct pathlist_iter *)iter->state.buffer, &pkg->files);
+};
+
+const pkgdb_pkg_t *pkgdb_next(pkgdb_iter_t *iter) {
+	if (iter->pos == iter->end) return NULL;
+	if (iter->kind == PKGDB_ITER_PKGS) {
+		const struct pkgdb_pkg *pkg = iter->pos;
+		iter->pos = pkg + 1;
+		return pkg;
+	} else if (iter->kind == PKGDB_ITER_OWNERS) {
+		const struct pkgdb_owner *owner = iter->pos;
+		iter->pos = owner + 1;
+		return owner->pkg;
+	};
+	return NULL;
+};
+
+/* Paths are relative to the root, as stored. */
+const char *pkgdb_next_file(pkgdb_iter_t *iter) {
+	if (iter->kind != PKGDB_ITER_FILES) return NULL;
+	return pathlist_next((struct pathlist_iter *)iter->state.buffer);
+};
+
+const char *pkgdb_pkg_name(const pkgdb_pkg_t *pkg) {
+	return pkg->name;
+};
+
+const char *pkgdb_pkg_version(const pkgdb_pkg_t *pkg) {
+	return pkg->version;
+};
+
+size_t pkgdb_pkg_files_count(const pkgdb_pkg_t *pkg) {
+	return pkg->files.count;
+};
+
+static int pkgdb_index_path(const char *db_dir, char *path, size_t size) {
+	return snprintf(path, size, "%s/" PKG_DB_INDEX_NAME, db_dir) >= (int)size ? ENAMETOOLONG : 0;
+};
+
+static int pkgdb_index_valid(struct pkgdb_index *index, unsigned long long int generation) {
+	if (index->size < PKGDB_INDEX_HEADER_SIZE || memcmp(index->data, PKG_DB_INDEX_MAGIC, 8)) return 0;
+	uint64_t index_generation;
+	memcpy(&index_generation, index->data + 8, 8);
+	memcpy(&index->count, index->data + 16, 8);
+	if (index_generation != generation) return 0;
+	if (index->count > (index->size - PKGDB_INDEX_HEADER_SIZE) / 8) return 0;
+	index->offsets = (const uint64_t *)(index->data + PKGDB_INDEX_HEADER_SIZE);
+	for (uint64_t i = 0; i < index->count; i++) {
+		if (index->offsets[i] >= index->size) return 0;
+	};
+	return !index->count || !index->data[index->size - 1];
+};
+
+static int pkgdb_index_map(struct pkgdb_index *index, const char *path, unsigned long long int generation) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+	struct stat st;
+	if (!fstat(fd, &st) && st.st_size >= PKGDB_INDEX_HEADER_SIZE) {
+		void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (data != MAP_FAILED) {
+			index->data = data;
+			index->size = st.st_size;
+			index->mapped = 1;
+		};
+	};
+	close(fd);
+	if (index->mapped && !pkgdb_index_valid(index, generation)) {
+		munmap(index->data, index->size);
+		index->data = NULL;
+		index->mapped = 0;
+	};
+	return index->mapped;
+};
+
+static int pkgdb_index_build(struct pkgdb_index *index, const struct pkgdb *db) {
+	struct pathlist_iter iter = {NULL};
+	size_t size = PKGDB_INDEX_HEADER_SIZE + db->owners_count * 8;
+	for (size_t i = 0; i < db->owners_count; i++) {
+		size += strlen(pkgdb_owner_path(&db->owners[i], &iter)) + strlen(db->owners[i].pkg->name) + strlen(db->owners[i].pkg->version) + 3;
+	};
+	if (!(index->data = malloc(size))) return ENOMEM;
+	index->size = size;
+	uint64_t generation = db->generation;
+	index->count = db->owners_count;
+	memcpy(index->data, PKG_DB_INDEX_MAGIC, 8);
+	memcpy(index->data + 8, &generation, 8);
+	memcpy(index->data + 16, &index->count, 8);
+	uint64_t *offsets = (uint64_t *)(index->data + PKGDB_INDEX_HEADER_SIZE);
+	char *record = index->data + PKGDB_INDEX_HEADER_SIZE + db->owners_count * 8;
+	for (size_t i = 0; i < db->owners_count; i++) {
+		offsets[i] = record - index->data;
+		record += sprintf(record, "%s", pkgdb_owner_path(&db->owners[i], &iter)) + 1;
+		record += sprintf(record, "%s/%s", db->owners[i].pkg->name, db->owners[i].pkg->version) + 1;
+	};
+	index->offsets = offsets;
+	return 0;
+};
+
+/* Written under a temporary name and renamed, readers see either index. */
+static void pkgdb_index_save(struct pkgdb_index *index, const char *path) {
+	char tmp_path[PATH_MAX];
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.%ld", path, (long int)getpid()) >= (int)sizeof(tmp_path)) return;
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return;
+	size_t written = 0;
+	while (written < index->size) {
+		ssize_t ret = write(fd, index->data + written, index->size - written);
+		if (ret < 0 && errno == EINTR) continue;
+		if (ret <= 0) break;
+		written += ret;
+	};
+	if (close(fd) || written != index->size || rename(tmp_path, path)) unlink(tmp_path);
+};
+
+int pkgdb_index_open(const char *root, const char *db_path, long int timeout_ms, pkgdb_index_t **out) {
+	struct pkgdb_index *index = calloc(1, sizeof(struct pkgdb_index));
+	if (!index) return ENOMEM;
+	char db_dir[PATH_MAX];
+	char path[PATH_MAX];
+	unsigned long long int generation;
+	int ret = 0;
+	if (snprintf(db_dir, sizeof(db_dir), "%s/%s", root, db_path) >= (int)sizeof(db_dir)) ret = ENAMETOOLONG;
+	if (!ret) ret = pkgdb_index_path(db_dir, path, sizeof(path));
+	if (!ret) ret = pkgdb_read_generation(db_dir, &generation);
+	if (!ret && !pkgdb_index_map(index, path, generation)) {
+		pkgdb_t *db;
+		if (!(ret = pkgdb_open(root, db_path, timeout_ms, &db))) {
+			if (!(ret = pkgdb_index_build(index, db))) pkgdb_index_save(index, path);
+			pkgdb_close(db);
+		};
+	};
+	if (ret) {
+		pkgdb_index_close(index);
+		return ret;
+	};
+	*out = index;
+	return 0;
+};
+
+void pkgdb_index_close(pkgdb_index_t *index) {
+	if (!index) return;
+	if (index->mapped) {
+		munmap(index->data, index->size);
+	} else {
+		free(index->data);
+	};
+	free(index);
+};
+
+size_t pkgdb_index_owners(const pkgdb_index_t *index, const char *path, pkgdb_iter_t *iter) {
+	while (*path == '/') path++;
+	size_t low = 0, high = index->count;
+	while (low < high) {
+		size_t middle = (low + high) / 2;
+		if (strcmp(index->data + index->offsets[middle], path) < 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		};
+	};
+	size_t end = low;
+	while (end < index->count && !strcmp(index->data + index->offsets[end], path)) end++;
+	iter->db = NULL;
+	iter->base = index->data;
+	iter->pos = index->offsets + low;
+	iter->end = index->offsets + end;
+	iter->kind = PKGDB_ITER_INDEX;
+	return end - low;
+};
+
+const char *pkgdb_next_owner(pkgdb_iter_t *iter) {
+	if (iter->pos == iter->end || iter->kind != PKGDB_ITER_INDEX) return NULL;
+	const uint64_t *offset = iter->pos;
+	iter->pos = offset + 1;
+	const char *record = iter->base + *offset;
+	return record + strlen(record) + 1;
+};
@@ -0,0 +1,64 @@
+#ifndef _PKGDB_H_
+#define _PKGDB_H_
+
+#include <stddef.h>
+
+/* Read only access to an installed package database, for programs that want
+ * to ask what is installed without running pkgng. Functions return 0 or an
+ * errno value and never exit or print. A pkgdb_t does not change after
+ * pkgdb_open returns, so threads may query the same one concurrently, each
+ * through its own pkgdb_iter_t. Strings returned point into the pkgdb_t and
+ * live until pkgdb_close. */
+
+#define PKGDB_API_VERSION 2
+#define PKGDB_ITER_STATE_SIZE 4160
+
+typedef struct pkgdb pkgdb_t;
+typedef struct pkgdb_pkg pkgdb_pkg_t;
+typedef struct pkgdb_index pkgdb_index_t;
+
+typedef struct pkgdb_iter {
+	const pkgdb_t *db;
+	const void *pos;
+	const void *end;
+	const char *base;
+	int kind;
+	/* file lists are front coded, paths are decoded in here */
+	union {
+		void *align;
+		char buffer[PKGDB_ITER_STATE_SIZE];
+	} state;
+} pkgdb_iter_t;
+
+/* Loads a consistent snapshot, waiting up to timeout_ms (-1 forever) while
+ * a writer works on the database. */
+int pkgdb_open(const char *root, const char *db_path, long int timeout_ms, pkgdb_t **db);
+void pkgdb_close(pkgdb_t *db);
+/* Nonzero once the database has changed since the snapshot was taken. */
+int pkgdb_stale(const pkgdb_t *db);
+size_t pkgdb_count(const pkgdb_t *db);
+
+/* Iterators are filled in by these and walked with pkgdb_next and
+ * pkgdb_next_file; they need no cleanup. A path from pkgdb_next_file lives
+ * in the iterator until the next call. */
+void pkgdb_list(const pkgdb_t *db, pkgdb_iter_t *iter);
+size_t pkgdb_lookup(const pkgdb_t *db, const char *name, const char *version, pkgdb_iter_t *iter);
+size_t pkgdb_owners(const pkgdb_t *db, const char *path, pkgdb_iter_t *iter);
+void pkgdb_files(const pkgdb_t *db, const pkgdb_pkg_t *pkg, pkgdb_iter_t *iter);
+const pkgdb_pkg_t *pkgdb_next(pkgdb_iter_t *iter);
+const char *pkgdb_next_file(pkgdb_iter_t *iter);
+
+const char *pkgdb_pkg_name(const pkgdb_pkg_t *pkg);
+const char *pkgdb_pkg_version(const pkgdb_pkg_t *pkg);
+size_t pkgdb_pkg_files_count(const pkgdb_pkg_t *pkg);
+
+/* Path to owner index kept in the database directory, so answering owners
+ * of a path needs neither the file lists nor more than O(log n) work. An
+ * index older than the database is rebuilt, and written back when the
+ * directory is writable. */
+int pkgdb_index_open(const char *root, const char *db_path, long int timeout_ms, pkgdb_index_t **index);
+void pkgdb_index_close(pkgdb_index_t *index);
+size_t pkgdb_index_owners(const pkgdb_index_t *index, const char *path, pkgdb_iter_t *iter);
+/* Owners come as name/version. */
+const char *pkgdb_next_owner(pkgdb_iter_t *iter);
+#endif
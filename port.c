@@ -1,6 +1,10 @@
-#define _POSIX_C_SOURCE 200112L
+#define _POSIX_C_SOURCE 200809L
 #include <stdlib.h>
+#include <limits.h>
+#include <signal.h>
+#include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/statvfs.h>
 #include <sys/utsname.h>
 #include <kga/kga.h>
 #include <kga/scope.h>
@@ -13,9 +17,12 @@
 #include "kga_wrappers.h"
 //#include "build_script.sh.h"
 #include "shell.h"
+#include "profile.h"
+#include "hash.h"
 
 exception_type_t port_aborted_by_user = {};
 int (*port_confirm)(const char *fmt, ...) = NULL;
+int port_test_mode = 0;
 
 struct port_db {
 	scope_pool_t *scope_pool;
@@ -30,6 +37,68 @@ struct port_db {
 	struct port *ports;
 	shell_t *shell;
 	FILE *warning_stream;
+	long int prefetch_jobs;
+	int background_cleanup;
+	struct port_prefetch *prefetch;
+	int hooks_pending;
+	const char *tmpfs_dir;
+	long long int tmpfs_budget;
+	struct port_placement *placements;
+	struct port_stat *stats;
+	long int build_slots;
+	int *slot_tokens;
+	long long int build_mem;
+	struct port **order;
+	uint64_t conf_hash;
+	FILE *journal;
+	int resume;
+	struct shell_var *conf_vars;
+	char *conf_script;
+	shell_t *conf_shell;
+};
+
+struct port_journal_state {
+	long int flag;
+	const char *name;
+};
+
+/* Upgrade state transitions kept in <ports>/journal, "port state input_hash" per line. */
+static const struct port_journal_state port_journal_states[] = {
+	{PORT_MARK_TO_PROCESS, "marked"},
+	{PORT_ACTUAL, "actual"},
+	{PORT_FINISHED, "finished"},
+	{PORT_HAVE_ERROR, "error"},
+	{PORT_MARK_TO_BUILD, "build"},
+	{PORT_BUILD_TIME_NEEDED, "build-needed"},
+	{0, NULL}
+};
+
+#define PORT_HASH_BUFFER_SIZE 65536
+
+struct port_placement {
+	char *tmp_path;
+	long long int size;
+};
+
+struct port_stat {
+	char *port;
+	char *key;
+	char *value;
+};
+
+struct port_prefetch {
+	pid_t pid, parent_pid;
+	FILE *done;
+	int token;
+};
+
+struct port_job {
+	port_t *port;
+	char *tmp_path;
+	pid_t pid;
+	int slot;
+	int token;
+	long long int start;
 };
 
 static void port_db_free(void *ptr) {
@@ -48,6 +117,24 @@ port_db_t *port_db_new(const char *root, const char *path, const char *pkg_db_pa
 	db->root = root;
 	db->path = path;
 	db->warning_stream = warning_stream;
+	db->prefetch_jobs = 0;
+	db->background_cleanup = 0;
+	db->prefetch = NULL;
+	db->hooks_pending = 0;
+	db->tmpfs_dir = NULL;
+	db->tmpfs_budget = 0;
+	db->placements = NULL;
+	db->stats = NULL;
+	db->build_slots = 0;
+	db->slot_tokens = NULL;
+	db->build_mem = 0;
+	db->order = NULL;
+	db->conf_hash = 0;
+	db->journal = NULL;
+	db->resume = 0;
+	db->conf_vars = NULL;
+	db->conf_script = NULL;
+	db->conf_shell = NULL;
 	scope {
 		char *targets_path = string_new_fmt("%s/%s/targets", db->root, db->path);
 		scope_use(db->scope_pool) {
@@ -88,57 +175,132 @@ port_t *port_db_get_port_by_name(port_db_t *db, const char *port_name) {
 	return NULL;
 };
 
+static const char *port_metadata_names[] = {
+	"NAME", "VERSION", "SOURCES_NAME", "SOURCES_VERSION", "BUILD", "DEPENDS", "OPTIONAL_DEPENDS",
+	"BUILD_DEPENDS", "VERSION_DEPENDS", "KEEPOLD", "BUILD_JOBS", "BUILD_MEM", NULL
+};
+
+/* Names a declarative build.sh uses but does not set come from ports.conf,
+ * asked once from a shell that has read nothing else. db->shell has been
+ * through earlier build.sh files and would answer with what they left. */
+static char *port_db_conf_var(void *data, const char *name) {
+	port_db_t *db = data;
+	array_foreach(db->conf_vars, struct shell_var *, each_var) {
+		if (!strcmp(each_var->name, name)) return each_var->value;
+	};
+	struct shell_var var;
+	scope_use(db->scope_pool) {
+		if (!db->conf_shell) {
+			db->conf_shell = shell_new();
+			shell_process(db->conf_shell, db->conf_script);
+		};
+		var.name = string_new_set(name);
+		var.value = shell_get_var(db->conf_shell, name);
+	};
+	array_push(db->conf_vars, var);
+	return var.value;
+};
+
+static char *port_metadata_get(struct shell_var *vars, const char *name) {
+	array_foreach(vars, struct shell_var *, each_var) {
+		if (!strcmp(each_var->name, name)) return each_var->value;
+	};
+	return "";
+};
+
+/* Metadata of a build.sh made only of assignments, read without the shell. NULL
+ * when the script needs the shell. Values come out as echo prints them, the
+ * way shell_get_var reads them. */
+static struct shell_var *port_metadata_declarative(port_db_t *db, const char *port_path, const char *port_script_path) {
+	struct shell_var *vars = array_new(struct shell_var, 0, 0);
+	struct shell_var var = {string_new_set("PORT_NAME"), string_new_set(port_path)};
+	array_push(vars, var);
+	for (const char **each_name = port_metadata_names; *each_name; each_name++) {
+		struct shell_var empty_var = {string_new_set(*each_name), string_new()};
+		array_push(vars, empty_var);
+	};
+	if (!shell_parse_declarative(port_script_path, &vars, port_db_conf_var, db)) return NULL;
+	array_foreach(vars, struct shell_var *, each_var) {
+		for (char *c = each_var->value; *c; c++) {
+			if (*c == '\t' || *c == '\n') *c = ' ';
+		};
+		each_var->value = string_join(string_split(each_var->value, " ", STRING_SPLIT_WITHOUT_EMPTY), " ", 0);
+	};
+	array_foreach(vars, struct shell_var *, each_var) {
+		if (!strcmp(each_var->name, "SOURCES_NAME") && !*each_var->value) each_var->value = port_metadata_get(vars, "NAME");
+		if (!strcmp(each_var->name, "SOURCES_VERSION") && !*each_var->value) each_var->value = port_metadata_get(vars, "VERSION");
+	};
+	return vars;
+};
+
+static struct shell_var *port_metadata_shell(port_db_t *db, const char *port_path, const char *port_script_path) {
+	char *prepare_script = string_new_fmt(
+			"PORT_NAME='%s'\n"
+			"NAME=''\n"
+			"VERSION=''\n"
+			"SOURCES_NAME=''\n"
+			"SOURCES_VERSION=''\n"
+			"BUILD=''\n"
+			"DEPENDS=''\n"
+			"OPTIONAL_DEPENDS=''\n"
+			"BUILD_DEPENDS=''\n"
+			"VERSION_DEPENDS=''\n"
+			"KEEPOLD=''\n"
+			"BUILD_JOBS=''\n"
+			"BUILD_MEM=''\n"
+			"planned() {\n"
+			"return 1\n"
+			"}\n"
+			"version() {\n"
+			"return 1\n"
+			"}\n",
+			port_path);
+	shell_process(db->shell, prepare_script);
+	shell_process_file(db->shell, port_script_path);
+	shell_process(db->shell,
+			"if test -z \"$SOURCES_NAME\"\n"
+			"then\n"
+			"SOURCES_NAME=\"$NAME\"\n"
+			"fi\n"
+			"if test -z \"$SOURCES_VERSION\"\n"
+			"then\n"
+			"SOURCES_VERSION=\"$VERSION\"\n"
+			"fi\n"
+		     );
+	struct shell_var *vars = array_new(struct shell_var, 0, 0);
+	for (const char **each_name = port_metadata_names; *each_name; each_name++) {
+		struct shell_var var = {string_new_set(*each_name), shell_get_var(db->shell, *each_name)};
+		array_push(vars, var);
+	};
+	return vars;
+};
+
 void port_db_load_port(port_db_t *db, const char *port_path, int flags) {
 	important_check(db);
 	important_check(port_path);
 	important_check(*port_path);
 	if (port_db_get_port(db, port_path)) return;
 	scope {
+		size_t profile_mark = profile_begin("metadata", port_path);
 		char *port_script_path = string_new_fmt("/%s/pkgblds/%s/build.sh", db->path, port_path);
-		char *prepare_script = string_new_fmt(
-				"PORT_NAME='%s'"
-				"NAME=''\n"
-				"VERSION=''\n"
-				"SOURCES_NAME=''\n"
-				"SOURCES_VERSION=''\n"
-				"BUILD=''\n"
-				"DEPENDS=''\n"
-				"OPTIONAL_DEPENDS=''\n"
-				"BUILD_DEPENDS=''\n"
-				"VERSION_DEPENDS=''\n"
-				"KEEPOLD=''\n"
-				"planned() {\n"
-				"return 1\n"
-				"}\n"
-				"version() {\n"
-				"return 1\n"
-				"}\n",
-				port_path);
-		shell_process(db->shell, prepare_script);
-		shell_process_file(db->shell, port_script_path);
-		shell_process(db->shell,
-				"if test -z \"$SOURCES_NAME\"\n"
-				"then\n"
-				"SOURCES_NAME=\"$NAME\"\n"
-				"fi\n"
-				"if test -z \"$SOURCES_VERSION\"\n"
-				"then\n"
-				"SOURCES_VERSION=\"$VERSION\"\n"
-				"fi\n"
-			     );
-		char *depends = shell_get_var(db->shell, "DEPENDS");
-		char *optional_depends = shell_get_var(db->shell, "OPTIONAL_DEPENDS");
-		char *version_depends = shell_get_var(db->shell, "VERSION_DEPENDS");
-		char *build_depends = shell_get_var(db->shell, "BUILD_DEPENDS");
-		char *keep_old = shell_get_var(db->shell, "KEEPOLD");
+		struct shell_var *vars = port_metadata_declarative(db, port_path, port_script_path);
+		int declarative = vars != NULL;
+		if (!declarative) vars = port_metadata_shell(db, port_path, port_script_path);
+		char *depends = port_metadata_get(vars, "DEPENDS");
+		char *optional_depends = port_metadata_get(vars, "OPTIONAL_DEPENDS");
+		char *version_depends = port_metadata_get(vars, "VERSION_DEPENDS");
+		char *build_depends = port_metadata_get(vars, "BUILD_DEPENDS");
+		char *keep_old = port_metadata_get(vars, "KEEPOLD");
+		char *build_jobs = port_metadata_get(vars, "BUILD_JOBS");
+		char *build_mem = port_metadata_get(vars, "BUILD_MEM");
 		struct port port;
 		scope_use(db->scope_pool) {
 			port.path = string_new();
 			string_set(port.path, port_path);
-			port.name = shell_get_var(db->shell, "NAME");
-			port.sources_name = shell_get_var(db->shell, "SOURCES_NAME");
-			port.version = shell_get_var(db->shell, "VERSION");
-			port.sources_version = shell_get_var(db->shell, "SOURCES_VERSION");
+			port.name = string_new_set(port_metadata_get(vars, "NAME"));
+			port.sources_name = string_new_set(port_metadata_get(vars, "SOURCES_NAME"));
+			port.version = string_new_set(port_metadata_get(vars, "VERSION"));
+			port.sources_version = string_new_set(port_metadata_get(vars, "SOURCES_VERSION"));
 			port.depends = string_split(depends, " ", STRING_SPLIT_WITHOUT_EMPTY);
 			port.version_depends = string_split(version_depends, " ", STRING_SPLIT_WITHOUT_EMPTY);
 			port.optional_depends = string_split(optional_depends, " ", STRING_SPLIT_WITHOUT_EMPTY);
@@ -148,10 +310,21 @@ void port_db_load_port(port_db_t *db, const char *port_path, int flags) {
 			} else {
 				port.keep_old = 0;
 			};
-			//too early calculate BUILD, make that later
-			port.build = NULL;
+			port.build_jobs = *build_jobs ? strtol(build_jobs, NULL, 10) : 0;
+			port.build_mem = *build_mem ? parse_size(build_mem) : 0;
+			port.estimate = 0;
+			port.input_hash = NULL;
+			port.priority = -1;
+			if (port.build_jobs < 0 || port.build_mem < 0) {
+				fprintf(db->warning_stream, "%s: bad BUILD_JOBS or BUILD_MEM, ignored.\n", port_path);
+				port.build_jobs = 0;
+				port.build_mem = 0;
+			};
+			// a declarative BUILD can not ask planned() or version(), otherwise it is too early
+			port.build = declarative ? string_new_set(port_metadata_get(vars, "BUILD")) : NULL;
 			port.flags = flags;
 			port.all_depends = array_new(struct port_depend *, 0, 0);
+			profile_end(profile_mark);
 			array_push(db->ports, port);
 			for (int i = 0, n = array_length(port.depends); i < n; i++) {
 				port_db_load_port(db, port.depends[i], flags);
@@ -198,7 +371,9 @@ char *port_calculate_build_script(port_t *port, port_db_t *db) {
 };
 
 void port_calculate_build(port_t *port, port_db_t *db) {
+	if (port->build) return;
 	scope {
+		size_t profile_mark = profile_begin("metadata", port->path);
 		char *port_script_path = string_new_fmt("/%s/pkgblds/%s/build.sh", db->path, port->path);
 		shell_process(db->shell, "BUILD=''\n");
 		shell_process(db->shell, port_calculate_build_script(port, db));
@@ -206,6 +381,317 @@ void port_calculate_build(port_t *port, port_db_t *db) {
 		scope_use(db->scope_pool) {
 			port->build = shell_get_var(db->shell, "BUILD");
 		};
+		profile_end(profile_mark);
+	};
+};
+
+/* Per-port figures kept between runs in <ports>/stats, one "port key value" per line. */
+static void port_db_stats_load(port_db_t *db) {
+	if (db->stats) return;
+	scope {
+		char *stats_path = string_new_fmt("/%s/stats", db->path);
+		char **lines = NULL;
+		try lines = file_lines(stats_path);
+		catch if (!exception_type_is(exception_type_fopen_no_such_file)) throw_proxy();
+		scope_use(db->scope_pool) {
+			db->stats = array_new(struct port_stat, 0, 0);
+			if (lines) array_foreach(lines, char **, each_line) {
+				char **fields = string_split(*each_line, " ", STRING_SPLIT_WITHOUT_EMPTY);
+				if (array_length(fields) != 3) continue;
+				struct port_stat stat = {fields[0], fields[1], fields[2]};
+				array_push(db->stats, stat);
+			};
+		};
+	};
+};
+
+static const char *port_stat_get(port_db_t *db, port_t *port, const char *key) {
+	port_db_stats_load(db);
+	array_foreach(db->stats, struct port_stat *, each_stat) {
+		if (!strcmp(each_stat->port, port->path) && !strcmp(each_stat->key, key)) return each_stat->value;
+	};
+	return NULL;
+};
+
+static void port_stat_set(port_db_t *db, port_t *port, const char *key, const char *value) {
+	port_db_stats_load(db);
+	struct port_stat *found = NULL;
+	array_foreach(db->stats, struct port_stat *, each_stat) {
+		if (!strcmp(each_stat->port, port->path) && !strcmp(each_stat->key, key)) found = each_stat;
+	};
+	scope_use(db->scope_pool) {
+		if (found) {
+			found->value = string_new_set(value);
+		} else {
+			struct port_stat stat = {string_new_set(port->path), string_new_set(key), string_new_set(value)};
+			array_push(db->stats, stat);
+		};
+	};
+};
+
+static void port_db_stats_save(port_db_t *db) {
+	if (!db->stats) return;
+	scope {
+		char *stats_path = string_new_fmt("/%s/stats", db->path);
+		char *stats_new_path = string_new_fmt("%s.new", stats_path);
+		char **lines = array_new(char *, 0, 0);
+		array_foreach(db->stats, struct port_stat *, each_stat) {
+			array_push(lines, string_new_fmt("%s %s %s", each_stat->port, each_stat->key, each_stat->value));
+		};
+		lines_to_file(lines, stats_new_path);
+		kga_rename(stats_new_path, stats_path);
+	};
+};
+
+/* Inputs the installed package was made from, to notice changes without a BUILD bump. */
+static void port_installed_record(port_db_t *db, port_t *port) {
+	if (!port->input_hash) return;
+	port_stat_set(db, port, "input", port->input_hash);
+	port_db_stats_save(db);
+};
+
+static long long int port_stat_get_number(port_db_t *db, port_t *port, const char *key) {
+	const char *value = port_stat_get(db, port, key);
+	return value ? strtoll(value, NULL, 10) : -1;
+};
+
+static void port_hash_dir(struct hash_state *state, int dir_fd, const char *relative) {
+	scope {
+		char *buffer = kga_malloc(PORT_HASH_BUFFER_SIZE);
+		scope_add(buffer, free);
+		char **names = array_new(char *, 0, ARRAY_NULL_TERMINATED);
+		size_t readed;
+		while ((readed = kga_getdents64(dir_fd, buffer, PORT_HASH_BUFFER_SIZE))) {
+			for (size_t position = 0; position < readed; ) {
+				struct kga_dirent64 *dirent = (struct kga_dirent64 *)(buffer + position);
+				position += dirent->d_reclen;
+				if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, "..")) continue;
+				array_push(names, string_new_set(dirent->d_name));
+			};
+		};
+		// getdents order depends on the filesystem
+		strings_sort(names);
+		array_foreach(names, char **, each_name) {
+			struct stat st;
+			char *path = string_new_fmt("%s/%s", relative, *each_name);
+			kga_fstatat(dir_fd, *each_name, &st);
+			hash_update(state, path, string_length(path) + 1);
+			if (S_ISDIR(st.st_mode)) {
+				int fd = kga_openat(dir_fd, *each_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+				port_hash_dir(state, fd, path);
+			} else if (S_ISLNK(st.st_mode)) {
+				char target[PATH_MAX];
+				ssize_t length = readlinkat(dir_fd, *each_name, target, sizeof(target));
+				if (length < 0) throw_errno_verbose(path);
+				hash_update(state, target, length);
+			} else {
+				int fd = kga_openat(dir_fd, *each_name, O_RDONLY);
+				ssize_t file_readed;
+				while ((file_readed = read(fd, buffer, PORT_HASH_BUFFER_SIZE)) > 0) {
+					hash_update(state, buffer, file_readed);
+				};
+				if (file_readed < 0) throw_errno_verbose(path);
+			};
+		};
+	};
+};
+
+/* Settings of ports.conf that only say how this machine runs builds and
+ * where packages come from, not what gets built. */
+static const char *port_local_conf_names[] = {
+	"IGNORED_DEPENDS", "PREFETCH_JOBS", "BACKGROUND_CLEANUP", "BUILD_TMPFS_DIR", "BUILD_TMPFS_BUDGET",
+	"BUILD_SLOTS", "BUILD_MEM_BUDGET", "SYNC_TO", "CACHE_PACKAGES", "CACHE_SOURCES", "CACHE_BY_NAME", NULL
+};
+
+/* ports.conf without comments, blank lines and assignments of local settings,
+ * so tuning a machine does not change every input hash. */
+static uint64_t port_conf_hash(const char *conf_path) {
+	struct hash_state state;
+	hash_init(&state);
+	scope {
+		char **lines = NULL;
+		try lines = file_lines(conf_path);
+		catch if (!exception_type_is(exception_type_fopen_no_such_file)) throw_proxy();
+		if (lines) array_foreach(lines, char **, each_line) {
+			const char *c = *each_line;
+			while (*c == ' ' || *c == '\t') c++;
+			if (!*c || *c == '#') continue;
+			if (!strncmp(c, "export ", 7)) c += 7;
+			const char *end = c;
+			while ((*end >= 'A' && *end <= 'Z') || (*end >= 'a' && *end <= 'z') || (*end >= '0' && *end <= '9') || *end == '_') end++;
+			int local = 0;
+			if (*end == '=') {
+				for (const char **each_name = port_local_conf_names; *each_name; each_name++) {
+					if (strlen(*each_name) == (size_t)(end - c) && !strncmp(*each_name, c, end - c)) local = 1;
+				};
+			};
+			if (!local) hash_update(&state, *each_line, string_length(*each_line) + 1);
+		};
+	};
+	return hash_final(&state);
+};
+
+/* Tarjan's walk over dependencies. Ports of one dependency loop are finished
+ * together, whatever port the walk came in from. */
+struct port_hash_walk {
+	long int *index;
+	long int *lowlink;
+	port_t **stack;
+	long int counter;
+};
+
+static port_t *port_hash_depend(port_db_t *db, const char *depend) {
+	if (port_db_is_ignored_depend(db, depend)) return NULL;
+	return port_db_get_port(db, depend);
+};
+
+static int port_path_compare(const void *ptr1, const void *ptr2) {
+	return strcmp((*(port_t * const *)ptr1)->path, (*(port_t * const *)ptr2)->path);
+};
+
+/* Dependencies out of the loop of the port count with their hash, the ones
+ * in it by path only. */
+static void port_depends_hash(port_db_t *db, struct hash_state *state, char **depends) {
+	port_t *depend_port;
+	array_foreach(depends, char **, each_depend) {
+		if (!(depend_port = port_hash_depend(db, *each_depend))) continue;
+		hash_update(state, *each_depend, strlen(*each_depend) + 1);
+		if (depend_port->input_hash) hash_update(state, depend_port->input_hash, strlen(depend_port->input_hash) + 1);
+	};
+};
+
+static uint64_t port_own_hash(port_db_t *db, port_t *port) {
+	uint64_t hash;
+	scope {
+		struct hash_state state;
+		hash_init(&state);
+		hash_update(&state, db->arch, string_length(db->arch) + 1);
+		hash_update(&state, &db->conf_hash, sizeof(db->conf_hash));
+		hash_update(&state, port->path, string_length(port->path) + 1);
+		char *script = port_calculate_build_script(port, db);
+		hash_update(&state, script, string_length(script) + 1);
+		char *port_dir_path = string_new_fmt("/%s/pkgblds/%s", db->path, port->path);
+		int port_dir_fd = kga_openat(AT_FDCWD, port_dir_path, O_RDONLY | O_DIRECTORY);
+		port_hash_dir(&state, port_dir_fd, "");
+		port_depends_hash(db, &state, port->depends);
+		port_depends_hash(db, &state, port->build_depends);
+		port_depends_hash(db, &state, port->optional_depends);
+		hash = hash_final(&state);
+	};
+	return hash;
+};
+
+static void port_hash_set(port_db_t *db, port_t *port, uint64_t hash) {
+	char hex[17];
+	snprintf(hex, sizeof(hex), "%016llx", (unsigned long long int)hash);
+	scope_use(db->scope_pool) {
+		port->input_hash = string_new_set(hex);
+	};
+};
+
+/* A loop hashes the own hashes of its ports in path order into each of them. */
+static void port_hash_loop(port_db_t *db, port_t **loop) {
+	if (array_length(loop) == 1) {
+		port_hash_set(db, loop[0], port_own_hash(db, loop[0]));
+		return;
+	};
+	array_sort(loop, port_path_compare);
+	uint64_t *own = array_new(uint64_t, 0, 0);
+	struct hash_state state;
+	hash_init(&state);
+	array_foreach(loop, port_t **, each_port) {
+		array_push(own, port_own_hash(db, *each_port));
+		hash_update(&state, &own[array_length(own) - 1], sizeof(uint64_t));
+	};
+	uint64_t loop_hash = hash_final(&state);
+	for (size_t i = 0, n = array_length(loop); i < n; i++) {
+		uint64_t pair[2] = {own[i], loop_hash};
+		port_hash_set(db, loop[i], hash_data(pair, sizeof(pair)));
+	};
+};
+
+static void port_hash_visit(port_db_t *db, struct port_hash_walk *walk, port_t *port) {
+	size_t i = port - db->ports;
+	walk->index[i] = walk->lowlink[i] = ++walk->counter;
+	array_push(walk->stack, port);
+	char **lists[] = {port->depends, port->build_depends, port->optional_depends};
+	for (int l = 0; l < 3; l++) {
+		char **depends = lists[l];
+		array_foreach(depends, char **, each_depend) {
+			port_t *depend_port = port_hash_depend(db, *each_depend);
+			// hashed ones are done, visited ones without a hash are on the stack
+			if (!depend_port || depend_port->input_hash) continue;
+			size_t j = depend_port - db->ports;
+			if (!walk->index[j]) {
+				port_hash_visit(db, walk, depend_port);
+				if (walk->lowlink[j] < walk->lowlink[i]) walk->lowlink[i] = walk->lowlink[j];
+			} else if (walk->index[j] < walk->lowlink[i]) {
+				walk->lowlink[i] = walk->index[j];
+			};
+		};
+	};
+	if (walk->lowlink[i] != walk->index[i]) return;
+	scope {
+		port_t **loop = array_new(port_t *, 0, 0);
+		size_t start = array_length(walk->stack);
+		while (walk->stack[--start] != port);
+		for (size_t k = start, n = array_length(walk->stack); k < n; k++) array_push(loop, walk->stack[k]);
+		array_resize(walk->stack, start);
+		port_hash_loop(db, loop);
+	};
+};
+
+static const char *port_input_hash(port_db_t *db, port_t *port) {
+	if (port->input_hash) return port->input_hash;
+	scope {
+		size_t count = array_length(db->ports);
+		struct port_hash_walk walk = {
+			kga_malloc((count + 1) * sizeof(long int)), kga_malloc((count + 1) * sizeof(long int)),
+			array_new(port_t *, 0, 0), 0
+		};
+		scope_add(walk.index, free);
+		scope_add(walk.lowlink, free);
+		memset(walk.index, 0, count * sizeof(long int));
+		port_hash_visit(db, &walk, port);
+	};
+	return port->input_hash;
+};
+
+static int port_installed(port_db_t *db, port_t *port) {
+	int installed = 1;
+	if (!port->version || !*port->version) return installed;
+	scope {
+		size_t profile_mark = profile_begin("pkg_installed", port->path);
+		char *version_build = string_new_fmt("%s-%s-%s", port->version, port->build, db->arch);
+		installed = pkg_installed(db->root, db->pkg_db_path, port->name, version_build);
+		profile_end(profile_mark);
+	};
+	return installed;
+};
+
+/* The installed version-build was made from other inputs, it is not actual
+ * and goes in again. */
+static int port_inputs_changed(port_db_t *db, port_t *port) {
+	const char *installed_hash = port_stat_get(db, port, "input");
+	return installed_hash && port->input_hash && strcmp(installed_hash, port->input_hash);
+};
+
+static int port_actual(port_db_t *db, port_t *port) {
+	return port_installed(db, port) && !port_inputs_changed(db, port);
+};
+
+/* BUILD_SLOTS shared by the build and the forked prefetch process: the build
+ * owns one slot implicitly, every other slot is a token in a pipe both take
+ * from without waiting. */
+static void port_db_slot_tokens_init(port_db_t *db) {
+	scope_use(db->scope_pool) {
+		db->slot_tokens = kga_pipe();
+	};
+	fcntl(db->slot_tokens[0], F_SETFD, FD_CLOEXEC);
+	fcntl(db->slot_tokens[1], F_SETFD, FD_CLOEXEC);
+	fcntl(db->slot_tokens[0], F_SETFL, O_NONBLOCK);
+	for (long int i = 1; i < db->build_slots; i++) {
+		if (write(db->slot_tokens[1], "+", 1) != 1) throw_errno();
 	};
 };
 
@@ -215,6 +701,12 @@ void port_db_prepare(port_db_t *db) {
 		char *prepare_script = string_new();
 		string_fmt(prepare_script,
 			"IGNORED_DEPENDS=''\n"
+			"PREFETCH_JOBS=''\n"
+			"BACKGROUND_CLEANUP=''\n"
+			"BUILD_TMPFS_DIR=''\n"
+			"BUILD_TMPFS_BUDGET=''\n"
+			"BUILD_SLOTS=''\n"
+			"BUILD_MEM_BUDGET=''\n"
 			"ROOTDIR=%s\n"
 			"PORTSBASEDIR=%s\n"
 			"PORTS_ARCH=%s\n"
@@ -226,9 +718,46 @@ void port_db_prepare(port_db_t *db) {
 			db->path,
 			db->arch);
 		shell_process(db->shell, prepare_script);
+		scope_use(db->scope_pool) {
+			db->conf_script = string_new_set(prepare_script);
+		};
+		db->conf_hash = port_conf_hash(string_new_fmt("/%s/ports.conf", db->path));
 		char *ignored_depends = shell_get_var(db->shell, "IGNORED_DEPENDS");
+		char *prefetch_jobs = shell_get_var(db->shell, "PREFETCH_JOBS");
+		db->prefetch_jobs = *prefetch_jobs ? strtol(prefetch_jobs, NULL, 10) : PORT_PREFETCH_DEFAULT_JOBS;
+		db->background_cleanup = strcmp(shell_get_var(db->shell, "BACKGROUND_CLEANUP"), "n");
+		char *tmpfs_dir = shell_get_var(db->shell, "BUILD_TMPFS_DIR");
+		char *tmpfs_budget = shell_get_var(db->shell, "BUILD_TMPFS_BUDGET");
+		char *build_slots = shell_get_var(db->shell, "BUILD_SLOTS");
+		char *build_mem_budget = shell_get_var(db->shell, "BUILD_MEM_BUDGET");
+		db->build_slots = *build_slots ? strtol(build_slots, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+		if (db->build_slots < 1) db->build_slots = 1;
+		port_db_slot_tokens_init(db);
+		db->build_mem = *build_mem_budget ? parse_size(build_mem_budget) : (long long int)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+		if (db->build_mem < 0) {
+			fprintf(db->warning_stream, "Bad BUILD_MEM_BUDGET %s, using physical memory.\n", build_mem_budget);
+			db->build_mem = (long long int)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+		};
 		db->ignored_depends = NULL;
 		scope_use(db->scope_pool) {
+			db->placements = array_new(struct port_placement, 0, 0);
+			db->conf_vars = array_new(struct shell_var, 0, 0);
+			if (*tmpfs_dir) {
+				// a budget larger than the free space would only turn into ENOSPC in the middle of a build
+				struct statvfs st;
+				kga_mkpath(tmpfs_dir, 0755);
+				if (statvfs(tmpfs_dir, &st)) throw_errno_verbose(tmpfs_dir);
+				db->tmpfs_budget = (long long int)st.f_bavail * st.f_frsize;
+				if (*tmpfs_budget) {
+					long long int budget = parse_size(tmpfs_budget);
+					if (budget < 0) {
+						fprintf(db->warning_stream, "Bad BUILD_TMPFS_BUDGET %s, using free space of %s.\n", tmpfs_budget, tmpfs_dir);
+					} else if (budget < db->tmpfs_budget) {
+						db->tmpfs_budget = budget;
+					};
+				};
+				db->tmpfs_dir = string_new_set(tmpfs_dir);
+			};
 			db->ignored_depends = string_split(ignored_depends, " ", STRING_SPLIT_WITHOUT_EMPTY);
 			db->ports = array_new(port_t, 0, ARRAY_NULL_TERMINATED);
 			if (db->targets) {
@@ -245,11 +774,18 @@ void port_db_prepare(port_db_t *db) {
 				port_calculate_build(&db->ports[i], db);
 			};
 		};
-		char *version_build = string_new();
 		array_foreach(db->ports, struct port *, port) {
-			string_fmt(version_build, "%s-%s-%s", port->version, port->build, db->arch);
-			if ((!port->version || !*port->version) || pkg_installed(db->root, db->pkg_db_path, port->name, version_build)) {
-				port->flags |= PORT_ACTUAL;
+			size_t profile_mark = profile_begin("input_hash", port->path);
+			port_input_hash(db, port);
+			profile_end(profile_mark);
+		};
+		array_foreach(db->ports, struct port *, port) {
+			if (port_installed(db, port)) {
+				if (port_inputs_changed(db, port)) {
+					fprintf(db->warning_stream, "Inputs of %s changed since %s-%s was installed, installing it again.\n", port->path, port->version, port->build);
+				} else {
+					port->flags |= PORT_ACTUAL;
+				};
 #if 0
 			} else {
 				if (!(port->flags & PORT_BUILD_TIME))
@@ -265,22 +801,94 @@ void port_write_script(port_db_t *db, port_t *port, const char *script_path) {
 		FILE *file = kga_fopen(script_path, "w");
 		kga_fprintf(file, "PORTSROOT='/%s'\n", db->path);
 		kga_fprintf(file, "PORT_PATH='%s'\n%s", port->path, port_calculate_build_script(port, db));
+		if (port->input_hash) kga_fprintf(file, "INPUT_HASH='%s'\n", port->input_hash);
+		if (profile_enabled()) kga_fprintf(file, "PORT_PROFILE='y'\n");
 		kga_fprintf(file, ". /%s \"$@\"\n", db->build_template);
 	};
 };
 
-int port_run_script(port_db_t *db, port_t *port, const char *cmd) {
-	int status = -1;
+/* Build dir base for the port: the tmpfs if the tree of its last build fits in
+ * what is left of the budget, the ports tree otherwise. Ports never built yet
+ * go to disk. The size to reserve is returned in *size. */
+static const char *port_db_place(port_db_t *db, port_t *port, long long int *size) {
+	*size = 0;
+	if (!db->tmpfs_dir) return NULL;
+	long long int tree = port_stat_get_number(db, port, "tree");
+	if (tree < 0) return NULL;
+	// the tree is measured when the build is over, leave room for what was deleted on the way
+	tree += tree / 4;
+	long long int used = 0;
+	array_foreach(db->placements, struct port_placement *, each_placement) {
+		used += each_placement->size;
+	};
+	if (used + tree > db->tmpfs_budget) return NULL;
+	*size = tree;
+	return db->tmpfs_dir;
+};
+
+static void port_db_place_release(port_db_t *db, const char *tmp_path) {
+	for (size_t i = 0; i < array_length(db->placements); i++) {
+		if (!strcmp(db->placements[i].tmp_path, tmp_path)) {
+			array_delete_interval(db->placements, i, 1);
+			return;
+		};
+	};
+};
+
+static char *port_script_prepare(port_db_t *db, port_t *port, const char *base) {
+	char *tmp_path = base ? string_new_fmt("%s/bld.XXXXXX", base) : string_new_fmt("/%s/tmp/bld.XXXXXX", db->path);
+	kga_mkdtemp(tmp_path);
+	kga_chown(tmp_path, PORT_UID, PORT_GID);
 	scope {
-		char *tmp_path = string_new_fmt("/%s/tmp/bld.XXXXXX", db->path);
-		kga_mkdtemp(tmp_path);
-		kga_chown(tmp_path, PORT_UID, PORT_GID);
 		char *script_path = string_new_fmt("%s/script.sh", tmp_path);
 		port_write_script(db, port, script_path);
-		if (port_confirm && !port_confirm("Do you want run script %s?", script_path)) {
-			throw(port_aborted_by_user, 1, "Aborted by user", NULL);
-		};
-		pid_t script_pid = kga_fork();
+	};
+	return tmp_path;
+};
+
+static int port_db_slot_token_take(port_db_t *db) {
+	char token;
+	return read(db->slot_tokens[0], &token, 1) == 1;
+};
+
+static void port_db_slot_token_give(port_db_t *db) {
+	if (write(db->slot_tokens[1], "+", 1) != 1) throw_errno();
+};
+
+/* Job slots granted to one build out of the global budget: BUILD_JOBS of the
+ * port, or every slot, cut down so that BUILD_MEM per job fits into the memory
+ * left and to the tokens the running prefetch scripts left. A build always
+ * gets at least one slot, so builds never wait here. */
+static long int port_db_slots_take(port_db_t *db, port_t *port) {
+	long int jobs = port->build_jobs && port->build_jobs < db->build_slots ? port->build_jobs : db->build_slots;
+	if (port->build_mem && jobs > db->build_mem / port->build_mem) jobs = db->build_mem / port->build_mem;
+	long int granted = 1;
+	while (granted < jobs && port_db_slot_token_take(db)) granted++;
+	db->build_mem -= granted * port->build_mem;
+	return granted;
+};
+
+static void port_db_slots_release(port_db_t *db, port_t *port, long int jobs) {
+	for (long int i = 1; i < jobs; i++) port_db_slot_token_give(db);
+	db->build_mem += jobs * port->build_mem;
+};
+
+/* Make-style jobserver for one build: a pipe holding a token per granted slot
+ * but the one the build owns implicitly. */
+static int *port_jobserver_new(long int jobs) {
+	int *fds = kga_pipe();
+	for (long int i = 1; i < jobs; i++) {
+		if (write(fds[1], "+", 1) != 1) throw_errno();
+	};
+	return fds;
+};
+
+static pid_t port_script_spawn(const char *tmp_path, const char *cmd, long int jobs, const int *jobserver) {
+	pid_t script_pid;
+	scope {
+		char *script_path = string_new_fmt("%s/script.sh", tmp_path);
+		fflush(NULL);
+		script_pid = kga_fork();
 		if (!script_pid) {
 			char script_path_copy[string_length(script_path) + 1];
 			char cmd_copy[strlen(cmd) + 1];
@@ -288,44 +896,516 @@ int port_run_script(port_db_t *db, port_t *port, const char *cmd) {
 			strcpy(cmd_copy, cmd);
 			setenv("HOME", tmp_path, 1);
 			kga_chdir(tmp_path);
+			// the scope closes the pipe, the script gets its own copies
+			int jobserver_read = jobserver ? dup(jobserver[0]) : -1;
+			int jobserver_write = jobserver ? dup(jobserver[1]) : -1;
 			while (scope_current()) scope_end();
+			if (jobserver_read >= 0 && jobserver_write >= 0) {
+				const char *old_makeflags = getenv("MAKEFLAGS");
+				char makeflags[64 + (old_makeflags ? strlen(old_makeflags) : 0)];
+				char jobs_string[32];
+				snprintf(makeflags, sizeof(makeflags), "-j%li --jobserver-auth=%i,%i%s%s", jobs, jobserver_read, jobserver_write,
+						old_makeflags ? " " : "", old_makeflags ? old_makeflags : "");
+				snprintf(jobs_string, sizeof(jobs_string), "%li", jobs);
+				setenv("MAKEFLAGS", makeflags, 1);
+				setenv("PORT_JOBS", jobs_string, 1);
+			};
 			setuid(PORT_UID);
 			setgid(PORT_GID);
 			execl("/bin/sh", "/bin/sh", script_path_copy, cmd_copy, NULL);
-			fprintf(stderr, "exec: %s: %s\n", script_path, strerror(errno));
+			fprintf(stderr, "exec: %s: %s\n", script_path_copy, strerror(errno));
 			exit(EXIT_FAILURE);
 		};
+	};
+	return script_pid;
+};
+
+/* Runs cmd for the port, a built or fetched package is left in <tmp_path>/fr. */
+static int port_script_run(port_db_t *db, port_t *port, const char *cmd, char **tmp_path) {
+	int status = -1;
+	long long int size = 0;
+	const char *base = strcmp(cmd, "build_package") ? NULL : port_db_place(db, port, &size);
+	*tmp_path = port_script_prepare(db, port, base);
+	if (base) {
+		struct port_placement placement;
+		scope_use(db->scope_pool) {
+			placement.tmp_path = string_new_set(*tmp_path);
+		};
+		placement.size = size;
+		array_push(db->placements, placement);
+		fprintf(db->warning_stream, "Building %s in %s.\n", port->name, base);
+	};
+	if (port_confirm && !port_confirm("Do you want run script %s/script.sh?", *tmp_path)) {
+		throw(port_aborted_by_user, 1, "Aborted by user", NULL);
+	};
+	long int jobs = 0;
+	pid_t script_pid;
+	if (!strcmp(cmd, "build_package")) {
+		jobs = port_db_slots_take(db, port);
+		scope {
+			int *jobserver = port_jobserver_new(jobs);
+			script_pid = port_script_spawn(*tmp_path, cmd, jobs, jobserver);
+			fprintf(db->warning_stream, "Waiting script pid %li, %li jobs\n", (long int)script_pid, jobs);
+		};
+	} else {
+		script_pid = port_script_spawn(*tmp_path, cmd, 0, NULL);
 		fprintf(db->warning_stream, "Waiting script pid %li\n", (long int)script_pid);
-		waitpid(script_pid, &status, 0);
+	};
+	long long int start = profile_now();
+	waitpid(script_pid, &status, 0);
+	long long int duration = profile_now() - start;
+	if (jobs) port_db_slots_release(db, port, jobs);
+	scope {
+		char *profile_log_path = string_new_fmt("%s/profile.log", *tmp_path);
+		profile_stages_load(profile_log_path, port->path, 0);
+		// a failed build stops short, its tree says nothing of the next one
+		if (!status && !strcmp(cmd, "build_package")) {
+			char *pkg_path = string_new_fmt("%s/fr", *tmp_path);
+			port_stat_set(db, port, "tree", string_new_fmt("%lld", disk_usage(*tmp_path)));
+			port_stat_set(db, port, "fr", string_new_fmt("%lld", disk_usage(pkg_path)));
+		};
 		if (!status) {
-			char *pkg_path = string_new_fmt("%s/fr", tmp_path);
-			try {
-				if (port->keep_old) {
-					if (!port_confirm || port_confirm("Install package %s/%s from %s?", port->name, port->version, pkg_path)) {
-						pkg_install(pkg_path, db->root, db->pkg_db_path, 0, db->warning_stream);
-					} else {
-						status = -1;
-					};
+			port_stat_set(db, port, cmd, string_new_fmt("%lld", duration));
+			port_stat_set(db, port, "last", cmd);
+		};
+		port_db_stats_save(db);
+	};
+	return status;
+};
+
+static void port_db_journal_hooks(port_db_t *db, const char *state) {
+	if (!db->journal) return;
+	kga_fprintf(db->journal, "- %s -\n", state);
+	kga_fflush_and_fsync(db->journal);
+};
+
+/* Installs leave their hooks to port_db_hooks_run. The journal hears of them
+ * before the install, a run that dies in between leaves them to the next. */
+static void port_db_hooks_pending(port_db_t *db) {
+	if (db->hooks_pending) return;
+	db->hooks_pending = 1;
+	port_db_journal_hooks(db, "hooks");
+};
+
+static void port_db_hooks_run(port_db_t *db) {
+	if (!db->hooks_pending) return;
+	pkg_finish_installs(db->root, NULL, db->warning_stream);
+	db->hooks_pending = 0;
+	port_db_journal_hooks(db, "hooks-done");
+};
+
+static int port_package_install(port_db_t *db, port_t *port, const char *tmp_path) {
+	int status = 0;
+	scope {
+		char *pkg_path = string_new_fmt("%s/fr", tmp_path);
+		size_t install_profile_mark = profile_begin("pkg_install", NULL);
+		try {
+			port_db_hooks_pending(db);
+			if (port->keep_old) {
+				if (!port_confirm || port_confirm("Install package %s/%s from %s?", port->name, port->version, pkg_path)) {
+					pkg_install(pkg_path, db->root, db->pkg_db_path, PKG_REINSTALL | PKG_DEFER_HOOKS, db->warning_stream);
 				} else {
-					if (!port_confirm || port_confirm("Upgrade package %s/%s from %s?", port->name, port->version, pkg_path)) {
-						pkg_install(pkg_path, db->root, db->pkg_db_path, PKG_UPGRADE, db->warning_stream);
-					} else {
-						status = -1;
-					};
+					status = -1;
+				};
+			} else {
+				if (!port_confirm || port_confirm("Upgrade package %s/%s from %s?", port->name, port->version, pkg_path)) {
+					pkg_install(pkg_path, db->root, db->pkg_db_path, PKG_UPGRADE | PKG_INCREMENTAL | PKG_REINSTALL | PKG_DEFER_HOOKS, db->warning_stream);
+				} else {
+					status = -1;
 				};
 			};
-			catch {
-				exception_print(stderr);
+			if (!status) port_installed_record(db, port);
+		};
+		catch {
+			exception_print(stderr);
+			if (exception_type_is(exception_type_pkg_finish_failed)) {
+				port_installed_record(db, port);
+			} else {
 				status = -1;
 			};
 		};
+		profile_end(install_profile_mark);
+	};
+	return status;
+};
+
+/* Build trees are unique per script run, so nothing waits for them to go away.
+ * Trees on the tmpfs hold memory of the budget and go right away. */
+static void port_script_cleanup(port_db_t *db, const char *tmp_path) {
+	size_t rmrf_profile_mark = profile_begin("cleanup", NULL);
+	size_t placements = array_length(db->placements);
+	port_db_place_release(db, tmp_path);
+	if (db->background_cleanup && placements == array_length(db->placements)) {
+		rmrf_background(tmp_path);
+	} else {
 		rmrf(tmp_path);
 	};
+	profile_end(rmrf_profile_mark);
+};
+
+int port_run_script(port_db_t *db, port_t *port, const char *cmd) {
+	int status = -1;
+	if (port_test_mode) {
+		// nothing gets installed, so take the port as done to let the plan go on
+		fprintf(db->warning_stream, "Test mode, skipping %s for %s.\n", cmd, port->name);
+		port->flags |= PORT_ACTUAL;
+		return 0;
+	};
+	scope {
+		size_t profile_mark = profile_begin(cmd, port->path);
+		char *tmp_path;
+		status = port_script_run(db, port, cmd, &tmp_path);
+		if (!status) status = port_package_install(db, port, tmp_path);
+		port_script_cleanup(db, tmp_path);
+		profile_end(profile_mark);
+	};
 	return status;
 };
 
-void port_db_upgrade(port_db_t *db, char **need) {
+
+static void port_prefetch_run(port_db_t *db, struct port_job *jobs, FILE *done) {
+	size_t total = array_length(jobs), started = 0, finished = 0, running = 0;
+	try {
+		while (finished < total) {
+			while (running < db->prefetch_jobs && started < total) {
+				// the first script runs on the token taken for the prefetch process, the others need their own
+				jobs[started].token = running > 0;
+				if (jobs[started].token && !port_db_slot_token_take(db)) break;
+				// slots are the lanes of the profile trace
+				for (jobs[started].slot = 1; ; jobs[started].slot++) {
+					size_t i;
+					for (i = 0; i < started && !(jobs[i].pid > 0 && jobs[i].slot == jobs[started].slot); i++);
+					if (i == started) break;
+				};
+				jobs[started].start = profile_now();
+				jobs[started].tmp_path = port_script_prepare(db, jobs[started].port, NULL);
+				jobs[started].pid = port_script_spawn(jobs[started].tmp_path, "prefetch", 0, NULL);
+				started++;
+				running++;
+			};
+			int status;
+			pid_t pid = waitpid(-1, &status, 0);
+			if (pid < 0) throw_errno();
+			for (size_t i = 0; i < started; i++) {
+				if (jobs[i].pid != pid) continue;
+				jobs[i].pid = -1;
+				if (jobs[i].token) port_db_slot_token_give(db);
+				running--;
+				finished++;
+				fprintf(db->warning_stream, "Prefetch [%zu/%zu] %s: %s\n", finished, total, jobs[i].port->name, status ? "not available" : "done");
+				rmrf(jobs[i].tmp_path);
+				kga_fprintf(done, "%li %lli %lli %i\n", (long int)(jobs[i].port - db->ports), jobs[i].start, profile_now(), jobs[i].slot);
+				fflush(done);
+				break;
+			};
+		};
+	};
+	catch {
+		exception_print(stderr);
+		for (size_t i = 0; i < started; i++) {
+			if (jobs[i].pid > 0) kill(jobs[i].pid, SIGTERM);
+		};
+	};
+};
+
+static void port_prefetch_free(void *ptr) {
+	struct port_prefetch *prefetch = ptr;
+	if (prefetch->pid > 0 && prefetch->parent_pid == getpid()) {
+		int status;
+		kill(prefetch->pid, SIGTERM);
+		waitpid(prefetch->pid, &status, 0);
+	};
+	free(prefetch);
+};
+
+/* Fetch packages and sources of all ports planned for update into the cache,
+ * up to PREFETCH_JOBS at once, while the main loop goes on. */
+static void port_db_prefetch_start(port_db_t *db) {
+	if (db->prefetch_jobs <= 0 || port_confirm || port_test_mode) return;
+	scope {
+		struct port_job *jobs = array_new(struct port_job, 0, 0);
+		struct port_job job;
+		array_foreach(db->order, struct port **, each_port) {
+			port_t *port = *each_port;
+			if (!(port->flags & PORT_MARK_TO_PROCESS) || (port->flags & (PORT_ACTUAL | PORT_BUILD_TIME))) continue;
+			// installed ports need nothing fetched, checked here instead of relying on prepare to flag them
+			if (port_actual(db, port)) {
+				port->flags |= PORT_ACTUAL;
+				continue;
+			};
+			port->flags |= PORT_PREFETCH_PENDING;
+			job.port = port;
+			job.tmp_path = NULL;
+			job.pid = -1;
+			job.slot = 0;
+			job.token = 0;
+			job.start = 0;
+			array_push(jobs, job);
+		};
+		if (array_length(jobs)) {
+			int *done_pipe = kga_pipe();
+			scope_use(db->scope_pool) {
+				db->prefetch = kga_malloc(sizeof(struct port_prefetch));
+				db->prefetch->pid = -1;
+				db->prefetch->parent_pid = getpid();
+				db->prefetch->done = NULL;
+				// with a single slot there is no token, prefetch then runs one script beside the build
+				db->prefetch->token = port_db_slot_token_take(db);
+				scope_add(db->prefetch, port_prefetch_free);
+				fflush(NULL);
+				db->prefetch->pid = kga_fork();
+				if (!db->prefetch->pid) {
+					close(done_pipe[0]);
+					fcntl(done_pipe[1], F_SETFD, FD_CLOEXEC);
+					FILE *done = fdopen(done_pipe[1], "w");
+					if (!done) exit(EXIT_FAILURE);
+					port_prefetch_run(db, jobs, done);
+					fclose(done);
+					exit(EXIT_SUCCESS);
+				};
+				db->prefetch->done = kga_fdopen(done_pipe[0], "r");
+				done_pipe[0] = -1;
+			};
+		};
+	};
+};
+
+static void port_db_prefetch_done(port_db_t *db, const char *line) {
+	long int index;
+	long long int start, end;
+	int slot;
+	if (sscanf(line, "%li %lli %lli %i", &index, &start, &end, &slot) != 4) return;
+	if (index < 0 || index >= array_length(db->ports)) return;
+	db->ports[index].flags &= ~PORT_PREFETCH_PENDING;
+	profile_event("prefetch", db->ports[index].path, start, end, slot);
+};
+
+/* Block until prefetch for the port was finished, so its script consumes the cache. */
+/* The token of the prefetch process is for builds again once it is done. */
+static void port_db_prefetch_release(port_db_t *db) {
+	if (!db->prefetch || !db->prefetch->token) return;
+	port_db_slot_token_give(db);
+	db->prefetch->token = 0;
+};
+
+static void port_db_prefetch_wait(port_db_t *db, port_t *port) {
+	char line[128];
+	while (port->flags & PORT_PREFETCH_PENDING) {
+		if (!db->prefetch || !fgets(line, sizeof(line), db->prefetch->done)) {
+			port_db_prefetch_release(db);
+			array_foreach(db->ports, struct port *, each_port) {
+				each_port->flags &= ~PORT_PREFETCH_PENDING;
+			};
+			break;
+		};
+		port_db_prefetch_done(db, line);
+	};
+};
+
+static void port_db_prefetch_finish(port_db_t *db) {
+	if (!db->prefetch) return;
+	char line[128];
+	while (fgets(line, sizeof(line), db->prefetch->done)) port_db_prefetch_done(db, line);
+	port_db_prefetch_release(db);
+	int status;
+	waitpid(db->prefetch->pid, &status, 0);
+	db->prefetch->pid = -1;
+};
+
+struct port_staged {
+	port_t *port;
+	char *tmp_path;
+};
+
+static void port_journal_write(port_db_t *db, port_t *port, long int flag) {
+	for (const struct port_journal_state *state = port_journal_states; state->name; state++) {
+		if (state->flag != flag) continue;
+		kga_fprintf(db->journal, "%s %s %s\n", port->path, state->name, port->input_hash ? port->input_hash : "-");
+	};
+};
+
+static void port_set_flag(port_db_t *db, port_t *port, long int flag) {
+	if (port->flags & flag) return;
+	port->flags |= flag;
+	if (!db->journal) return;
+	port_journal_write(db, port, flag);
+	// the journal is for interrupted runs, it has to be on disk before going on
+	kga_fflush_and_fsync(db->journal);
+};
+
+/* Makes the next upgrade go on from the journal of an interrupted one. */
+void port_db_resume(port_db_t *db) {
 	important_check(db);
+	db->resume = 1;
+};
+
+/* States of ports whose inputs did not change since they were journaled. Fetches
+ * that failed are not tried again and failed builds are retried without them.
+ * Hooks an interrupted run left pending are run by any next run. */
+static void port_db_journal_load(port_db_t *db) {
+	scope {
+		char *journal_path = string_new_fmt("/%s/journal", db->path);
+		char **lines = NULL;
+		try lines = file_lines(journal_path);
+		catch if (!exception_type_is(exception_type_fopen_no_such_file)) throw_proxy();
+		if (lines) array_foreach(lines, char **, each_line) {
+			char **fields = string_split(*each_line, " ", STRING_SPLIT_WITHOUT_EMPTY);
+			if (array_length(fields) != 3) continue;
+			if (!strcmp(fields[0], "-")) {
+				if (!strcmp(fields[1], "hooks")) db->hooks_pending = 1;
+				if (!strcmp(fields[1], "hooks-done")) db->hooks_pending = 0;
+				continue;
+			};
+			if (!db->resume) continue;
+			port_t *port = port_db_get_port(db, fields[0]);
+			if (!port || !port->input_hash || strcmp(port->input_hash, fields[2])) continue;
+			if (!strcmp(fields[1], "build") || !strcmp(fields[1], "error")) {
+				port->flags |= PORT_MARK_TO_BUILD;
+			} else if (!strcmp(fields[1], "build-needed")) {
+				port->flags |= PORT_BUILD_TIME_NEEDED;
+			} else if (!strcmp(fields[1], "finished") && (port->flags & PORT_ACTUAL)) {
+				port->flags |= PORT_FINISHED;
+			};
+		};
+	};
+};
+
+static void port_db_journal_start(port_db_t *db) {
+	if (port_test_mode) return;
+	port_db_journal_load(db);
+	scope {
+		char *journal_path = string_new_fmt("/%s/journal", db->path);
+		scope_use(db->scope_pool) {
+			db->journal = kga_fopen(journal_path, db->resume ? "a" : "w");
+		};
+		if (db->hooks_pending && !db->resume) port_db_journal_hooks(db, "hooks");
+		// marks are worked out again on resume, they are only there to read
+		array_foreach(db->ports, struct port *, each_port) {
+			if (each_port->flags & PORT_MARK_TO_PROCESS) port_journal_write(db, each_port, PORT_MARK_TO_PROCESS);
+		};
+		kga_fflush_and_fsync(db->journal);
+	};
+};
+
+/* A run that ended without errors leaves nothing to resume. */
+static void port_db_journal_finish(port_db_t *db) {
+	if (!db->journal) return;
+	array_foreach(db->ports, struct port *, each_port) {
+		if (each_port->flags & PORT_HAVE_ERROR) return;
+	};
+	scope {
+		char *journal_path = string_new_fmt("/%s/journal", db->path);
+		if (unlink(journal_path)) throw_errno_verbose(journal_path);
+	};
+};
+
+/* Gets packages of every port that became ready in one pass and installs them
+ * with one transaction, or one by one if the transaction fails. Ports without
+ * a package are marked to build. */
+static void port_db_get_packages(port_db_t *db, port_t **ports) {
+	if (port_test_mode || port_confirm || array_length(ports) < 2) {
+		array_foreach(ports, port_t **, each_port) {
+			port_db_prefetch_wait(db, *each_port);
+			fprintf(db->warning_stream, "Trying get package for %s.\n", (*each_port)->name);
+			if (port_run_script(db, *each_port, "get_package")) {
+				port_set_flag(db, *each_port, PORT_MARK_TO_BUILD);
+			};
+		};
+		return;
+	};
+	scope {
+		struct port_staged *staged = array_new(struct port_staged, 0, 0);
+		char **pkg_paths = array_new(char *, 0, ARRAY_NULL_TERMINATED);
+		int batch_installed = 0;
+		array_foreach(ports, port_t **, each_port) {
+			struct port_staged each_staged;
+			port_db_prefetch_wait(db, *each_port);
+			fprintf(db->warning_stream, "Trying get package for %s.\n", (*each_port)->name);
+			size_t profile_mark = profile_begin("get_package", (*each_port)->path);
+			each_staged.port = *each_port;
+			if (port_script_run(db, *each_port, "get_package", &each_staged.tmp_path)) {
+				port_set_flag(db, *each_port, PORT_MARK_TO_BUILD);
+				port_script_cleanup(db, each_staged.tmp_path);
+			} else {
+				array_push(staged, each_staged);
+				if (!(*each_port)->keep_old) array_push(pkg_paths, string_new_fmt("%s/fr", each_staged.tmp_path));
+			};
+			profile_end(profile_mark);
+		};
+		if (array_length(pkg_paths)) {
+			size_t profile_mark = profile_begin("pkg_install", NULL);
+			try {
+				port_db_hooks_pending(db);
+				pkg_install_many(pkg_paths, db->root, db->pkg_db_path, PKG_UPGRADE | PKG_INCREMENTAL | PKG_REINSTALL | PKG_DEFER_HOOKS, db->warning_stream);
+				batch_installed = 1;
+			};
+			catch {
+				exception_print(stderr);
+				// past the commit the packages are in, one by one would find them installed
+				if (exception_type_is(exception_type_pkg_finish_failed)) {
+					batch_installed = 1;
+				} else {
+					fprintf(db->warning_stream, "Installing %zu packages together failed, installing one by one.\n", array_length(pkg_paths));
+				};
+			};
+			if (batch_installed) {
+				array_foreach(staged, struct port_staged *, each_staged) {
+					if (!each_staged->port->keep_old) port_installed_record(db, each_staged->port);
+				};
+			};
+			profile_end(profile_mark);
+		};
+		array_foreach(staged, struct port_staged *, each_staged) {
+			if (!batch_installed || each_staged->port->keep_old) {
+				if (port_package_install(db, each_staged->port, each_staged->tmp_path)) {
+					port_set_flag(db, each_staged->port, PORT_MARK_TO_BUILD);
+				};
+			};
+			port_script_cleanup(db, each_staged->tmp_path);
+		};
+	};
+};
+
+/* Expected wall time of the port, the last get_package or build_package that
+ * got it installed. Ports without history count as free. */
+static long long int port_estimate(port_db_t *db, port_t *port) {
+	if (port->flags & PORT_ACTUAL) return 0;
+	const char *last = port_stat_get(db, port, "last");
+	if (!last) return 0;
+	long long int duration = port_stat_get_number(db, port, last);
+	return duration < 0 ? 0 : duration;
+};
+
+/* Length of the longest chain of estimates from the port up to the last port
+ * waiting for it. */
+static long long int port_priority(port_db_t *db, port_t *port) {
+	if (port->priority >= 0) return port->priority;
+	if (port->priority == -2) return 0; // dependency loop
+	port->priority = -2;
+	long long int longest = 0;
+	array_foreach(db->ports, struct port *, each_port) {
+		if (!(each_port->flags & PORT_MARK_TO_PROCESS)) continue;
+		array_foreach(each_port->all_depends, struct port **, each_depend) {
+			if (*each_depend != port) continue;
+			long long int priority = port_priority(db, each_port);
+			if (priority > longest) longest = priority;
+			break;
+		};
+	};
+	port->priority = port->estimate + longest;
+	return port->priority;
+};
+
+static int port_priority_compare(const void *ptr1, const void *ptr2) {
+	const struct port *port1 = *(struct port * const *)ptr1;
+	const struct port *port2 = *(struct port * const *)ptr2;
+	if (port1->priority != port2->priority) return port1->priority < port2->priority ? 1 : -1;
+	return port1 < port2 ? -1 : port1 > port2;
+};
+
+/* Resolves dependencies, marks what need requires and orders the ports longest
+ * path first, so long chains start as early as possible. */
+static void port_db_mark(port_db_t *db, char **need) {
 	if (need) {
 		port_t *port;
 		for(char **needed_port = need; *needed_port; needed_port++) {
@@ -358,11 +1438,41 @@ void port_db_upgrade(port_db_t *db, char **need) {
 		};
 	};
 
+	for(int changed = 1; changed; ) {
+		changed = 0;
+		array_foreach(db->ports, struct port *, each_port) {
+			if (!(each_port->flags & PORT_MARK_TO_PROCESS)) continue;
+			array_foreach(each_port->all_depends, struct port **, each_depend) {
+				if (!((*each_depend)->flags & PORT_MARK_TO_PROCESS)) {
+					(*each_depend)->flags |= PORT_MARK_TO_PROCESS;
+					changed = 1;
+				};
+			};
+		};
+	};
+	array_foreach(db->ports, struct port *, each_port) {
+		each_port->estimate = port_estimate(db, each_port);
+	};
+	scope_use(db->scope_pool) {
+		db->order = array_new(struct port *, 0, 0);
+		array_foreach(db->ports, struct port *, each_port) {
+			port_priority(db, each_port);
+			array_push(db->order, each_port);
+		};
+	};
+	array_sort(db->order, port_priority_compare);
+};
+
+/* Gets, builds and installs marked ports until nothing changes. Builds see the
+ * hooks of what was installed before them. */
+static void port_db_process(port_db_t *db) {
 	scope {
-		char *version_build = string_new();
+		port_t **ready_ports = array_new(port_t *, 0, 0);
 		for(int changed = 1; changed; ) {
 			changed = 0;
-			array_foreach(db->ports, struct port *, port) {
+			array_resize(ready_ports, 0);
+			array_foreach(db->order, struct port **, each_port) {
+				port_t *port = *each_port;
 				if (!(port->flags & PORT_MARK_TO_PROCESS) || (port->flags & PORT_FINISHED) || (port->flags & PORT_HAVE_ERROR)) continue;
 
 				array_foreach(port->all_depends, struct port **, each_depend) {
@@ -373,9 +1483,8 @@ void port_db_upgrade(port_db_t *db, char **need) {
 				};
 
 				if (!(port->flags & PORT_ACTUAL)) {
-					string_fmt(version_build, "%s-%s-%s", port->version, port->build, db->arch);
-					if ((!port->version || !*port->version) || pkg_installed(db->root, db->pkg_db_path, port->name, version_build)) {
-						port->flags |= PORT_ACTUAL;
+					if (port_actual(db, port)) {
+						port_set_flag(db, port, PORT_ACTUAL);
 						changed = 1;
 					};
 				};
@@ -400,7 +1509,7 @@ void port_db_upgrade(port_db_t *db, char **need) {
 #if 0
 						fprintf(db->warning_stream, "Port %s finished.\n", port->name);
 #endif
-						port->flags |= PORT_FINISHED;
+						port_set_flag(db, port, PORT_FINISHED);
 						changed = 1;
 					};
 				};
@@ -415,10 +1524,7 @@ void port_db_upgrade(port_db_t *db, char **need) {
 						};
 					};
 					if (port_ready_to_update) {
-						fprintf(db->warning_stream, "Trying get package for %s.\n", port->name);
-						if (port_run_script(db, port, "get_package")) {
-							port->flags |= PORT_MARK_TO_BUILD;
-						};
+						array_push(ready_ports, port);
 						changed = 1;
 					};
 				};
@@ -429,7 +1535,7 @@ void port_db_upgrade(port_db_t *db, char **need) {
 						array_foreach (port->all_depends, struct port **, each_depend) {
 							if (!(*each_depend)->flags & PORT_BUILD_TIME) continue;
 							if (!((*each_depend)->flags & PORT_BUILD_TIME_NEEDED)) {
-								(*each_depend)->flags |= PORT_BUILD_TIME_NEEDED;
+								port_set_flag(db, *each_depend, PORT_BUILD_TIME_NEEDED);
 								changed = 1;
 							};
 							if (!((*each_depend)->flags & PORT_FINISHED)) {
@@ -438,15 +1544,39 @@ void port_db_upgrade(port_db_t *db, char **need) {
 						};
 					};
 					if (port_ready_to_build) {
+						port_db_prefetch_wait(db, port);
+						port_db_hooks_run(db);
 						if (port_run_script(db, port, "build_package")) {
-							port->flags |= PORT_HAVE_ERROR;
+							port_set_flag(db, port, PORT_HAVE_ERROR);
 						};
 						changed = 1;
+						// what the build unblocked may come before the rest of this pass
+						break;
 					};
 				};
 
 			};
+			if (array_length(ready_ports)) port_db_get_packages(db, ready_ports);
 		};
+	};
+};
+
+void port_db_upgrade(port_db_t *db, char **need) {
+	important_check(db);
+	port_db_mark(db, need);
+	port_db_journal_start(db);
+	port_db_prefetch_start(db);
+
+	scope {
+		try port_db_process(db);
+		catch {
+			// installed packages get their hooks however the run ends
+			port_db_hooks_run(db);
+			throw_proxy();
+		};
+		port_db_prefetch_finish(db);
+		port_db_hooks_run(db);
+		port_db_journal_finish(db);
 		if (db->warning_stream) {
 			array_foreach(db->ports, struct port *, port) {
 				if (!(port->flags & PORT_ACTUAL) && !(port->flags & PORT_BUILD_TIME)) {
@@ -457,15 +1587,74 @@ void port_db_upgrade(port_db_t *db, char **need) {
 		struct pkg_list_item *pkg_list = pkg_db_list(db->root, db->pkg_db_path);
 		if (!db->root || !*db->root) {
 			struct port *port;
+			char **drop = array_new(char *, 0, ARRAY_NULL_TERMINATED);
 			array_foreach(pkg_list, struct pkg_list_item *, each_pkg) {
+				if (array_length(drop) && !strcmp(drop[array_length(drop) - 1], each_pkg->name)) continue;
 				if (!(port = port_db_get_port_by_name(db, each_pkg->name)) || (port->flags & PORT_BUILD_TIME)) {
-					if (!port_confirm || port_confirm("Drop package %s?", each_pkg->name)) {
+					if (port_test_mode) {
+						fprintf(db->warning_stream, "Test mode, not dropping %s.\n", each_pkg->name);
+					} else if (!port_confirm || port_confirm("Drop package %s?", each_pkg->name)) {
 						if (db->warning_stream) fprintf(db->warning_stream, "Remove package: %s\n", each_pkg->name);
-						pkg_drop(db->root, db->pkg_db_path, each_pkg->name, NULL, db->warning_stream);
+						array_push(drop, (char *)each_pkg->name);
+					};
+				};
+			};
+			// one pass over the package database for all of them
+			size_t profile_mark = profile_begin("drop", NULL);
+			pkg_drop_many(db->root, db->pkg_db_path, drop, db->warning_stream);
+			profile_end(profile_mark);
+		};
+	};
+};
+
+static int port_plan_pending(port_t **left, port_t *port) {
+	array_foreach(left, port_t **, each_port) {
+		if (*each_port == port) return 1;
+	};
+	return 0;
+};
+
+/* Prints the ports upgrade would process, in the order it picks them, with
+ * start and finish times of a sequential run estimated from the last run. */
+void port_db_plan(port_db_t *db, char **need, FILE *out) {
+	important_check(db);
+	port_db_mark(db, need);
+	scope {
+		port_t **left = array_new(port_t *, 0, 0);
+		array_foreach(db->order, struct port **, each_port) {
+			if (!((*each_port)->flags & PORT_MARK_TO_PROCESS) || ((*each_port)->flags & PORT_ACTUAL)) continue;
+			array_push(left, *each_port);
+		};
+		long long int now = 0, critical = array_length(left) ? left[0]->priority : 0;
+		size_t unknown = 0;
+		fprintf(out, "%10s %10s %10s  %s\n", "Start", "Finish", "Chain", "Port");
+		while (array_length(left)) {
+			size_t i, n = array_length(left);
+			for (i = 0; i < n; i++) {
+				int ready = 1;
+				array_foreach(left[i]->all_depends, struct port **, each_depend) {
+					if (port_plan_pending(left, *each_depend)) {
+						ready = 0;
+						break;
 					};
 				};
+				if (ready) break;
 			};
+			// a dependency loop, upgrade would stop there
+			if (i == n) i = 0;
+			port_t *port = left[i];
+			int known = port_stat_get(db, port, "last") != NULL;
+			if (!known) unknown++;
+			fprintf(out, "%10.1f %10.1f %10.1f  %s (%s/%s-%s)%s%s\n",
+					now / 1e6, (now + port->estimate) / 1e6, port->priority / 1e6,
+					port->path, port->name, port->version, port->build,
+					port->flags & PORT_BUILD_TIME ? " [B]" : "", known ? "" : " [no history]");
+			now += port->estimate;
+			array_delete_interval(left, i, 1);
 		};
+		fprintf(out, "Estimated finish %.1fs, longest chain %.1fs", now / 1e6, critical / 1e6);
+		if (unknown) fprintf(out, ", %zu ports without history", unknown);
+		fprintf(out, "\n");
 	};
 };
 
@@ -7,6 +7,7 @@
 #define PORT_ACTUAL 16
 #define PORT_MARK_TO_BUILD 32
 #define PORT_BUILD_TIME_NEEDED 64
+#define PORT_PREFETCH_PENDING 128
 
 int port_test_mode;
 int (*port_confirm)(const char *fmt, ...);
@@ -29,6 +30,11 @@ struct port {
 	char **build_depends;
 	struct port **all_depends;
 	short keep_old;
+	long int build_jobs;
+	long long int build_mem;
+	long long int estimate;
+	long long int priority;
+	char *input_hash;
 	long int flags;
 };
 
@@ -46,4 +52,6 @@ void port_db_unlock(port_db_t *db);
 void port_db_target_add(port_db_t *db, const char *target);
 void port_db_target_delete(port_db_t *db, const char *target);
 void port_db_upgrade(port_db_t *db, char **need);
+void port_db_resume(port_db_t *db);
+void port_db_plan(port_db_t *db, char **need, FILE *out);
 void port_db_targets_save(port_db_t *db);
@@ -9,6 +9,7 @@
 #include "pkg.h"
 #include "config.h"
 #include "main_common.h"
+#include "profile.h"
 
 static const char *root;
 static const char *port_db_path;
@@ -16,6 +17,11 @@ static const char *pkg_db_path;
 
 exception_type_t port_main_incorrect_cmd;
 
+static const struct option long_options[] = {
+	{"resume", no_argument, NULL, 'R'},
+	{NULL, 0, NULL, 0}
+};
+
 void usage(FILE *out) {
 };
 
@@ -28,13 +34,14 @@ int main(int argc, char **argv) {
 	//array_max_size = 128 * 1024;
 	int ret = EXIT_SUCCESS;
 	int opt;
+	int resume = 0;
 	kga_init();
 	set_signal_handler(SIGPIPE, SIG_IGN);
 	set_signal_handler(SIGHUP, interrupted);
 	set_signal_handler(SIGINT, interrupted);
 	set_signal_handler(SIGTERM, interrupted);
 	try_scope {
-		while ((opt = getopt(argc, argv, "r:p:ti")) != -1) {
+		while ((opt = getopt_long(argc, argv, "r:p:tiPT:", long_options, NULL)) != -1) {
 			switch(opt) {
 			case 'i':
 				port_confirm = common_confirm;
@@ -46,6 +53,18 @@ int main(int argc, char **argv) {
 			case 'p':
 				port_db_path = optarg;
 				break;
+			case 't':
+				port_test_mode = 1;
+				break;
+			case 'P':
+				profile_enable(NULL);
+				break;
+			case 'T':
+				profile_enable(optarg);
+				break;
+			case 'R':
+				resume = 1;
+				break;
 			default:
 				throw(port_main_incorrect_cmd, 1, "unknown option", NULL);
 				break;
@@ -114,6 +133,7 @@ int main(int argc, char **argv) {
 		} else if (!strcmp(real_argv[0], "upgrade")) {
 			port_db_t *db = port_db_new(root, port_db_path, pkg_db_path, stderr);
 			port_db_prepare(db);
+			if (resume) port_db_resume(db);
 			if (real_argc - 1 > 0) {
 				char *need[real_argc];
 				memcpy(need, &(real_argv[1]), (real_argc - 1) * sizeof(char *));
@@ -122,6 +142,17 @@ int main(int argc, char **argv) {
 			} else {
 				port_db_upgrade(db, NULL);
 			};
+		} else if (!strcmp(real_argv[0], "plan")) {
+			port_db_t *db = port_db_new(root, port_db_path, pkg_db_path, stderr);
+			port_db_prepare(db);
+			if (real_argc - 1 > 0) {
+				char *need[real_argc];
+				memcpy(need, &(real_argv[1]), (real_argc - 1) * sizeof(char *));
+				need[real_argc - 1] = NULL;
+				port_db_plan(db, need, stdout);
+			} else {
+				port_db_plan(db, NULL, stdout);
+			};
 		} else if (!strcmp(real_argv[0], "add") && real_argc > 1) {
 			port_db_t *db = port_db_new(root, port_db_path, pkg_db_path, stderr);
 			for (int i = 1; i < real_argc; i++)
@@ -145,5 +176,13 @@ int main(int argc, char **argv) {
 		};
 		ret = EXIT_FAILURE;
 	};
+	try {
+		profile_report(stderr);
+		profile_trace_write();
+	};
+	catch {
+		exception_print(stderr);
+		ret = EXIT_FAILURE;
+	};
 	return ret;
 };
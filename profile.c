@@ -0,0 +1,243 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <kga/kga.h>
+#include <kga/scope.h>
+#include <kga/string.h>
+#include <kga/array.h>
+#include "profile.h"
+#include "misc.h"
+#include "kga_wrappers.h"
+
+struct profile_event {
+	const char *phase;
+	const char *subject;
+	long long int start;
+	long long int duration;
+	long int parent;
+	int lane;
+};
+
+struct profile_total {
+	const char *name;
+	long long int duration;
+	size_t count;
+};
+
+static scope_pool_t *profile_pool = NULL;
+static const char *profile_trace_path = NULL;
+static struct profile_event *profile_events = NULL;
+static size_t *profile_stack = NULL;
+static char **profile_strings = NULL;
+
+void profile_enable(const char *trace_path) {
+	if (!profile_pool) {
+		profile_pool = scope_pool_new(0);
+		scope_use(profile_pool) {
+			profile_events = array_new(struct profile_event, 0, 0);
+			profile_stack = array_new(size_t, 0, 0);
+			profile_strings = array_new(char *, 0, 0);
+		};
+	};
+	profile_trace_path = trace_path;
+};
+
+int profile_enabled() {
+	return profile_pool != NULL;
+};
+
+long long int profile_now() {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts)) throw_errno();
+	return (long long int)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+};
+
+static const char *profile_intern(const char *string) {
+	if (!string) return NULL;
+	array_foreach(profile_strings, char **, each_string) {
+		if (!strcmp(*each_string, string)) return *each_string;
+	};
+	char *copy;
+	scope_use(profile_pool) {
+		copy = string_new_set(string);
+	};
+	array_push(profile_strings, copy);
+	return copy;
+};
+
+size_t profile_begin(const char *phase, const char *subject) {
+	if (!profile_pool) return 0;
+	size_t mark = array_length(profile_stack);
+	struct profile_event event;
+	event.parent = mark ? (long int)profile_stack[mark - 1] : -1;
+	event.phase = profile_intern(phase);
+	event.subject = subject ? profile_intern(subject) : (event.parent >= 0 ? profile_events[event.parent].subject : NULL);
+	event.lane = 0;
+	event.duration = -1;
+	event.start = profile_now();
+	array_push(profile_events, event);
+	array_push(profile_stack, array_length(profile_events) - 1);
+	return mark;
+};
+
+/* Closes every event opened since the matching profile_begin, including
+ * ones left open by an exception. */
+void profile_end(size_t mark) {
+	if (!profile_pool) return;
+	long long int now = profile_now();
+	for (size_t n = array_length(profile_stack); n > mark; n--) {
+		profile_events[profile_stack[n - 1]].duration = now - profile_events[profile_stack[n - 1]].start;
+		array_resize(profile_stack, n - 1);
+	};
+};
+
+void profile_event(const char *phase, const char *subject, long long int start, long long int end, int lane) {
+	if (!profile_pool) return;
+	struct profile_event event;
+	event.phase = profile_intern(phase);
+	event.subject = profile_intern(subject);
+	event.start = start;
+	event.duration = end > start ? end - start : 0;
+	// events of the main lane happen inside whatever is running now
+	event.parent = !lane && array_length(profile_stack) ? (long int)profile_stack[array_length(profile_stack) - 1] : -1;
+	event.lane = lane;
+	array_push(profile_events, event);
+};
+
+static long long int profile_parse_time(const char *string) {
+	char *end;
+	long long int value = strtoll(string, &end, 10);
+	if (end == string || *end) return -1;
+	return value;
+};
+
+/* Stage log written by build_template.sh: "begin|end <stage> <realtime ns>" per line. */
+void profile_stages_load(const char *log_path, const char *subject, int lane) {
+	if (!profile_pool) return;
+	scope {
+		char **lines = NULL;
+		try lines = file_lines(log_path);
+		catch if (!exception_type_is(exception_type_fopen_no_such_file)) throw_proxy();
+		struct timespec ts;
+		if (clock_gettime(CLOCK_REALTIME, &ts)) throw_errno();
+		long long int offset = profile_now() - ((long long int)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+		char **begin = NULL;
+		array_foreach(lines, char **, each_line) {
+			char **fields = string_split(*each_line, " ", STRING_SPLIT_WITHOUT_EMPTY);
+			if (array_length(fields) != 3) continue;
+			long long int time = profile_parse_time(fields[2]);
+			if (time < 0) continue;
+			if (!strcmp(fields[0], "begin")) {
+				begin = fields;
+			} else if (!strcmp(fields[0], "end") && begin && !strcmp(begin[1], fields[1])) {
+				profile_event(fields[1], subject, profile_parse_time(begin[2]) / 1000 + offset, time / 1000 + offset, lane);
+				begin = NULL;
+			};
+		};
+	};
+};
+
+static int profile_total_compare(const void *ptr1, const void *ptr2) {
+	const struct profile_total *total1 = ptr1;
+	const struct profile_total *total2 = ptr2;
+	if (total1->duration == total2->duration) return 0;
+	return total1->duration < total2->duration ? 1 : -1;
+};
+
+static struct profile_total *profile_total_add(struct profile_total *totals, const char *name, long long int duration) {
+	array_foreach(totals, struct profile_total *, each_total) {
+		if (each_total->name == name) {
+			each_total->duration += duration;
+			each_total->count++;
+			return totals;
+		};
+	};
+	struct profile_total total;
+	total.name = name;
+	total.duration = duration;
+	total.count = 1;
+	array_push(totals, total);
+	return totals;
+};
+
+void profile_report(FILE *stream) {
+	if (!profile_pool || !stream) return;
+	profile_end(0);
+	scope {
+		struct profile_total *phases = array_new(struct profile_total, 0, 0);
+		struct profile_total *subjects = array_new(struct profile_total, 0, 0);
+		long long int first = -1, last = -1;
+		array_foreach(profile_events, struct profile_event *, event) {
+			if (first < 0 || event->start < first) first = event->start;
+			if (event->start + event->duration > last) last = event->start + event->duration;
+			phases = profile_total_add(phases, event->phase, event->duration);
+			if (!event->subject) continue;
+			// nested events of the same subject are already counted by their parent
+			if (event->parent >= 0 && profile_events[event->parent].subject == event->subject) continue;
+			subjects = profile_total_add(subjects, event->subject, event->duration);
+		};
+		array_sort(phases, profile_total_compare);
+		array_sort(subjects, profile_total_compare);
+		fprintf(stream, "Profile, wall time %.3fs\n", first < 0 ? 0.0 : (last - first) / 1e6);
+		fprintf(stream, "%-32s %8s %12s\n", "Phase", "Count", "Seconds");
+		array_foreach(phases, struct profile_total *, each_phase) {
+			fprintf(stream, "%-32s %8zu %12.3f\n", each_phase->name, each_phase->count, each_phase->duration / 1e6);
+		};
+		fprintf(stream, "%-32s %8s %12s  %s\n", "Port", "Events", "Seconds", "Phases");
+		array_foreach(subjects, struct profile_total *, each_subject) {
+			fprintf(stream, "%-32s %8zu %12.3f ", each_subject->name, each_subject->count, each_subject->duration / 1e6);
+			struct profile_total *subject_phases = array_new(struct profile_total, 0, 0);
+			array_foreach(profile_events, struct profile_event *, event) {
+				if (event->subject != each_subject->name) continue;
+				subject_phases = profile_total_add(subject_phases, event->phase, event->duration);
+			};
+			array_sort(subject_phases, profile_total_compare);
+			array_foreach(subject_phases, struct profile_total *, each_phase) {
+				fprintf(stream, " %s=%.3f", each_phase->name, each_phase->duration / 1e6);
+			};
+			fprintf(stream, "\n");
+		};
+	};
+};
+
+static void profile_json_string(FILE *file, const char *string) {
+	kga_fprintf(file, "\"");
+	for (const char *c = string; c && *c; c++) {
+		if (*c == '"' || *c == '\\') {
+			kga_fprintf(file, "\\%c", *c);
+		} else if ((unsigned char)*c < 0x20) {
+			kga_fprintf(file, "\\u%04x", (unsigned char)*c);
+		} else {
+			kga_fprintf(file, "%c", *c);
+		};
+	};
+	kga_fprintf(file, "\"");
+};
+
+/* Chrome trace-event format, loadable by chrome://tracing or Perfetto. */
+void profile_trace_write() {
+	if (!profile_pool || !profile_trace_path) return;
+	profile_end(0);
+	scope {
+		FILE *file = kga_fopen(profile_trace_path, "w");
+		int max_lane = 0;
+		kga_fprintf(file, "{\"traceEvents\":[\n");
+		array_foreach(profile_events, struct profile_event *, event) {
+			if (event->lane > max_lane) max_lane = event->lane;
+			kga_fprintf(file, "{\"name\":");
+			profile_json_string(file, event->phase);
+			kga_fprintf(file, ",\"cat\":");
+			profile_json_string(file, event->subject ? event->subject : "");
+			kga_fprintf(file, ",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":1,\"tid\":%i,\"args\":{\"port\":",
+					event->start, event->duration, event->lane);
+			profile_json_string(file, event->subject ? event->subject : "");
+			kga_fprintf(file, "}},\n");
+		};
+		kga_fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"main\"}}");
+		for (int lane = 1; lane <= max_lane; lane++) {
+			kga_fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%i,\"args\":{\"name\":\"prefetch %i\"}}", lane, lane);
+		};
+		kga_fprintf(file, "\n]}\n");
+	};
+};
@@ -0,0 +1,15 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <stdio.h>
+
+void profile_enable(const char *trace_path);
+int profile_enabled();
+long long int profile_now();
+size_t profile_begin(const char *phase, const char *subject);
+void profile_end(size_t mark);
+void profile_event(const char *phase, const char *subject, long long int start, long long int end, int lane);
+void profile_stages_load(const char *log_path, const char *subject, int lane);
+void profile_report(FILE *stream);
+void profile_trace_write();
+#endif
@@ -2,11 +2,13 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <kga/kga.h>
 #include <kga/string.h>
+#include <kga/array.h>
 #include "shell.h"
 #include "kga_wrappers.h"
 
@@ -118,3 +120,234 @@ void shell_process_file(shell_t *shell, const char *file_path) {
 	catch throw_proxy();
 };
 
+
+/* In-process evaluation of scripts made only of assignments, comments and
+ * function definitions, which is what most build.sh files are. Values may use
+ * quotes and $NAME or ${NAME}, anything else makes the script not declarative
+ * and it has to go to the shell. */
+
+struct shell_parser {
+	const char *c;
+	struct shell_var **vars;
+	char *(*lookup)(void *data, const char *name);
+	void *data;
+};
+
+static int shell_is_name_start(char c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+};
+
+static int shell_is_name(char c) {
+	return shell_is_name_start(c) || (c >= '0' && c <= '9');
+};
+
+static char *shell_var_lookup(struct shell_parser *parser, const char *name) {
+	array_foreach_reverse(*parser->vars, struct shell_var *, each_var) {
+		if (!strcmp(each_var->name, name)) return each_var->value;
+	};
+	return parser->lookup ? parser->lookup(parser->data, name) : "";
+};
+
+static void shell_var_set(struct shell_parser *parser, const char *name, const char *value) {
+	array_foreach(*parser->vars, struct shell_var *, each_var) {
+		if (!strcmp(each_var->name, name)) {
+			string_set(each_var->value, value);
+			return;
+		};
+	};
+	struct shell_var var = {string_new_set(name), string_new_set(value)};
+	array_push(*parser->vars, var);
+};
+
+/* $NAME or ${NAME} at parser->c, appended to value. */
+static int shell_parse_expansion(struct shell_parser *parser, char **value) {
+	int braced = parser->c[1] == '{';
+	const char *start = parser->c + (braced ? 2 : 1);
+	const char *end = start;
+	if (!shell_is_name_start(*end)) {
+		if (braced) return 0;
+		// a lone $ stays as it is, $1, $$, $( and friends need the shell
+		if (*end && !strchr(" \t\n\";", *end)) return 0;
+		string_push(*value, '$');
+		parser->c++;
+		return 1;
+	};
+	while (shell_is_name(*end)) end++;
+	if (braced && *end != '}') return 0;
+	char name[end - start + 1];
+	memcpy(name, start, end - start);
+	name[end - start] = '\0';
+	string_cat(*value, shell_var_lookup(parser, name));
+	parser->c = end + (braced ? 1 : 0);
+	return 1;
+};
+
+static int shell_parse_word(struct shell_parser *parser, char **value) {
+	for (;;) {
+		switch (*parser->c) {
+		case '\0': case ' ': case '\t': case '\n': case ';':
+			return 1;
+		case '\'': {
+			const char *end = strchr(parser->c + 1, '\'');
+			if (!end) return 0;
+			for (const char *c = parser->c + 1; c < end; c++) string_push(*value, *c);
+			parser->c = end + 1;
+			break;
+		};
+		case '"':
+			for (parser->c++; *parser->c != '"'; ) {
+				if (!*parser->c || *parser->c == '`') return 0;
+				if (*parser->c == '\\' && parser->c[1] && strchr("$`\"\\\n", parser->c[1])) {
+					if (parser->c[1] != '\n') string_push(*value, parser->c[1]);
+					parser->c += 2;
+				} else if (*parser->c == '$') {
+					if (!shell_parse_expansion(parser, value)) return 0;
+				} else {
+					string_push(*value, *parser->c);
+					parser->c++;
+				};
+			};
+			parser->c++;
+			break;
+		case '$':
+			if (!shell_parse_expansion(parser, value)) return 0;
+			break;
+		case '\\': case '`': case '|': case '&': case '<': case '>': case '(': case ')': case '~': case '{': case '}':
+			return 0;
+		default:
+			string_push(*value, *parser->c);
+			parser->c++;
+			break;
+		};
+	};
+};
+
+/* name() { ... }, the body skipped up to the } that closes it. Quotes, escapes
+ * and comments are stepped over and every other brace has to pair up; a } in
+ * command position must be the one closing the function. Anything the count
+ * cannot follow, here-documents included, leaves the script to the shell
+ * rather than losing what comes after the function. */
+static int shell_skip_function(struct shell_parser *parser) {
+	parser->c += 2;
+	while (*parser->c == ' ' || *parser->c == '\t' || *parser->c == '\n') parser->c++;
+	if (*parser->c != '{') return 0;
+	parser->c++;
+	int depth = 1;
+	// at the start of a command, where } is the reserved word
+	int command = 0;
+	// at the start of a word, where # begins a comment
+	int word = 1;
+	for (;;) {
+		char c = *parser->c;
+		switch (c) {
+		case '\0':
+			return 0;
+		case '\n': case ';': case '&': case '|':
+			command = 1;
+			word = 1;
+			parser->c++;
+			continue;
+		case ' ': case '\t':
+			word = 1;
+			parser->c++;
+			continue;
+		case '#':
+			if (word) {
+				while (*parser->c && *parser->c != '\n') parser->c++;
+				continue;
+			};
+			break;
+		case '\\':
+			if (!parser->c[1]) return 0;
+			parser->c++;
+			break;
+		case '\'': {
+			const char *end = strchr(parser->c + 1, '\'');
+			if (!end) return 0;
+			parser->c = end;
+			break;
+		};
+		case '"':
+			for (parser->c++; *parser->c != '"'; parser->c++) {
+				if (!*parser->c) return 0;
+				if (*parser->c == '\\' && parser->c[1]) parser->c++;
+			};
+			break;
+		case '<':
+			if (parser->c[1] == '<') return 0;
+			break;
+		case '{':
+			depth++;
+			break;
+		case '}':
+			if (--depth < 0) return 0;
+			if (!depth) {
+				const char *next = parser->c + 1;
+				if (!command || (*next && !strchr(" \t\n;", *next))) return 0;
+				parser->c = next;
+				return 1;
+			};
+			break;
+		};
+		// ${ and a group's { alike, a } right after either is wrong anyway
+		command = c == '{' || c == '(';
+		word = c == '(';
+		parser->c++;
+	};
+};
+
+static int shell_parse(struct shell_parser *parser) {
+	for (;;) {
+		while (*parser->c == ' ' || *parser->c == '\t' || *parser->c == '\n' || *parser->c == ';') parser->c++;
+		if (!*parser->c) return 1;
+		if (*parser->c == '#') {
+			while (*parser->c && *parser->c != '\n') parser->c++;
+			continue;
+		};
+		if (!shell_is_name_start(*parser->c)) return 0;
+		const char *start = parser->c;
+		while (shell_is_name(*parser->c)) parser->c++;
+		char name[parser->c - start + 1];
+		memcpy(name, start, parser->c - start);
+		name[parser->c - start] = '\0';
+		if (*parser->c == '=') {
+			parser->c++;
+			char *value = string_new();
+			if (!shell_parse_word(parser, &value)) return 0;
+			// A=1 command runs a command
+			while (*parser->c == ' ' || *parser->c == '\t') parser->c++;
+			if (*parser->c && *parser->c != '\n' && *parser->c != ';' && *parser->c != '#') return 0;
+			shell_var_set(parser, name, value);
+			continue;
+		};
+		while (*parser->c == ' ' || *parser->c == '\t') parser->c++;
+		if (parser->c[0] != '(' || parser->c[1] != ')') return 0;
+		if (!shell_skip_function(parser)) return 0;
+	};
+};
+
+/* Evaluates the script at path on top of vars, 0 if it is not declarative. A
+ * missing script sets nothing, like . of the shell behind test -f. Names not
+ * set by vars or the script come from lookup. */
+int shell_parse_declarative(const char *path, struct shell_var **vars, char *(*lookup)(void *data, const char *name), void *data) {
+	int declarative = 0;
+	char *script = string_new();
+	scope {
+		FILE *file = NULL;
+		try file = kga_fopen(path, "r");
+		catch if (!exception_type_is(exception_type_fopen_no_such_file)) throw_proxy();
+		if (file) {
+			char buffer[4096];
+			for (size_t readed; (readed = kga_fread(buffer, 1, sizeof(buffer) - 1, file)) > 0; ) {
+				buffer[readed] = '\0';
+				string_cat(script, buffer);
+			};
+		};
+	};
+	// NUL bytes would cut the script short
+	if (string_length(script) == strlen(script)) {
+		struct shell_parser parser = {script, vars, lookup, data};
+		declarative = shell_parse(&parser);
+	};
+	return declarative;
+};
@@ -1,3 +1,5 @@
+#ifndef _SHELL_H_
+#define _SHELL_H_
 struct shell;
 typedef struct shell shell_t;
 
@@ -6,4 +8,12 @@ void shell_process_file(shell_t *shell, const char *path);
 void shell_process(shell_t *shell, const char *cmd);
 char *shell_get_var(shell_t *shell, const char *name);
 
+struct shell_var {
+	char *name;
+	char *value;
+};
+
+int shell_parse_declarative(const char *path, struct shell_var **vars, char *(*lookup)(void *data, const char *name), void *data);
+
 exception_type_t shell_exception_process_died;
+#endif